@@ -98,7 +98,10 @@
 #include <utility>    // for pair
 #include <stdexcept>  // For length_error
 #include <type_traits>
+#include <vector>
 #include <sparsehash/internal/hashtable-common.h>
+#include <sparsehash/internal/hashtable-parallel.h>
+#include <sparsehash/internal/hashtable-snapshot.h>
 #include <sparsehash/internal/libc_allocator_with_realloc.h>
 
 namespace google {
@@ -125,27 +128,32 @@ namespace google {
 // EqualKey: Given two Keys, says whether they are the same (that is,
 //           if they are both associated with the same Value).
 // Alloc: STL allocator to use to allocate memory.
+// Stats: no_stats, or count_stats to count lookups, probes and resizes
+//        for stats() (see hashtable-common.h).
 
 template <class Value, class Key, class HashFcn, class ExtractKey, class SetKey,
-          class EqualKey, class Alloc>
+          class EqualKey, class Alloc, class Stats = no_stats>
 class dense_hashtable;
 
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
 struct dense_hashtable_iterator;
 
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
 struct dense_hashtable_const_iterator;
 
 // We're just an array, but we need to skip over empty and deleted elements
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
 struct dense_hashtable_iterator {
  private:
   using value_alloc_type =
       typename std::allocator_traits<A>::template rebind_alloc<V>;
 
  public:
-  typedef dense_hashtable_iterator<V, K, HF, ExK, SetK, EqK, A> iterator;
-  typedef dense_hashtable_const_iterator<V, K, HF, ExK, SetK, EqK, A>
+  typedef dense_hashtable_iterator<V, K, HF, ExK, SetK, EqK, A, St> iterator;
+  typedef dense_hashtable_const_iterator<V, K, HF, ExK, SetK, EqK, A, St>
       const_iterator;
 
   typedef std::forward_iterator_tag iterator_category;  // very little defined!
@@ -157,7 +165,7 @@ struct dense_hashtable_iterator {
 
   // "Real" constructor and default constructor
   dense_hashtable_iterator(
-      const dense_hashtable<V, K, HF, ExK, SetK, EqK, A>* h, pointer it,
+      dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>* h, pointer it,
       pointer it_end, bool advance)
       : ht(h), pos(it), end(it_end) {
     if (advance) advance_past_empty_and_deleted();
@@ -173,8 +181,8 @@ struct dense_hashtable_iterator {
   // Arithmetic.  The only hard part is making sure that
   // we're not on an empty or marked-deleted array element
   void advance_past_empty_and_deleted() {
-    while (pos != end && (ht->test_empty(*this) || ht->test_deleted(*this)))
-      ++pos;
+    pos = ht->skip_unoccupied(pos, end);
+    if (pos != end) ht->before_write_at(pos);  // we may change *pos
   }
   iterator& operator++() {
     assert(pos != end);
@@ -193,20 +201,21 @@ struct dense_hashtable_iterator {
   bool operator!=(const iterator& it) const { return pos != it.pos; }
 
   // The actual data
-  const dense_hashtable<V, K, HF, ExK, SetK, EqK, A>* ht;
+  dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>* ht;
   pointer pos, end;
 };
 
 // Now do it all again, but with const-ness!
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
 struct dense_hashtable_const_iterator {
  private:
   using value_alloc_type =
       typename std::allocator_traits<A>::template rebind_alloc<V>;
 
  public:
-  typedef dense_hashtable_iterator<V, K, HF, ExK, SetK, EqK, A> iterator;
-  typedef dense_hashtable_const_iterator<V, K, HF, ExK, SetK, EqK, A>
+  typedef dense_hashtable_iterator<V, K, HF, ExK, SetK, EqK, A, St> iterator;
+  typedef dense_hashtable_const_iterator<V, K, HF, ExK, SetK, EqK, A, St>
       const_iterator;
 
   typedef std::forward_iterator_tag iterator_category;  // very little defined!
@@ -218,7 +227,7 @@ struct dense_hashtable_const_iterator {
 
   // "Real" constructor and default constructor
   dense_hashtable_const_iterator(
-      const dense_hashtable<V, K, HF, ExK, SetK, EqK, A>* h, pointer it,
+      const dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>* h, pointer it,
       pointer it_end, bool advance)
       : ht(h), pos(it), end(it_end) {
     if (advance) advance_past_empty_and_deleted();
@@ -237,8 +246,7 @@ struct dense_hashtable_const_iterator {
   // Arithmetic.  The only hard part is making sure that
   // we're not on an empty or marked-deleted array element
   void advance_past_empty_and_deleted() {
-    while (pos != end && (ht->test_empty(*this) || ht->test_deleted(*this)))
-      ++pos;
+    pos = ht->skip_unoccupied(pos, end);
   }
   const_iterator& operator++() {
     assert(pos != end);
@@ -257,16 +265,18 @@ struct dense_hashtable_const_iterator {
   bool operator!=(const const_iterator& it) const { return pos != it.pos; }
 
   // The actual data
-  const dense_hashtable<V, K, HF, ExK, SetK, EqK, A>* ht;
+  const dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>* ht;
   pointer pos, end;
 };
 
 template <class Value, class Key, class HashFcn, class ExtractKey, class SetKey,
-          class EqualKey, class Alloc>
+          class EqualKey, class Alloc, class Stats>
 class dense_hashtable {
  private:
   using value_alloc_type =
       typename std::allocator_traits<Alloc>::template rebind_alloc<Value>;
+  using occupied_alloc_type =
+      typename std::allocator_traits<Alloc>::template rebind_alloc<uint64_t>;
 
  public:
   typedef Key key_type;
@@ -282,10 +292,11 @@ class dense_hashtable {
   typedef typename value_alloc_type::pointer pointer;
   typedef typename value_alloc_type::const_pointer const_pointer;
   typedef dense_hashtable_iterator<Value, Key, HashFcn, ExtractKey, SetKey,
-                                   EqualKey, Alloc> iterator;
+                                   EqualKey, Alloc, Stats> iterator;
 
-  typedef dense_hashtable_const_iterator<
-      Value, Key, HashFcn, ExtractKey, SetKey, EqualKey, Alloc> const_iterator;
+  typedef dense_hashtable_const_iterator<Value, Key, HashFcn, ExtractKey,
+                                         SetKey, EqualKey, Alloc, Stats>
+      const_iterator;
 
   // These come from tr1.  For us they're the same as regular iterators.
   typedef iterator local_iterator;
@@ -313,7 +324,12 @@ class dense_hashtable {
   static const size_type HT_DEFAULT_STARTING_BUCKETS = 32;
 
   // ITERATOR FUNCTIONS
-  iterator begin() { return iterator(this, table, table + num_buckets, true); }
+  // A non-const iterator can change any element it reaches, so while a
+  // snapshot is being written, each page is copied aside as an iterator
+  // gets to it (see before_write_at()).
+  iterator begin() {
+    return iterator(this, table, table + num_buckets, true);
+  }
   iterator end() {
     return iterator(this, table + num_buckets, table + num_buckets, true);
   }
@@ -327,6 +343,7 @@ class dense_hashtable {
   // These come from tr1 unordered_map.  They iterate over 'bucket' n.
   // We'll just consider bucket n to be the n-th element of the table.
   local_iterator begin(size_type i) {
+    before_write(i);
     return local_iterator(this, table + i, table + i + 1, false);
   }
   local_iterator end(size_type i) {
@@ -343,6 +360,94 @@ class dense_hashtable {
     return it;
   }
 
+  // RANGE ITERATION
+  // Iterates over the elements in buckets [first, last).  Unlike the
+  // tr1 begin(i)/end(i), the ranges for disjoint bucket intervals can be
+  // walked at the same time from different threads, so a scan over the
+  // whole table can be split up: see for_each_parallel() below.
+  std::pair<iterator, iterator> bucket_range(size_type first,
+                                             size_type last) {
+    assert(first <= last && last <= num_buckets);
+    before_write_range(first, last);
+    return std::pair<iterator, iterator>(
+        iterator(this, table + first, table + last, true),
+        iterator(this, table + last, table + last, true));
+  }
+  std::pair<const_iterator, const_iterator> bucket_range(
+      size_type first, size_type last) const {
+    assert(first <= last && last <= num_buckets);
+    return std::pair<const_iterator, const_iterator>(
+        const_iterator(this, table + first, table + last, true),
+        const_iterator(this, table + last, table + last, true));
+  }
+
+  // Calls fn(value) for every element, splitting the buckets between up
+  // to num_threads threads (0 means one per hardware thread).  fn is
+  // called concurrently, and in no particular order.  The table itself
+  // mustn't change while this runs, though fn may modify the non-key
+  // part of the value it's handed.
+  template <class Fn>
+  void for_each_parallel(Fn fn, size_type num_threads = 0) {
+    if (size() == 0) return;
+    before_write_all();
+    sparsehash_internal::for_each_in_pieces(
+        num_buckets, num_threads,
+        [this](size_type first, size_type last) {
+          return bucket_range(first, last);
+        },
+        fn);
+  }
+  template <class Fn>
+  void for_each_parallel(Fn fn, size_type num_threads = 0) const {
+    if (size() == 0) return;
+    sparsehash_internal::for_each_in_pieces(
+        num_buckets, num_threads,
+        [this](size_type first, size_type last) {
+          return bucket_range(first, last);
+        },
+        fn);
+  }
+
+  // Returns combine(...combine(combine(init, map(v1)), map(v2))..., map(vn))
+  // over all elements, computed in pieces on up to num_threads threads.
+  // combine must be associative; map and combine are called concurrently.
+  template <class T, class Map, class Combine>
+  T reduce_parallel(T init, Map map, Combine combine,
+                    size_type num_threads = 0) const {
+    if (size() == 0) return init;
+    return sparsehash_internal::reduce_in_pieces(
+        num_buckets, num_threads,
+        [this](size_type first, size_type last) {
+          return bucket_range(first, last);
+        },
+        init, map, combine);
+  }
+
+  // Calls fn(value) for every element, in bucket order.  This is the
+  // quickest way to look at everything: there's no iterator to keep up,
+  // and we go straight from one occupied bucket to the next.  fn may
+  // modify the non-key part of the value, but mustn't insert or erase.
+  template <class Fn>
+  void for_each(Fn fn) {
+    if (size() == 0) return;
+    before_write_all();
+    for (size_type w = 0; w < occupied.size(); ++w) {
+      for (uint64_t word = occupied[w]; word != 0; word &= word - 1) {
+        fn(table[w * 64 + sparsehash_internal::count_trailing_zeros(word)]);
+      }
+    }
+  }
+  template <class Fn>
+  void for_each(Fn fn) const {
+    if (size() == 0) return;
+    for (size_type w = 0; w < occupied.size(); ++w) {
+      for (uint64_t word = occupied[w]; word != 0; word &= word - 1) {
+        fn(static_cast<const_reference>(
+            table[w * 64 + sparsehash_internal::count_trailing_zeros(word)]));
+      }
+    }
+  }
+
   // ACCESSOR FUNCTIONS for the things we templatize on, basically
   hasher hash_funct() const { return settings; }
   key_equal key_eq() const { return key_info; }
@@ -351,6 +456,34 @@ class dense_hashtable {
   // Accessor function for statistics gathering.
   int num_table_copies() const { return settings.num_ht_copies(); }
 
+  // What the Stats policy has counted; all zeros under no_stats.
+  hashtable_stats stats() const { return settings.stats(); }
+
+  // Walks the whole table to see how well it's holding up; see
+  // hashtable_analysis.  Takes time linear in bucket_count().
+  hashtable_analysis analyze() const {
+    sparsehash_internal::table_analyzer analyzer(bucket_count());
+    if (!table) return analyzer.finish();  // no empty key yet: no entries
+    const size_type bucket_count_minus_one = bucket_count() - 1;
+    for (size_type bucknum = 0; bucknum < bucket_count(); ++bucknum) {
+      if (test_empty(bucknum)) {
+        analyzer.empty();
+      } else if (test_deleted(bucknum)) {
+        analyzer.deleted(bucknum);
+      } else {
+        const size_type home =
+            hash(get_key(table[bucknum])) & bucket_count_minus_one;
+        size_type num_probes = 0;  // retrace find_position()'s steps
+        for (size_type pos = home; pos != bucknum;
+             pos = (pos + JUMP_(key, num_probes)) & bucket_count_minus_one) {
+          ++num_probes;
+        }
+        analyzer.entry(home, num_probes);
+      }
+    }
+    return analyzer.finish();
+  }
+
  private:
   // Annoyingly, we can't copy values around, because they might have
   // const components (they're probably pair<const X, Y>).  We use
@@ -366,6 +499,76 @@ class dense_hashtable {
     for (; first != last; ++first) table[first].~value_type();
   }
 
+  // OCCUPANCY BITMAP
+  // occupied has one bit per bucket, set when the bucket holds an
+  // element (so it's neither empty nor deleted).  Every routine that
+  // changes what a bucket holds keeps it up to date, which lets
+  // iteration skip 64 free buckets per word instead of comparing each
+  // one's key against the empty and deleted keys.
+  bool test_occupied(size_type bucknum) const {
+    return (occupied[bucknum / 64] >> (bucknum % 64)) & 1;
+  }
+  void set_occupied(size_type bucknum) {
+    occupied[bucknum / 64] |= uint64_t(1) << (bucknum % 64);
+  }
+  void clear_occupied(size_type bucknum) {
+    occupied[bucknum / 64] &= ~(uint64_t(1) << (bucknum % 64));
+  }
+  void reset_occupied(size_type new_num_buckets) {
+    occupied.assign((new_num_buckets + 63) / 64, 0);
+  }
+
+  // COPY-ON-WRITE
+  // While write_snapshot() runs, every change to the table is preceded
+  // by one of these, so the page holding the buckets about to change is
+  // copied aside if it hasn't been written yet.  Without a snapshot
+  // they cost a test of a NULL pointer.
+  void before_write(size_type bucknum) {
+    if (snapshot_state) before_write_range(bucknum, bucknum + 1);
+  }
+  void before_write_range(size_type first, size_type last) {
+    if (!snapshot_state || first == last) return;
+    for (size_t page = first / SNAPSHOT_CHUNK_BUCKETS;
+         page <= (last - 1) / SNAPSHOT_CHUNK_BUCKETS; ++page) {
+      snapshot_state->before_write(page, [this, page]() {
+        return save_snapshot_page(
+            page, std::is_copy_constructible<value_type>());
+      });
+    }
+  }
+  void before_write_all() {
+    if (snapshot_state) before_write_range(0, num_buckets);
+  }
+
+ public:
+  // Used by the non-const iterators before they stop at pos.  A loop
+  // over the table copies pages one at a time as it reaches them, and
+  // none that the snapshot has already written.
+  void before_write_at(const_pointer pos) {
+    before_write(static_cast<size_type>(pos - table));
+  }
+
+  // Used by the iterators: the first position in [pos, last) that holds
+  // an element, or last if there is none.
+  template <class Pointer>
+  Pointer skip_unoccupied(Pointer pos, Pointer last) const {
+    if (pos == last || num_elements == num_deleted) return last;
+    const size_type first_bucknum = static_cast<size_type>(pos - table);
+    const size_type last_bucknum = static_cast<size_type>(last - table);
+    size_type bucknum = first_bucknum;
+    while (bucknum < last_bucknum) {
+      const uint64_t word = occupied[bucknum / 64] >> (bucknum % 64);
+      if (word != 0) {
+        bucknum += sparsehash_internal::count_trailing_zeros(word);
+        break;
+      }
+      bucknum = (bucknum | 63) + 1;  // on to the next word
+    }
+    return bucknum < last_bucknum ? pos + (bucknum - first_bucknum) : last;
+  }
+
+ private:
+
   // DELETE HELPER FUNCTIONS
   // This lets the user describe a key that will indicate deleted
   // table entries.  This key should be an "impossible" entry --
@@ -438,7 +641,9 @@ class dense_hashtable {
   // Set it so test_deleted is true.  true if object didn't used to be deleted.
   bool set_deleted(iterator& it) {
     check_use_deleted("set_deleted()");
+    before_write(static_cast<size_type>(it.pos - table));
     bool retval = !test_deleted(it);
+    clear_occupied(static_cast<size_type>(it.pos - table));
     // &* converts from iterator to value-type.
     set_key(&(*it), key_info.delkey);
     return retval;
@@ -457,7 +662,9 @@ class dense_hashtable {
   // really matter.
   bool set_deleted(const_iterator& it) {
     check_use_deleted("set_deleted()");
+    before_write(static_cast<size_type>(it.pos - table));
     bool retval = !test_deleted(it);
+    clear_occupied(static_cast<size_type>(it.pos - table));
     set_key(const_cast<pointer>(&(*it)), key_info.delkey);
     return retval;
   }
@@ -515,6 +722,7 @@ class dense_hashtable {
     table = val_info.allocate(num_buckets);
     assert(table);
     fill_range_with_empty(table, num_buckets);
+    reset_occupied(num_buckets);
   }
   key_type empty_key() const {
     assert(settings.use_empty());
@@ -563,8 +771,11 @@ class dense_hashtable {
              num_remain < sz * shrink_factor) {
         sz /= 2;  // stay a power of 2
       }
+      const size_type old_buckets = bucket_count();
+      settings.begin_rehash();
       dense_hashtable tmp(std::move(*this), sz);  // Do the actual resizing
       swap(tmp);                       // now we are tmp
+      settings.end_rehash(old_buckets, bucket_count());
       retval = true;
     }
     settings.set_consider_shrink(false);  // because we just considered it
@@ -622,8 +833,11 @@ class dense_hashtable {
         resize_to *= 2;
       }
     }
+    const size_type old_buckets = bucket_count();
+    settings.begin_rehash();
     dense_hashtable tmp(std::move(*this), resize_to);
     swap(tmp);  // now we are tmp
+    settings.end_rehash(old_buckets, bucket_count());
     return true;
   }
 
@@ -664,6 +878,7 @@ class dense_hashtable {
       using value_t = typename std::conditional<will_move::value, value_type&&, const_reference>::type;
 
       set_value(&table[bucknum], std::forward<value_t>(value));
+      set_occupied(bucknum);
       num_elements++;
     }
     settings.inc_num_ht_copies();
@@ -710,7 +925,8 @@ class dense_hashtable {
                         ? HT_DEFAULT_STARTING_BUCKETS
                         : settings.min_buckets(expected_max_items_in_table, 0)),
         val_info(alloc_impl<value_alloc_type>(alloc)),
-        table(NULL) {
+        table(NULL),
+        occupied(occupied_alloc_type(val_info)) {
     // table is NULL until emptyval is set.  However, we set num_buckets
     // here so we know how much space to allocate once emptyval is set
     settings.reset_thresholds(bucket_count());
@@ -726,7 +942,8 @@ class dense_hashtable {
         num_elements(0),
         num_buckets(0),
         val_info(ht.val_info),
-        table(NULL) {
+        table(NULL),
+        occupied(occupied_alloc_type(val_info)) {
     if (!ht.settings.use_empty()) {
       // If use_empty isn't set, copy_from will crash, so we do our own copying.
       assert(ht.empty());
@@ -751,7 +968,8 @@ class dense_hashtable {
         num_elements(0),
         num_buckets(0),
         val_info(std::move(ht.val_info)),
-        table(NULL) {
+        table(NULL),
+        occupied(occupied_alloc_type(val_info)) {
     if (!ht.settings.use_empty()) {
       // If use_empty isn't set, copy_or_move_from will crash, so we do our own copying.
       assert(ht.empty());
@@ -760,6 +978,7 @@ class dense_hashtable {
       return;
     }
     settings.reset_thresholds(bucket_count());
+    ht.before_write_all();  // a rebuild empties every page of ht at once
     copy_or_move_from(std::move(ht), min_buckets_wanted);  // copy_or_move_from() ignores deleted entries
   }
 
@@ -793,13 +1012,18 @@ class dense_hashtable {
   }
 
   // Many STL algorithms use swap instead of copy constructors
+  // A snapshot being written stays with its table, and gets a copy of
+  // whatever it still needs first.
   void swap(dense_hashtable& ht) {
+    before_write_all();
+    ht.before_write_all();
     std::swap(settings, ht.settings);
     std::swap(key_info, ht.key_info);
     std::swap(num_deleted, ht.num_deleted);
     std::swap(num_elements, ht.num_elements);
     std::swap(num_buckets, ht.num_buckets);
     std::swap(table, ht.table);
+    occupied.swap(ht.occupied);
     settings.reset_thresholds(bucket_count());  // also resets consider_shrink
     ht.settings.reset_thresholds(ht.bucket_count());
     // we purposefully don't swap the allocator, which may not be swap-able
@@ -807,6 +1031,7 @@ class dense_hashtable {
 
  private:
   void clear_to_size(size_type new_num_buckets) {
+    before_write_all();
     if (!table) {
       table = val_info.allocate(new_num_buckets);
     } else {
@@ -821,6 +1046,7 @@ class dense_hashtable {
     }
     assert(table);
     fill_range_with_empty(table, new_num_buckets);
+    reset_occupied(new_num_buckets);
     num_elements = 0;
     num_deleted = 0;
     num_buckets = new_num_buckets;  // our new size
@@ -845,8 +1071,10 @@ class dense_hashtable {
   void clear_no_resize() {
     if (num_elements > 0) {
       assert(table);
+      before_write_all();
       destroy_buckets(0, num_buckets);
       fill_range_with_empty(table, num_buckets);
+      reset_occupied(num_buckets);
     }
     // don't consider to shrink before another erase()
     settings.reset_thresholds(bucket_count());
@@ -868,6 +1096,7 @@ class dense_hashtable {
     size_type insert_pos = ILLEGAL_BUCKET;  // where we would insert
     while (1) {                             // probe until something happens
       if (test_empty(bucknum)) {            // bucket is empty
+        settings.count_lookup(num_probes, false);
         if (insert_pos == ILLEGAL_BUCKET)   // found no prior place to insert
           return std::pair<size_type, size_type>(ILLEGAL_BUCKET, bucknum);
         else
@@ -877,6 +1106,7 @@ class dense_hashtable {
         if (insert_pos == ILLEGAL_BUCKET) insert_pos = bucknum;
 
       } else if (equals(key, get_key(table[bucknum]))) {
+        settings.count_lookup(num_probes, true);
         return std::pair<size_type, size_type>(bucknum, ILLEGAL_BUCKET);
       }
       ++num_probes;  // we're doing another probe
@@ -892,8 +1122,8 @@ class dense_hashtable {
     std::pair<size_type, size_type> pos = find_position(key);
     if (pos.first == ILLEGAL_BUCKET)  // alas, not there
       return end();
-    else
-      return iterator(this, table + pos.first, table + num_buckets, false);
+    before_write(pos.first);  // the caller may change the value
+    return iterator(this, table + pos.first, table + num_buckets, false);
   }
 
   const_iterator find(const key_type& key) const {
@@ -954,10 +1184,13 @@ class dense_hashtable {
       clear_deleted(delpos);
       assert(num_deleted > 0);
       --num_deleted;  // used to be, now it isn't
+      settings.count_deleted_reused();
     } else {
       ++num_elements;  // replacing an empty bucket
     }
+    before_write(pos);
     set_value(&table[pos], std::forward<Args>(args)...);
+    set_occupied(pos);
     return iterator(this, table + pos, table + num_buckets, false);
   }
 
@@ -971,6 +1204,7 @@ class dense_hashtable {
 
     const std::pair<size_type, size_type> pos = find_position(key);
     if (pos.first != ILLEGAL_BUCKET) {  // object was already there
+      before_write(pos.first);
       return std::pair<iterator, bool>(
           iterator(this, table + pos.first, table + num_buckets, false),
           false);  // false: we didn't insert
@@ -1019,6 +1253,7 @@ class dense_hashtable {
     resize_delta(1);
 
     if (equals(key, hint->first)) {
+        before_write(static_cast<size_type>(hint.pos - table));
         return {iterator(this, const_cast<pointer>(hint.pos), const_cast<pointer>(hint.end), false), false};
     }
 
@@ -1034,6 +1269,139 @@ class dense_hashtable {
            typename std::iterator_traits<InputIterator>::iterator_category());
   }
 
+  // BULK LOADING
+  // Inserts [f, l) using up to num_threads threads (0 means one per
+  // hardware thread).  We size the table for everything up front, hash
+  // the input in parallel, and partition it by the high bits of each
+  // value's home bucket, so every thread fills its own contiguous range
+  // of buckets.  A value whose probe sequence would leave its range is
+  // set aside and inserted serially at the end.  policy says which
+  // value wins when keys repeat; with KeepFirst the result is the same
+  // as insert(f, l).  The hasher, key_equal and value_type's copy
+  // constructor are called concurrently.  Iterators that aren't
+  // random-access just get a serial insert.
+  template <class InputIterator>
+  void build_from(InputIterator f, InputIterator l, size_type num_threads,
+                  DuplicateKeyPolicy policy = KeepFirst) {
+    build_from(f, l, num_threads, policy,
+               typename std::iterator_traits<InputIterator>::iterator_category());
+  }
+
+ private:
+  // Used by build_from() for the values it couldn't place in parallel.
+  template <class Arg>
+  void insert_noresize_with_policy(const Arg& obj, DuplicateKeyPolicy policy) {
+    assert(settings.use_empty() && "Inserting without empty key");
+    const std::pair<size_type, size_type> pos = find_position(get_key(obj));
+    if (pos.first == ILLEGAL_BUCKET)
+      insert_at(pos.second, obj);
+    else if (policy == KeepLast) {
+      before_write(pos.first);
+      set_value(&table[pos.first], obj);
+    }
+  }
+
+  template <class InputIterator>
+  void build_from(InputIterator f, InputIterator l, size_type /*num_threads*/,
+                  DuplicateKeyPolicy policy, std::input_iterator_tag) {
+    for (; f != l; ++f) {
+      resize_delta(1);
+      insert_noresize_with_policy(*f, policy);
+    }
+  }
+
+  template <class RandomAccessIterator>
+  void build_from(RandomAccessIterator f, RandomAccessIterator l,
+                  size_type num_threads, DuplicateKeyPolicy policy,
+                  std::random_access_iterator_tag) {
+    assert(settings.use_empty() && "Inserting without empty key");
+    const size_t n = static_cast<size_t>(l - f);
+    if (n >= (std::numeric_limits<size_type>::max)()) {
+      throw std::length_error("insert-range overflow");
+    }
+    num_threads = static_cast<size_type>(
+        sparsehash_internal::resolve_num_threads(num_threads));
+    resize_delta(static_cast<size_type>(n));
+    before_write_all();  // the threads below don't stop to copy pages
+
+    // Regions are a power of two, a few per thread so one crowded region
+    // doesn't hold everyone up, and big enough that most probe sequences
+    // stay inside.
+    size_type num_regions = 1;
+    int region_shift = 0;  // log2(bucket_count() / num_regions)
+    while (size_type(1) << region_shift < bucket_count()) ++region_shift;
+    while (num_regions < 4 * num_threads && region_shift > 6) {
+      num_regions *= 2;
+      --region_shift;
+    }
+    if (num_threads <= 1 || num_regions == 1) {
+      for (size_t i = 0; i < n; ++i) insert_noresize_with_policy(f[i], policy);
+      return;
+    }
+
+    const size_type bucket_count_minus_one = bucket_count() - 1;
+    std::vector<size_type> home(n);
+    sparsehash_internal::run_in_parallel(num_threads, num_threads,
+                                         [&](size_t t) {
+      for (size_t i = n * t / num_threads; i < n * (t + 1) / num_threads; ++i)
+        home[i] = hash(get_key(f[i])) & bucket_count_minus_one;
+    });
+
+    std::vector<size_t> order, region_begin;
+    sparsehash_internal::partition_by_region(
+        n, num_regions, num_threads,
+        [&](size_t i) { return home[i] >> region_shift; }, &order,
+        &region_begin);
+
+    std::vector<std::vector<size_t>> spilled(num_regions);
+    std::vector<size_type> added(num_regions, 0);
+    auto place_region = [&](size_t r) {
+      for (size_t j = region_begin[r]; j < region_begin[r + 1]; ++j) {
+        const size_t i = order[j];
+        size_type num_probes = 0;
+        size_type bucknum = home[i];
+        while (1) {
+          if (test_empty(bucknum)) {
+            set_value(&table[bucknum], f[i]);
+            // Regions are at least 64 buckets, so no other thread
+            // touches this word of the bitmap.
+            set_occupied(bucknum);
+            ++added[r];
+            break;
+          } else if (!test_deleted(bucknum) &&
+                     equals(get_key(f[i]), get_key(table[bucknum]))) {
+            if (policy == KeepLast) set_value(&table[bucknum], f[i]);
+            break;
+          }
+          ++num_probes;
+          bucknum = (bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one;
+          if ((bucknum >> region_shift) != r) {  // another thread's buckets
+            spilled[r].push_back(i);
+            break;
+          }
+        }
+      }
+    };
+    // If a thread throws, what the others placed is in the table all the
+    // same, so it has to be counted before the exception goes on.
+    std::exception_ptr error;
+    try {
+      sparsehash_internal::run_in_parallel(num_regions, num_threads,
+                                           place_region);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    for (size_type r = 0; r < num_regions; ++r) num_elements += added[r];
+    if (error) std::rethrow_exception(error);
+
+    // Spilled values come out in input order within each region, and
+    // equal keys always share a region, so duplicates resolve as above.
+    for (size_type r = 0; r < num_regions; ++r) {
+      for (size_t i : spilled[r]) insert_noresize_with_policy(f[i], policy);
+    }
+  }
+
+ public:
   // DefaultValue is a functor that takes a key and returns a value_type
   // representing the default value to be inserted if none is found.
   template <class T, class K>
@@ -1046,6 +1414,7 @@ class dense_hashtable {
            "Inserting the deleted key");
     const std::pair<size_type, size_type> pos = find_position(key);
     if (pos.first != ILLEGAL_BUCKET) {  // object was already there
+      before_write(pos.first);
       return table[pos.first];
     } else if (resize_delta(1)) {  // needed to rehash to make room
       // Since we resized, we can't use pos, so recalculate where to insert.
@@ -1097,6 +1466,58 @@ class dense_hashtable {
     return iterator(this, const_cast<pointer>(f.pos), const_cast<pointer>(f.end), false);
   }
 
+  // Erases every element for which pred(value) is true, and returns how
+  // many that was.  pred is called exactly once per element.  Rather
+  // than leaving a tombstone per removal, we empty the buckets as we go
+  // and then rehash the survivors into a table sized for them, so there
+  // is at most one copy and no deleted key is needed.  (For erasing just
+  // a few elements out of many, erase() is cheaper.)
+  template <class Predicate>
+  size_type erase_if(Predicate pred) {
+    if (size() == 0) return 0;
+    size_type num_erased = 0;
+    try {
+      for (size_type bucknum = 0; bucknum < num_buckets; ++bucknum) {
+        if (test_occupied(bucknum) &&
+            pred(static_cast<const_reference>(table[bucknum]))) {
+          before_write(bucknum);
+          table[bucknum].~value_type();
+          fill_range_with_empty(table + bucknum, 1);
+          clear_occupied(bucknum);
+          --num_elements;
+          ++num_erased;
+        }
+      }
+    } catch (...) {
+      // The holes we made break probe sequences; rehash before leaving.
+      if (num_erased > 0) rehash_after_erase_if();
+      throw;
+    }
+    if (num_erased > 0) rehash_after_erase_if();
+    return num_erased;
+  }
+
+ private:
+  // erase_if() empties buckets in place, which can cut probe sequences
+  // short, so we have to rehash everything that's left.  We shrink the
+  // way maybe_shrink() would while we're at it.
+  void rehash_after_erase_if() {
+    const size_type num_remain = size();
+    size_type sz = bucket_count();
+    const size_type shrink_threshold = settings.shrink_threshold();
+    if (shrink_threshold > 0 && num_remain < shrink_threshold) {
+      while (sz > HT_DEFAULT_STARTING_BUCKETS &&
+             num_remain < static_cast<size_type>(sz * settings.shrink_factor()))
+        sz /= 2;  // stay a power of 2
+    }
+    const size_type old_buckets = bucket_count();
+    settings.begin_rehash();
+    dense_hashtable tmp(std::move(*this), sz);
+    swap(tmp);  // now we are tmp
+    settings.end_rehash(old_buckets, bucket_count());
+  }
+
+ public:
   // COMPARISON
   bool operator==(const dense_hashtable& ht) const {
     if (size() != ht.size()) {
@@ -1138,30 +1559,52 @@ class dense_hashtable {
   typedef sparsehash_internal::pod_serializer<value_type> NopointerSerializer;
 
   // ValueSerializer: a functor.  operator()(OUTPUT*, const value_type&)
+  // Our own writes are buffered; with NopointerSerializer, so are the
+  // values, each run of occupied buckets going out in one piece.
   template <typename ValueSerializer, typename OUTPUT>
   bool serialize(ValueSerializer serializer, OUTPUT* fp) {
     squash_deleted();  // so we don't have to worry about delkey
-    if (!sparsehash_internal::write_bigendian_number(fp, MAGIC_NUMBER, 4))
+    sparsehash_internal::buffered_writer<OUTPUT> out(fp);
+    if (!sparsehash_internal::write_bigendian_number(&out, MAGIC_NUMBER, 4))
       return false;
-    if (!sparsehash_internal::write_bigendian_number(fp, num_buckets, 8))
+    if (!sparsehash_internal::write_bigendian_number(&out, num_buckets, 8))
       return false;
-    if (!sparsehash_internal::write_bigendian_number(fp, num_elements, 8))
+    if (!sparsehash_internal::write_bigendian_number(&out, num_elements, 8))
       return false;
+    const bool is_pod =
+        std::is_same<ValueSerializer, NopointerSerializer>::value;
     // Now write a bitmap of non-empty buckets.
     for (size_type i = 0; i < num_buckets; i += 8) {
       unsigned char bits = 0;
       for (int bit = 0; bit < 8; ++bit) {
-        if (i + bit < num_buckets && !test_empty(i + bit)) bits |= (1 << bit);
+        if (i + bit < num_buckets && test_occupied(i + bit)) bits |= (1 << bit);
       }
-      if (!sparsehash_internal::write_data(fp, &bits, sizeof(bits)))
+      if (!sparsehash_internal::write_data(&out, &bits, sizeof(bits)))
         return false;
-      for (int bit = 0; bit < 8; ++bit) {
-        if (bits & (1 << bit)) {
-          if (!serializer(fp, table[i + bit])) return false;
+      if (is_pod) {
+        for (int bit = 0; bit < 8;) {
+          if (!(bits & (1 << bit))) {
+            ++bit;
+            continue;
+          }
+          int run = 1;
+          while (bit + run < 8 && (bits & (1 << (bit + run)))) ++run;
+          if (!sparsehash_internal::write_data(&out, &table[i + bit],
+                                               run * sizeof(value_type)))
+            return false;
+          bit += run;
+        }
+      } else if (bits != 0) {
+        // serializer writes to fp itself, so it has to be caught up.
+        if (!out.flush()) return false;
+        for (int bit = 0; bit < 8; ++bit) {
+          if (bits & (1 << bit)) {
+            if (!serializer(fp, table[i + bit])) return false;
+          }
         }
       }
     }
-    return true;
+    return out.flush();
   }
 
   // INPUT: anything we've written an overload of read_data() for.
@@ -1184,21 +1627,447 @@ class dense_hashtable {
     if (!sparsehash_internal::read_bigendian_number(fp, &num_elements, 8))
       return false;
 
+    // With NopointerSerializer we know exactly how many bytes are left
+    // for us, so we can read ahead; otherwise the reader passes through.
+    const bool is_pod =
+        std::is_same<ValueSerializer, NopointerSerializer>::value;
+    sparsehash_internal::buffered_reader<INPUT> in(
+        fp, is_pod ? (num_buckets + 7) / 8 + num_elements * sizeof(value_type)
+                   : 0);
     // Read the bitmap of non-empty buckets.
     for (size_type i = 0; i < num_buckets; i += 8) {
       unsigned char bits;
-      if (!sparsehash_internal::read_data(fp, &bits, sizeof(bits)))
+      if (!sparsehash_internal::read_data(&in, &bits, sizeof(bits)))
         return false;
       for (int bit = 0; bit < 8; ++bit) {
         if (i + bit < num_buckets && (bits & (1 << bit))) {  // not empty
-          if (!serializer(fp, &table[i + bit])) return false;
+          if (is_pod) {
+            if (!sparsehash_internal::read_data(&in, &table[i + bit],
+                                                sizeof(value_type)))
+              return false;
+          } else if (!serializer(fp, &table[i + bit])) {
+            return false;
+          }
+          set_occupied(i + bit);
         }
       }
     }
     return true;
   }
 
+  // Reads what serialize() wrote a value at a time, without a table to
+  // put them in, so a file far bigger than memory can be scanned: the
+  // reader holds one value and a fixed-size buffer.  next() returns the
+  // next value, good until the following call, or NULL once there are
+  // no more -- or the file turns out to be bad, in which case ok() is
+  // false.  bucket() says which bucket the value was in.
+  //
+  //    dense_hash_map<K, V>::serialized_reader<Serializer, FILE> r(s, fp);
+  //    while (const std::pair<const K, V>* v = r.next()) use(*v);
+  //    if (!r.ok()) ...
+  //
+  // As for unserialize(), the serializer constructs each value in raw
+  // memory; the reader destroys it.
+  template <typename ValueSerializer, typename INPUT>
+  class serialized_reader {
+   public:
+    serialized_reader(ValueSerializer serializer, INPUT* fp)
+        : serializer_(serializer),
+          fp_(fp),
+          in_(fp, 0),
+          num_buckets_(0),
+          num_elements_(0),
+          num_read_(0),
+          next_bucket_(0),
+          base_(0),
+          bits_(0),
+          bucket_(0),
+          has_value_(false),
+          ok_(read_header()) {}
+    ~serialized_reader() { destroy_value(); }
+
+    // From the header, which the constructor reads.
+    size_type bucket_count() const { return num_buckets_; }
+    size_type size() const { return num_elements_; }
+
+    const value_type* next() {
+      destroy_value();
+      while (ok_ && bits_ == 0) {
+        if (next_bucket_ >= num_buckets_) {  // the end
+          ok_ = num_read_ == num_elements_;
+          return NULL;
+        }
+        unsigned char bits;
+        if (!sparsehash_internal::read_data(&in_, &bits, sizeof(bits))) {
+          ok_ = false;
+          break;
+        }
+        base_ = next_bucket_;
+        next_bucket_ += 8;
+        bits_ = bits;
+        if (next_bucket_ > num_buckets_)  // ignore bits past the end
+          bits_ &= (1u << (num_buckets_ - base_)) - 1;
+      }
+      if (!ok_) return NULL;
+      bucket_ = base_ + sparsehash_internal::count_trailing_zeros(bits_);
+      bits_ &= bits_ - 1;
+      value_type* value = slot();
+      if (std::is_same<ValueSerializer, NopointerSerializer>::value
+              ? !sparsehash_internal::read_data(&in_, value,
+                                                sizeof(value_type))
+              : !serializer_(fp_, value)) {
+        ok_ = false;
+        return NULL;
+      }
+      has_value_ = true;
+      ++num_read_;
+      return value;
+    }
+
+    size_type bucket() const { return bucket_; }
+    bool ok() const { return ok_; }
+
+   private:
+    bool read_header() {
+      MagicNumberType magic;
+      if (!sparsehash_internal::read_bigendian_number(fp_, &magic, 4) ||
+          magic != MAGIC_NUMBER ||
+          !sparsehash_internal::read_bigendian_number(fp_, &num_buckets_, 8) ||
+          !sparsehash_internal::read_bigendian_number(fp_, &num_elements_, 8))
+        return false;
+      // With NopointerSerializer all that's left is ours, as in
+      // unserialize(); otherwise the serializer reads fp itself.
+      if (std::is_same<ValueSerializer, NopointerSerializer>::value)
+        in_.add_readahead((num_buckets_ + 7) / 8 +
+                          num_elements_ * sizeof(value_type));
+      return true;
+    }
+
+    value_type* slot() { return reinterpret_cast<value_type*>(&storage_); }
+    void destroy_value() {
+      if (has_value_) slot()->~value_type();
+      has_value_ = false;
+    }
+
+    ValueSerializer serializer_;
+    INPUT* fp_;
+    sparsehash_internal::buffered_reader<INPUT> in_;
+    size_type num_buckets_;
+    size_type num_elements_;
+    size_type num_read_;
+    size_type next_bucket_;  // the first bucket of the next bitmap byte
+    size_type base_;         // the first bucket of the current one
+    unsigned bits_;          // what's left of it
+    size_type bucket_;
+    typename std::aligned_storage<sizeof(value_type),
+                                  alignof(value_type)>::type storage_;
+    bool has_value_;
+    bool ok_;
+
+    serialized_reader(const serialized_reader&);  // not copyable
+    void operator=(const serialized_reader&);
+  };
+
+  // Snapshots: the same data as serialize() writes, plus a header
+  // describing the table and CRC32C checksums over the lot, so a
+  // truncated, corrupt or mismatched file is refused instead of being
+  // loaded.  See hashtable-snapshot.h for the format.  Since the values
+  // are written through a checksumming stream rather than to fp itself,
+  // a ValueSerializer used here must accept any OUTPUT (or INPUT) type;
+  // NopointerSerializer does.
+  template <typename ValueSerializer, typename OUTPUT>
+  bool serialize_snapshot(ValueSerializer serializer, OUTPUT* fp) {
+    squash_deleted();  // so the header's counts match what's written
+    sparsehash_internal::snapshot_header header = expected_snapshot_header();
+    header.num_buckets = num_buckets;
+    header.num_elements = num_elements;
+    if (!sparsehash_internal::write_snapshot_header(fp, header)) return false;
+    sparsehash_internal::checksummed_writer<OUTPUT> out(fp);
+    return serialize(serializer, &out) && out.finish();
+  }
+
+  // Reads any kind of snapshot, or the older serialize() format (which
+  // has nothing to check it against).
+  template <typename ValueSerializer, typename INPUT>
+  bool unserialize_snapshot(ValueSerializer serializer, INPUT* fp) {
+    return load_snapshot(serializer, fp, 1);
+  }
+
+  // Like serialize_snapshot(), but the buckets are cut into chunks of
+  // SNAPSHOT_CHUNK_BUCKETS that are encoded and checksummed on up to
+  // num_threads threads (0 means one per hardware thread), and an index
+  // of the chunks follows them.  fp is written only from the calling
+  // thread, in order.  The serializer is copied for each chunk and the
+  // copies are called concurrently.
+  template <typename ValueSerializer, typename OUTPUT>
+  bool serialize_parallel(ValueSerializer serializer, OUTPUT* fp,
+                          size_type num_threads = 0) {
+    squash_deleted();
+    sparsehash_internal::snapshot_header header = expected_snapshot_header();
+    header.flags |= sparsehash_internal::SNAPSHOT_INDEXED;
+    header.num_buckets = num_buckets;
+    header.num_elements = num_elements;
+    header.chunk_size = SNAPSHOT_CHUNK_BUCKETS;
+    if (!sparsehash_internal::write_snapshot_header(fp, header)) return false;
+    return sparsehash_internal::write_indexed_chunks(
+        fp, num_snapshot_chunks(num_buckets, SNAPSHOT_CHUNK_BUCKETS),
+        sparsehash_internal::resolve_num_threads(num_threads),
+        [&](size_t chunk, sparsehash_internal::memory_writer* out) {
+          ValueSerializer chunk_serializer = serializer;
+          return write_buckets(chunk_serializer, out,
+                               chunk * SNAPSHOT_CHUNK_BUCKETS,
+                               (chunk + 1) * SNAPSHOT_CHUNK_BUCKETS);
+        });
+  }
+
+  // Reads what serialize_parallel() writes, sizing the table first and
+  // then decoding chunks straight into their buckets on up to
+  // num_threads threads; fp is read only from the calling thread.
+  // Other snapshots, and the older format, are read as by
+  // unserialize_snapshot().
+  template <typename ValueSerializer, typename INPUT>
+  bool unserialize_parallel(ValueSerializer serializer, INPUT* fp,
+                            size_type num_threads = 0) {
+    return load_snapshot(serializer, fp,
+                         sparsehash_internal::resolve_num_threads(num_threads));
+  }
+
+  // True if fp holds an intact snapshot that a table of this type could
+  // read, checked without loading anything.
+  template <typename INPUT>
+  static bool validate_snapshot(INPUT* fp) {
+    return sparsehash_internal::validate_snapshot(fp,
+                                                  expected_snapshot_header());
+  }
+
+  // Buckets per chunk in serialize_parallel().  A multiple of 64, so no
+  // two chunks share a word of the occupancy bitmap.
+  static const size_t SNAPSHOT_CHUNK_BUCKETS = 1 << 16;
+
+  // Background snapshots.  begin_snapshot() fixes what the snapshot will
+  // hold; write_snapshot() then writes it, typically on another thread,
+  // while this one goes on changing the table; end_snapshot() lets it
+  // go.  A chunk of SNAPSHOT_CHUNK_BUCKETS buckets that is about to
+  // change before write_snapshot() gets to it is copied first, so the
+  // cost to the writer of the table is at most one copy of each chunk
+  // (and the odd wait while one is encoded).  Anything that rewrites the
+  // whole table -- a resize, clear(), swap() -- copies all the chunks
+  // not yet written.  A non-const iterator copies each chunk as it comes
+  // to it, whether from begin(), find() or insert(), so it may be walked
+  // over the table and change any element it reaches.
+  //
+  // The file is what serialize_parallel() writes, so any of the
+  // unserialize routines reads it.  begin_snapshot() first gets rid of
+  // deleted entries, which copies the table if there are any.
+  void begin_snapshot() {
+    static_assert(std::is_copy_constructible<value_type>::value,
+                  "Snapshots copy values that are about to change");
+    assert(!snapshot_state && "A snapshot is already in progress");
+    assert(settings.use_empty() && "empty_key not set for snapshot");
+    squash_deleted();
+    sparsehash_internal::snapshot_header header = expected_snapshot_header();
+    header.flags |= sparsehash_internal::SNAPSHOT_INDEXED;
+    header.num_buckets = num_buckets;
+    header.num_elements = num_elements;
+    header.chunk_size = SNAPSHOT_CHUNK_BUCKETS;
+    snapshot_state.reset(new SnapshotState(
+        header, num_snapshot_chunks(num_buckets, SNAPSHOT_CHUNK_BUCKETS)));
+  }
+
+  // Writes the snapshot begin_snapshot() started.  This may run on any
+  // one thread, concurrently with anything but end_snapshot() and the
+  // destructor.  Returns false on a write error, or if there's no
+  // snapshot to write.
+  template <typename ValueSerializer, typename OUTPUT>
+  bool write_snapshot(ValueSerializer serializer, OUTPUT* fp) const {
+    if (!snapshot_state) return false;
+    const size_type snapshot_buckets =
+        static_cast<size_type>(snapshot_state->header().num_buckets);
+    return sparsehash_internal::write_cow_snapshot(
+        fp, snapshot_state.get(),
+        [&](size_t page, const SnapshotPage* saved,
+            sparsehash_internal::memory_writer* out) {
+          const size_type first =
+              static_cast<size_type>(page * SNAPSHOT_CHUNK_BUCKETS);
+          const size_type n = static_cast<size_type>((std::min)(
+              SNAPSHOT_CHUNK_BUCKETS, size_t(snapshot_buckets - first)));
+          if (saved)
+            return write_bucket_values(serializer, out, saved->values.data(),
+                                       saved->occupied.data(), n);
+          return write_bucket_values(serializer, out, table + first,
+                                     occupied.data() + first / 64, n);
+        });
+  }
+
+  // Call once write_snapshot() has returned.
+  void end_snapshot() { snapshot_state.reset(); }
+
+  bool snapshot_in_progress() const { return snapshot_state != nullptr; }
+
  private:
+  static sparsehash_internal::snapshot_header expected_snapshot_header() {
+    return sparsehash_internal::expected_snapshot_header<hasher, key_type,
+                                                         value_type>(false);
+  }
+
+  static size_t num_snapshot_chunks(size_t n, size_t chunk_size) {
+    return (n + chunk_size - 1) / chunk_size;
+  }
+
+  template <typename ValueSerializer, typename INPUT>
+  bool load_snapshot(ValueSerializer& serializer, INPUT* fp,
+                     size_type num_threads) {
+    unsigned char magic[4];
+    if (!sparsehash_internal::read_data(fp, magic, sizeof(magic)))
+      return false;
+    const unsigned char* p = magic;
+    if (sparsehash_internal::get_bigendian(&p, 4) !=
+        sparsehash_internal::SNAPSHOT_MAGIC) {
+      sparsehash_internal::replay_reader<INPUT> in(fp, magic, sizeof(magic));
+      return unserialize(serializer, &in);
+    }
+    sparsehash_internal::snapshot_header header;
+    if (!sparsehash_internal::read_snapshot_header_after_magic(fp, &header) ||
+        !header.compatible_with(expected_snapshot_header()))
+      return false;
+    bool ok;
+    if (header.indexed()) {
+      ok = header.chunk_size % 64 == 0 &&
+           load_indexed_snapshot(serializer, fp, header, num_threads);
+    } else {
+      sparsehash_internal::checksummed_reader<INPUT> in(fp, header.chunk_size);
+      ok = unserialize(serializer, &in) && in.finish();
+    }
+    if (!ok || num_buckets != header.num_buckets ||
+        num_elements != header.num_elements) {
+      clear();
+      return false;
+    }
+    return true;
+  }
+
+  template <typename ValueSerializer, typename INPUT>
+  bool load_indexed_snapshot(ValueSerializer& serializer, INPUT* fp,
+                             const sparsehash_internal::snapshot_header& header,
+                             size_type num_threads) {
+    assert(settings.use_empty() && "empty_key not set for read");
+    clear();
+    clear_to_size(static_cast<size_type>(header.num_buckets));
+    const size_type chunk_size = header.chunk_size;
+    const size_type num_chunks = num_snapshot_chunks(num_buckets, chunk_size);
+    std::vector<size_type> counts(num_chunks);
+    const bool ok = sparsehash_internal::read_indexed_chunks(
+        fp, num_chunks, num_threads,
+        [&](size_t chunk, const char* data, size_t length) {
+          sparsehash_internal::memory_reader in(data, length);
+          ValueSerializer chunk_serializer = serializer;
+          return read_buckets(chunk_serializer, &in, chunk * chunk_size,
+                              (chunk + 1) * chunk_size, &counts[chunk]) &&
+                 in.at_end();
+        });
+    num_elements = 0;
+    for (size_type count : counts) num_elements += count;
+    return ok;
+  }
+
+  // One chunk of serialize_parallel(): buckets [first, last) (or up to
+  // the end of the table) as serialize() would write them.  first is a
+  // multiple of 64.
+  template <typename ValueSerializer, typename OUTPUT>
+  bool write_buckets(ValueSerializer& serializer, OUTPUT* out, size_type first,
+                     size_type last) const {
+    if (last > num_buckets) last = num_buckets;
+    return write_bucket_values(serializer, out, table + first,
+                               occupied.data() + first / 64, last - first);
+  }
+
+  // The same for n buckets starting at values, with words holding their
+  // occupancy bits, so a chunk copied aside by before_write() is written
+  // just as it was in the table.
+  template <typename ValueSerializer, typename OUTPUT>
+  static bool write_bucket_values(ValueSerializer& serializer, OUTPUT* out,
+                                  const value_type* values,
+                                  const uint64_t* words, size_type n) {
+    const bool is_pod =
+        std::is_same<ValueSerializer, NopointerSerializer>::value;
+    for (size_type i = 0; i < n; i += 8) {
+      unsigned char bits = 0;
+      for (int bit = 0; bit < 8; ++bit) {
+        const size_type j = i + bit;
+        if (j < n && ((words[j / 64] >> (j % 64)) & 1)) bits |= (1 << bit);
+      }
+      if (!sparsehash_internal::write_data(out, &bits, sizeof(bits)))
+        return false;
+      for (int bit = 0; bit < 8; ++bit) {
+        if (!(bits & (1 << bit))) continue;
+        if (is_pod) {
+          if (!sparsehash_internal::write_data(out, &values[i + bit],
+                                               sizeof(value_type)))
+            return false;
+        } else if (!serializer(out, values[i + bit])) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // What before_write() saves of a chunk.
+  struct SnapshotPage {
+    std::vector<value_type> values;
+    std::vector<uint64_t> occupied;
+  };
+  typedef sparsehash_internal::cow_snapshot<SnapshotPage> SnapshotState;
+
+  std::unique_ptr<SnapshotPage> save_snapshot_page(size_t page,
+                                                   std::true_type) const {
+    const size_t first = page * SNAPSHOT_CHUNK_BUCKETS;
+    const size_t last =
+        (std::min)(first + SNAPSHOT_CHUNK_BUCKETS, size_t(num_buckets));
+    std::unique_ptr<SnapshotPage> saved(new SnapshotPage);
+    // Constructed rather than assigned: value_type may have a const key.
+    std::vector<value_type>(table + first, table + last).swap(saved->values);
+    saved->occupied.assign(occupied.begin() + first / 64,
+                           occupied.begin() + (last + 63) / 64);
+    return saved;
+  }
+  // begin_snapshot() doesn't compile for these, so it never gets here.
+  std::unique_ptr<SnapshotPage> save_snapshot_page(size_t,
+                                                   std::false_type) const {
+    assert(false);
+    return std::unique_ptr<SnapshotPage>();
+  }
+
+  // And back, into a table that clear_to_size() has just emptied.  Sets
+  // *count to how many values were read.
+  template <typename ValueSerializer, typename INPUT>
+  bool read_buckets(ValueSerializer& serializer, INPUT* in, size_type first,
+                    size_type last, size_type* count) {
+    if (last > num_buckets) last = num_buckets;
+    const bool is_pod =
+        std::is_same<ValueSerializer, NopointerSerializer>::value;
+    *count = 0;
+    for (size_type i = first; i < last; i += 8) {
+      unsigned char bits;
+      if (!sparsehash_internal::read_data(in, &bits, sizeof(bits)))
+        return false;
+      for (int bit = 0; bit < 8; ++bit) {
+        if (!(bits & (1 << bit))) continue;
+        if (i + bit >= last) return false;  // past the end of the table
+        if (is_pod) {
+          if (!sparsehash_internal::read_data(in, &table[i + bit],
+                                              sizeof(value_type)))
+            return false;
+        } else if (!serializer(in, &table[i + bit])) {
+          return false;
+        }
+        set_occupied(i + bit);
+        ++*count;
+      }
+    }
+    return true;
+  }
+
   template <class A>
   class alloc_impl : public A {
    public:
@@ -1260,9 +2129,11 @@ class dense_hashtable {
   // zero-size functors.  Since ExtractKey and hasher's operator() might
   // have the same function signature, they must be packaged in
   // different classes.
+  // The Stats policy rides along too, so no_stats costs nothing.
   struct Settings
       : sparsehash_internal::sh_hashtable_settings<key_type, hasher, size_type,
-                                                   HT_MIN_BUCKETS> {
+                                                   HT_MIN_BUCKETS>,
+        Stats {
     explicit Settings(const hasher& hf)
         : sparsehash_internal::sh_hashtable_settings<key_type, hasher,
                                                      size_type, HT_MIN_BUCKETS>(
@@ -1314,20 +2185,32 @@ class dense_hashtable {
   size_type num_buckets;
   ValInfo val_info;  // holds emptyval, and also the allocator
   pointer table;
+  // bit i set iff table[i] holds an element
+  std::vector<uint64_t, occupied_alloc_type> occupied;
+  // Set between begin_snapshot() and end_snapshot().  Never copied or
+  // swapped: it belongs to this table's buckets.
+  std::unique_ptr<SnapshotState> snapshot_state;
 };
 
 // We need a global swap as well
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-inline void swap(dense_hashtable<V, K, HF, ExK, SetK, EqK, A>& x,
-                 dense_hashtable<V, K, HF, ExK, SetK, EqK, A>& y) {
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
+inline void swap(dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>& x,
+                 dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>& y) {
   x.swap(y);
 }
 
 #undef JUMP_
 
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-const typename dense_hashtable<V, K, HF, ExK, SetK, EqK, A>::size_type
-    dense_hashtable<V, K, HF, ExK, SetK, EqK, A>::ILLEGAL_BUCKET;
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
+const typename dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::size_type
+    dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::ILLEGAL_BUCKET;
+
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
+const size_t
+    dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::SNAPSHOT_CHUNK_BUCKETS;
 
 // How full we let the table get before we resize.  Knuth says .8 is
 // good -- higher causes us to probe too much, though saves memory.
@@ -1335,14 +2218,18 @@ const typename dense_hashtable<V, K, HF, ExK, SetK, EqK, A>::size_type
 // more space (a trade-off densehashtable explicitly chooses to make).
 // Feel free to play around with different values, though, via
 // max_load_factor() and/or set_resizing_parameters().
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-const int dense_hashtable<V, K, HF, ExK, SetK, EqK, A>::HT_OCCUPANCY_PCT = 50;
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
+const int
+    dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::HT_OCCUPANCY_PCT = 50;
 
 // How empty we let the table get before we resize lower.
 // It should be less than OCCUPANCY_PCT / 2 or we thrash resizing.
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-const int dense_hashtable<V, K, HF, ExK, SetK, EqK, A>::HT_EMPTY_PCT =
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
+const int dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::HT_EMPTY_PCT =
     static_cast<int>(
-        0.4 * dense_hashtable<V, K, HF, ExK, SetK, EqK, A>::HT_OCCUPANCY_PCT);
+        0.4 *
+        dense_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::HT_OCCUPANCY_PCT);
 
 }  // namespace google
@@ -34,14 +34,23 @@
 // sh_hashtable_settings has parameters for growing and shrinking
 // a hashtable.  It also packages zero-size functor (ie. hasher).
 //
+// no_stats and count_stats are the two stats policies a hashtable can
+// be given as its last template argument; see hashtable_stats below.
+// hashtable_analysis is what a hashtable's analyze() reports.
+//
 // Other functions and classes provide common code for serializing
 // and deserializing hashtables to a stream (such as a FILE*).
 
 #pragma once
 
 #include <cassert>
+#include <chrono>   // for steady_clock
 #include <cstdio>
 #include <cstddef>  // for size_t
+#include <cstdint>  // for uint64_t
+#include <cstring>  // for memcpy
+#include <algorithm>  // for min, max
+#include <vector>
 #include <iosfwd>
 #include <stdexcept>  // For length_error
 
@@ -148,36 +157,152 @@ inline bool write_data(OUTPUT* fp, const void* data, size_t length) {
 // from sizeof(IntType), allowing us to save on a 32-bit system
 // and load on a 64-bit system).  Excess bytes are taken to be 0.
 // INPUT and OUTPUT must match legal inputs to read/write_data (above).
+// The bytes go through read/write_data() a chunk at a time, rather
+// than one call per byte.
 template <typename INPUT, typename IntType>
 bool read_bigendian_number(INPUT* fp, IntType* value, size_t length) {
   *value = 0;
-  unsigned char byte;
+  unsigned char bytes[16];
   // We require IntType to be unsigned or else the shifting gets all screwy.
   static_assert(static_cast<IntType>(-1) > static_cast<IntType>(0),
                 "serializing int requires an unsigned type");
-  for (size_t i = 0; i < length; ++i) {
-    if (!read_data(fp, &byte, sizeof(byte))) return false;
-    *value |= static_cast<IntType>(byte) << ((length - 1 - i) * 8);
+  for (size_t i = 0; i < length; i += sizeof(bytes)) {
+    const size_t n = (std::min)(length - i, sizeof(bytes));
+    if (!read_data(fp, bytes, n)) return false;
+    for (size_t j = 0; j < n; ++j) {
+      *value |= static_cast<IntType>(bytes[j]) << ((length - 1 - i - j) * 8);
+    }
   }
   return true;
 }
 
 template <typename OUTPUT, typename IntType>
 bool write_bigendian_number(OUTPUT* fp, IntType value, size_t length) {
-  unsigned char byte;
+  unsigned char bytes[16];
   // We require IntType to be unsigned or else the shifting gets all screwy.
   static_assert(static_cast<IntType>(-1) > static_cast<IntType>(0),
                 "serializing int requires an unsigned type");
-  for (size_t i = 0; i < length; ++i) {
-    byte = (sizeof(value) <= length - 1 - i)
-               ? 0
-               : static_cast<unsigned char>((value >> ((length - 1 - i) * 8)) &
-                                            255);
-    if (!write_data(fp, &byte, sizeof(byte))) return false;
+  for (size_t i = 0; i < length; i += sizeof(bytes)) {
+    const size_t n = (std::min)(length - i, sizeof(bytes));
+    for (size_t j = 0; j < n; ++j) {
+      const size_t shift = length - 1 - i - j;  // in bytes
+      bytes[j] = (sizeof(value) <= shift)
+                     ? 0
+                     : static_cast<unsigned char>((value >> (shift * 8)) & 255);
+    }
+    if (!write_data(fp, bytes, n)) return false;
   }
   return true;
 }
 
+// ----- buffered I/O ----
+
+// The hashtables write lots of small pieces: a few bytes of bitmap
+// here, one value there.  With a FILE* that's a locked fwrite() per
+// piece, and with an ostream it's worse.  buffered_writer collects the
+// pieces and passes them on to write_data() in blocks of up to
+// kBufferSize bytes.  It is itself an OUTPUT (it has Write()), so it
+// can be handed to anything that takes one.  Call flush() when done:
+// that's when write errors from the underlying OUTPUT are reported.
+template <typename OUTPUT>
+class buffered_writer {
+ public:
+  static const size_t kBufferSize = 1 << 20;
+
+  explicit buffered_writer(OUTPUT* fp) : fp_(fp), ok_(true) {}
+  ~buffered_writer() { flush(); }
+
+  size_t Write(const void* data, size_t length) {
+    if (buffer_.size() + length > kBufferSize) {
+      if (!flush()) return 0;
+      if (length >= kBufferSize) {  // too big to be worth copying
+        ok_ = write_data(fp_, data, length);
+        return ok_ ? length : 0;
+      }
+    }
+    const char* bytes = static_cast<const char*>(data);
+    buffer_.insert(buffer_.end(), bytes, bytes + length);
+    return ok_ ? length : 0;
+  }
+
+  // Hands everything we've buffered to the underlying OUTPUT.  Returns
+  // false if that, or any earlier write, failed.
+  bool flush() {
+    if (ok_ && !buffer_.empty())
+      ok_ = write_data(fp_, buffer_.data(), buffer_.size());
+    buffer_.clear();
+    return ok_;
+  }
+
+ private:
+  OUTPUT* fp_;
+  std::vector<char> buffer_;
+  bool ok_;
+
+  buffered_writer(const buffered_writer&);  // not copyable
+  void operator=(const buffered_writer&);
+};
+
+template <typename OUTPUT>
+const size_t buffered_writer<OUTPUT>::kBufferSize;
+
+// The reading side of buffered_writer: it reads from the underlying
+// INPUT in blocks of up to kBufferSize bytes and hands them out in
+// whatever pieces it's asked for.  Since the INPUT may hold more than
+// just our data, the caller says how many bytes are ours to read ahead
+// (readahead), and may add to that as it learns more.  Reads beyond
+// that go straight to the INPUT.
+template <typename INPUT>
+class buffered_reader {
+ public:
+  static const size_t kBufferSize = 1 << 20;
+
+  buffered_reader(INPUT* fp, size_t readahead)
+      : fp_(fp), readahead_(readahead), pos_(0) {}
+
+  // Says that another num_bytes after what we already know about are
+  // ours to read.
+  void add_readahead(size_t num_bytes) { readahead_ += num_bytes; }
+
+  size_t Read(void* data, size_t length) {
+    char* out = static_cast<char*>(data);
+    size_t left = length;
+    while (left > 0) {
+      if (pos_ == buffer_.size()) {  // need more
+        if (left >= kBufferSize || readahead_ < left) {
+          readahead_ -= (std::min)(readahead_, left);
+          return read_data(fp_, out, left) ? length : 0;
+        }
+        buffer_.resize((std::min)(readahead_, kBufferSize));
+        pos_ = 0;
+        if (!read_data(fp_, buffer_.data(), buffer_.size())) {
+          buffer_.clear();
+          return 0;
+        }
+        readahead_ -= buffer_.size();
+      }
+      const size_t n = (std::min)(left, buffer_.size() - pos_);
+      memcpy(out, buffer_.data() + pos_, n);
+      pos_ += n;
+      out += n;
+      left -= n;
+    }
+    return length;
+  }
+
+ private:
+  INPUT* fp_;
+  size_t readahead_;  // bytes past the buffer that we're allowed to read
+  std::vector<char> buffer_;
+  size_t pos_;  // next byte of buffer_ to hand out
+
+  buffered_reader(const buffered_reader&);  // not copyable
+  void operator=(const buffered_reader&);
+};
+
+template <typename INPUT>
+const size_t buffered_reader<INPUT>::kBufferSize;
+
 // If your keys and values are simple enough, you can pass this
 // serializer to serialize()/unserialize().  "Simple enough" means
 // value_type is a POD type that contains no pointers.  Note,
@@ -196,6 +321,19 @@ struct pod_serializer {
   }
 };
 
+// The index of the lowest set bit in word, which mustn't be 0.  This
+// compiles to a single tzcnt/bsf where the compiler lets us ask for it.
+inline int count_trailing_zeros(uint64_t word) {
+  assert(word != 0);
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(word);
+#else
+  int n = 0;
+  for (; !(word & 1); word >>= 1) ++n;
+  return n;
+#endif
+}
+
 // Settings contains parameters for growing and shrinking the table.
 // It also packages zero-size functor (ie. hasher).
 //
@@ -225,6 +363,7 @@ class sh_hashtable_settings : public HashFunc {
         consider_shrink_(false),
         use_empty_(false),
         use_deleted_(false),
+        physical_erase_(false),
         num_ht_copies_(0) {
     set_enlarge_factor(ht_occupancy_flt);
     set_shrink_factor(ht_empty_flt);
@@ -261,6 +400,9 @@ class sh_hashtable_settings : public HashFunc {
   bool use_deleted() const { return use_deleted_; }
   void set_use_deleted(bool t) { use_deleted_ = t; }
 
+  bool physical_erase() const { return physical_erase_; }
+  void set_physical_erase(bool t) { physical_erase_ = t; }
+
   size_type num_ht_copies() const {
     return static_cast<size_type>(num_ht_copies_);
   }
@@ -331,9 +473,232 @@ class sh_hashtable_settings : public HashFunc {
   bool consider_shrink_;
   bool use_empty_;    // used only by densehashtable, not sparsehashtable
   bool use_deleted_;  // false until delkey has been set
+  bool physical_erase_;  // used only by sparsehashtable, not densehashtable
   // num_ht_copies is a counter incremented every Copy/Move
   unsigned int num_ht_copies_;
 };
 
+}  // namespace sparsehash_internal
+
+// What a hashtable has counted about itself, as returned by stats().
+// A lookup is any search for a key: find(), count(), insert(), erase()
+// and friends all do one.  Its probe length is how many buckets past
+// the first one it had to look at, so a table with no collisions
+// averages 0.  Resizes and shrinks count the times the table was
+// rebuilt bigger or smaller; rehash_nanos is the time spent on those,
+// and on rebuilds that only clear out erased buckets.
+struct hashtable_stats {
+  hashtable_stats()
+      : lookups(0),
+        hits(0),
+        misses(0),
+        total_probes(0),
+        max_probe(0),
+        deleted_reused(0),
+        resizes(0),
+        shrinks(0),
+        rehash_nanos(0) {}
+
+  uint64_t lookups;
+  uint64_t hits;            // lookups that found the key
+  uint64_t misses;          // and those that didn't
+  uint64_t total_probes;    // summed over all lookups
+  uint64_t max_probe;       // the longest single one
+  uint64_t deleted_reused;  // inserts that went into a deleted bucket
+  uint64_t resizes;
+  uint64_t shrinks;
+  uint64_t rehash_nanos;
+};
+
+// The default stats policy: counts nothing, and takes no space or time.
+// stats() on such a table returns all zeros.
+struct no_stats {
+  void count_lookup(size_t /*probes*/, bool /*found*/) const {}
+  void count_deleted_reused() {}
+  void begin_rehash() {}
+  void end_rehash(size_t /*old_buckets*/, size_t /*new_buckets*/) {}
+  hashtable_stats stats() const { return hashtable_stats(); }
+};
+
+// Counts everything in hashtable_stats.  This costs a few adds per
+// lookup and two clock reads per resize.  Since a lookup now writes
+// to the table, a counting table mustn't be read from several threads
+// at once, even through const methods.  A copy of a table starts with
+// the counts of the table it was copied from.
+class count_stats {
+ public:
+  count_stats() {}
+
+  void count_lookup(size_t probes, bool found) const {
+    ++stats_.lookups;
+    ++(found ? stats_.hits : stats_.misses);
+    stats_.total_probes += probes;
+    if (probes > stats_.max_probe) stats_.max_probe = probes;
+  }
+  void count_deleted_reused() { ++stats_.deleted_reused; }
+  void begin_rehash() { rehash_start_ = std::chrono::steady_clock::now(); }
+  void end_rehash(size_t old_buckets, size_t new_buckets) {
+    if (new_buckets > old_buckets) ++stats_.resizes;
+    if (new_buckets < old_buckets) ++stats_.shrinks;
+    stats_.rehash_nanos += static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - rehash_start_).count());
+  }
+  hashtable_stats stats() const { return stats_; }
+
+ private:
+  mutable hashtable_stats stats_;  // lookups happen in const methods
+  std::chrono::steady_clock::time_point rehash_start_;
+};
+
+// A hashtable's health, as found by walking all of it in analyze().
+// This is for working out why a table is slow: a bad hash shows up as
+// long displacements and a large chi-square, a table that needs
+// rehashing as many deleted buckets, and too high a load as long
+// clusters even with a good hash.
+struct hashtable_analysis {
+  hashtable_analysis()
+      : num_buckets(0),
+        num_elements(0),
+        num_deleted(0),
+        mean_displacement(0),
+        max_displacement(0),
+        longest_cluster(0),
+        region_buckets(0),
+        chi_square(0),
+        chi_square_df(0) {}
+
+  size_t num_buckets;
+  size_t num_elements;
+  size_t num_deleted;  // deleted (or, for sparse tables, erased) buckets
+
+  // displacement[i] is how many entries are i probes from the bucket
+  // they hash to; so displacement[0] is the entries in their own.
+  std::vector<size_t> displacement;
+  double mean_displacement;
+  size_t max_displacement;
+
+  // The longest run of buckets without an empty one in it, wrapping
+  // round the end of the table.  Deleted buckets count as full here,
+  // since a lookup has to probe past them.
+  size_t longest_cluster;
+
+  // The table split into up to 64 regions of region_buckets buckets
+  // each, and how many deleted buckets are in each.
+  std::vector<size_t> deleted_per_region;
+  size_t region_buckets;
+
+  // For sparse tables, group_fill[i] is how many sparsegroups have i
+  // entries in them.  Empty for dense tables.
+  std::vector<size_t> group_fill;
+
+  // Pearson's chi-square for the entries' home buckets against an even
+  // spread, with chi_square_df degrees of freedom.  Big tables are
+  // counted in up to 65536 equal ranges of buckets rather than bucket
+  // by bucket.  A good hash gives about chi_square_df; several times
+  // that means the hash (after the bucket mask) clumps keys together.
+  double chi_square;
+  size_t chi_square_df;
+};
+
+namespace sparsehash_internal {
+
+// Builds a hashtable_analysis as a table is walked from bucket 0 up.
+// Tables say what is in each bucket with one of empty(), deleted() or
+// entry(), then call finish().
+class table_analyzer {
+ public:
+  explicit table_analyzer(size_t num_buckets)
+      : cell_buckets_(1),
+        total_displacement_(0),
+        run_(0),
+        first_run_(0),
+        seen_empty_(false) {
+    const size_t kMaxRegions = 64;
+    result_.num_buckets = num_buckets;
+    const size_t regions = (std::min)(num_buckets, kMaxRegions);
+    if (regions > 0) {
+      result_.region_buckets = num_buckets / regions;
+      result_.deleted_per_region.resize(regions);
+    }
+    // A count per bucket could take as much memory as the table.
+    const size_t kMaxCells = 65536;
+    const size_t cells = (std::min)(num_buckets, kMaxCells);
+    if (cells > 0) {
+      cell_buckets_ = num_buckets / cells;
+      home_counts_.resize(cells);
+    }
+  }
+
+  void empty() { end_run(); }
+  void deleted(size_t bucknum) {
+    ++result_.num_deleted;
+    ++result_.deleted_per_region[bucknum / result_.region_buckets];
+    ++run_;
+  }
+  // probes is how far the entry is from home, the bucket it hashes to.
+  void entry(size_t home, size_t probes) {
+    ++result_.num_elements;
+    ++home_counts_[(std::min)(home / cell_buckets_, home_counts_.size() - 1)];
+    if (probes >= result_.displacement.size()) {
+      result_.displacement.resize(probes + 1);
+    }
+    ++result_.displacement[probes];
+    total_displacement_ += probes;
+    ++run_;
+  }
+
+  // For sparse tables: one group with this many entries.
+  void group(size_t num_nonempty) {
+    if (num_nonempty >= result_.group_fill.size()) {
+      result_.group_fill.resize(num_nonempty + 1);
+    }
+    ++result_.group_fill[num_nonempty];
+  }
+
+  hashtable_analysis finish() {
+    if (seen_empty_) {  // the last run carries on into the first
+      result_.longest_cluster =
+          (std::max)(result_.longest_cluster, run_ + first_run_);
+    } else {
+      result_.longest_cluster = run_;  // no empty bucket at all
+    }
+    const size_t n = result_.num_elements;
+    if (n > 0) {
+      result_.mean_displacement =
+          static_cast<double>(total_displacement_) / n;
+      result_.max_displacement = result_.displacement.size() - 1;
+      const double expected =
+          static_cast<double>(n) / home_counts_.size();
+      double chi_square = 0;
+      for (size_t i = 0; i < home_counts_.size(); ++i) {
+        const double d = home_counts_[i] - expected;
+        chi_square += d * d;
+      }
+      result_.chi_square = chi_square / expected;
+      result_.chi_square_df = home_counts_.size() - 1;
+    }
+    return result_;
+  }
+
+ private:
+  void end_run() {
+    if (!seen_empty_) {
+      first_run_ = run_;
+      seen_empty_ = true;
+    }
+    result_.longest_cluster = (std::max)(result_.longest_cluster, run_);
+    run_ = 0;
+  }
+
+  hashtable_analysis result_;
+  std::vector<size_t> home_counts_;  // entries that hash to each cell
+  size_t cell_buckets_;              // of cell_buckets_ buckets
+  uint64_t total_displacement_;
+  size_t run_;        // non-empty buckets since the last empty one
+  size_t first_run_;  // those before the first empty bucket
+  bool seen_empty_;
+};
+
 }  // namespace sparsehash_internal
 }  // namespace google
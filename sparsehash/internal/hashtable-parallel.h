@@ -0,0 +1,184 @@
+// Copyright (c) 2010, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Helpers shared by the multi-threaded entry points of dense_hashtable
+// and sparse_hashtable.  Nothing here is thread-safe by itself: the
+// hashtables only use it on work they have already split into disjoint
+// pieces.
+
+#pragma once
+
+#include <cstddef>  // for size_t
+#include <algorithm>  // for min
+#include <exception>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace google {
+
+// What build_from() keeps when its input holds several values with the
+// same key.  KeepFirst gives the same result as insert(first, last).
+enum DuplicateKeyPolicy { KeepFirst, KeepLast };
+
+namespace sparsehash_internal {
+
+// Calls fn(task) for every task in [0, num_tasks), spread over at most
+// num_threads threads; the calling thread is one of them.  Thread t runs
+// tasks t, t + num_threads, ...  If any call throws, the first exception
+// (by thread number) is rethrown once every thread has finished.  If we
+// can't start a thread, its tasks run on the calling thread instead.
+template <typename Fn>
+void run_in_parallel(size_t num_tasks, size_t num_threads, Fn fn) {
+  if (num_threads > num_tasks) num_threads = num_tasks;
+  if (num_threads <= 1) {
+    for (size_t task = 0; task < num_tasks; ++task) fn(task);
+    return;
+  }
+
+  std::vector<std::exception_ptr> errors(num_threads);
+  auto worker = [&](size_t id) {
+    try {
+      for (size_t task = id; task < num_tasks; task += num_threads) fn(task);
+    } catch (...) {
+      errors[id] = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads - 1);
+  size_t started = 1;
+  for (; started < num_threads; ++started) {
+    try {
+      threads.emplace_back(worker, started);
+    } catch (const std::system_error&) {
+      break;  // out of threads: do the rest ourselves
+    }
+  }
+  worker(0);
+  for (size_t id = started; id < num_threads; ++id) worker(id);
+  for (std::thread& t : threads) t.join();
+
+  for (const std::exception_ptr& e : errors) {
+    if (e) std::rethrow_exception(e);
+  }
+}
+
+// How many threads to use when the caller asked for num_threads: 0
+// means one per hardware thread.
+inline size_t resolve_num_threads(size_t num_threads) {
+  if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+  return num_threads == 0 ? 1 : num_threads;
+}
+
+// Cuts [0, n) into a few pieces per thread -- so one slow piece doesn't
+// hold everyone up -- and calls fn(*it) on every element of each
+// range(first, last), which returns a pair of iterators.  fn is shared
+// by all the threads.  This is what for_each_parallel() is made of.
+template <typename Range, typename Fn>
+void for_each_in_pieces(size_t n, size_t num_threads, Range range, Fn& fn) {
+  num_threads = resolve_num_threads(num_threads);
+  const size_t num_pieces = (std::min)(n, 4 * num_threads);
+  run_in_parallel(num_pieces, num_threads, [&](size_t piece) {
+    auto r = range(n * piece / num_pieces, n * (piece + 1) / num_pieces);
+    for (; r.first != r.second; ++r.first) fn(*r.first);
+  });
+}
+
+// Like for_each_in_pieces(), but folds combine(acc, map(element)) over
+// each piece, then folds the per-piece results into init in piece order.
+// init is used exactly once, so it needn't be an identity for combine,
+// but combine has to be associative.
+template <typename T, typename Range, typename Map, typename Combine>
+T reduce_in_pieces(size_t n, size_t num_threads, Range range, T init,
+                   Map& map, Combine& combine) {
+  num_threads = resolve_num_threads(num_threads);
+  const size_t num_pieces = (std::min)(n, 4 * num_threads);
+  std::vector<T> partial(num_pieces, init);
+  std::vector<char> nonempty(num_pieces, 0);  // not vector<bool>: we race
+  run_in_parallel(num_pieces, num_threads, [&](size_t piece) {
+    auto r = range(n * piece / num_pieces, n * (piece + 1) / num_pieces);
+    if (r.first == r.second) return;
+    T acc = map(*r.first);
+    for (++r.first; r.first != r.second; ++r.first)
+      acc = combine(acc, map(*r.first));
+    partial[piece] = acc;
+    nonempty[piece] = 1;
+  });
+  for (size_t piece = 0; piece < num_pieces; ++piece) {
+    if (nonempty[piece]) init = combine(init, partial[piece]);
+  }
+  return init;
+}
+
+// Stable counting sort of the indices [0, n) by region_of(i), which must
+// be < num_regions.  On return (*order)[(*region_begin)[r] ..
+// (*region_begin)[r + 1]) are the indices in region r, in increasing
+// order.  Both the histogram and the scatter pass run on num_threads
+// threads, each over its own contiguous slice of [0, n).
+template <typename RegionOf>
+void partition_by_region(size_t n, size_t num_regions, size_t num_threads,
+                         RegionOf region_of, std::vector<size_t>* order,
+                         std::vector<size_t>* region_begin) {
+  if (num_threads == 0) num_threads = 1;
+  if (num_threads > n) num_threads = n > 0 ? n : 1;
+  // counts[t * num_regions + r]: how many of slice t's indices are in r.
+  std::vector<size_t> counts(num_threads * num_regions, 0);
+  run_in_parallel(num_threads, num_threads, [&](size_t t) {
+    size_t* slice_counts = &counts[t * num_regions];
+    for (size_t i = n * t / num_threads; i < n * (t + 1) / num_threads; ++i)
+      ++slice_counts[region_of(i)];
+  });
+
+  // Turn the counts into starting offsets, region-major, so slice t's
+  // indices land after slice t-1's within each region.
+  region_begin->assign(num_regions + 1, 0);
+  size_t offset = 0;
+  for (size_t r = 0; r < num_regions; ++r) {
+    (*region_begin)[r] = offset;
+    for (size_t t = 0; t < num_threads; ++t) {
+      const size_t count = counts[t * num_regions + r];
+      counts[t * num_regions + r] = offset;
+      offset += count;
+    }
+  }
+  (*region_begin)[num_regions] = offset;
+
+  order->resize(n);
+  run_in_parallel(num_threads, num_threads, [&](size_t t) {
+    size_t* slice_offsets = &counts[t * num_regions];
+    for (size_t i = n * t / num_threads; i < n * (t + 1) / num_threads; ++i)
+      (*order)[slice_offsets[region_of(i)]++] = i;
+  });
+}
+
+}  // namespace sparsehash_internal
+}  // namespace google
@@ -0,0 +1,800 @@
+// Copyright (c) 2010, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// The snapshot format shared by the serialize_snapshot() and
+// unserialize_snapshot() methods of dense_hashtable and
+// sparse_hashtable.  A snapshot is a self-describing header followed by
+// the hashtable's ordinary serialize() output, cut into checksummed
+// chunks:
+//
+//   magic         4 bytes  SNAPSHOT_MAGIC
+//   version       4        SNAPSHOT_VERSION
+//   flags         4        SNAPSHOT_LITTLE_ENDIAN, SNAPSHOT_SPARSE,
+//                          SNAPSHOT_INDEXED, SNAPSHOT_DELTA
+//   key size      4        sizeof(key_type)
+//   value size    4        sizeof(value_type)
+//   hasher tag    8        see snapshot_hasher_tag()
+//   bucket count  8
+//   element count 8
+//   chunk size    4        the most payload any chunk holds
+//   header CRC    4        CRC32C of all of the above
+//   chunks                 each: payload length (4), CRC32C of the
+//                          payload (4), payload; a chunk with length 0
+//                          ends the snapshot
+//
+// All the numbers above are big-endian, as in the older format.  The
+// payload is whatever serialize() writes, so with NopointerSerializer
+// the values are in the writer's native byte order: the flags say which
+// that was, and a machine with the other byte order refuses the file.
+//
+// serialize_parallel() writes an indexed snapshot instead, whose chunks
+// can be encoded and decoded independently.  The header is the same,
+// but with SNAPSHOT_INDEXED set and the chunk size counting buckets
+// (dense_hashtable) or sparsegroups (sparse_hashtable) rather than
+// bytes.  Chunk i holds buckets or groups [i * chunk size, (i + 1) *
+// chunk size), each in the table's own encoding, in frames of:
+//
+//   payload length 8, CRC32C of the payload 4, payload
+//
+// A frame with length 0 ends the chunks, and an index follows: the
+// number of chunks (8), the offset of each chunk's frame from the
+// first frame (8 each), and a CRC32C of the index (4).
+//
+// sparse_hashtable::serialize_delta() writes a delta: the header, with
+// SNAPSHOT_DELTA set and the counts the table has after the delta, and
+// then, in chunks as in the first format,
+//
+//   from epoch     8      the delta applies to a table at this epoch
+//   to epoch       8      and leaves it at this one
+//   deleted count  8      the table's num_deleted afterwards
+//   erased bits    1      1 if each group is followed by its bits of
+//                         erased_buckets (physical-erase mode)
+//   group count    8
+//   groups                each: its index (8), the group as
+//                         sparsetable::write_groups() writes it, and
+//                         perhaps GROUP_SIZE / 8 bytes of erased bits
+
+#pragma once
+
+#include <cstddef>  // for size_t, offsetof
+#include <cstdint>  // for uint32_t, uint64_t
+#include <cstring>  // for memcpy, strlen
+#include <algorithm>  // for min
+#include <atomic>
+#include <memory>     // for unique_ptr
+#include <mutex>
+#include <typeinfo>   // for typeid
+#include <vector>
+#include <sparsehash/internal/hashtable-common.h>
+#include <sparsehash/internal/hashtable-parallel.h>
+
+namespace google {
+namespace sparsehash_internal {
+
+// ----- CRC32C ----
+
+// The Castagnoli CRC (as used by iSCSI, ext4, ...), computed a byte at a
+// time from a table, or with the crc32 instruction when the CPU has
+// SSE4.2.  Pass the previous result as crc to checksum data in pieces;
+// start from 0.
+inline const uint32_t* crc32c_table() {
+  struct Table {
+    uint32_t entries[256];
+    Table() {
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+          crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        entries[i] = crc;
+      }
+    }
+  };
+  static const Table table;
+  return table.entries;
+}
+
+inline uint32_t crc32c_portable(uint32_t crc, const unsigned char* p,
+                                size_t length) {
+  const uint32_t* table = crc32c_table();
+  for (; length > 0; --length, ++p) crc = table[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define SPARSEHASH_HAVE_CRC32C_SSE42 1
+__attribute__((target("sse4.2"))) inline uint32_t crc32c_sse42(
+    uint32_t crc, const unsigned char* p, size_t length) {
+  uint64_t crc64 = crc;
+  for (; length >= 8; length -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc64 = __builtin_ia32_crc32di(crc64, word);
+  }
+  uint32_t crc32 = static_cast<uint32_t>(crc64);
+  for (; length > 0; --length, ++p) crc32 = __builtin_ia32_crc32qi(crc32, *p);
+  return crc32;
+}
+
+inline bool cpu_has_sse42() {
+  static const bool has_sse42 = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") != 0;
+  }();
+  return has_sse42;
+}
+#endif
+
+inline uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  crc = ~crc;
+#ifdef SPARSEHASH_HAVE_CRC32C_SSE42
+  if (cpu_has_sse42()) return ~crc32c_sse42(crc, p, length);
+#endif
+  return ~crc32c_portable(crc, p, length);
+}
+
+// ----- the header ----
+
+static const uint32_t SNAPSHOT_MAGIC = 0x53485632;  // "SHV2"
+static const uint32_t SNAPSHOT_VERSION = 2;
+static const uint32_t SNAPSHOT_LITTLE_ENDIAN = 1;  // flag: values' byte order
+static const uint32_t SNAPSHOT_SPARSE = 2;  // flag: sparse_hashtable layout
+static const uint32_t SNAPSHOT_INDEXED = 4;  // flag: serialize_parallel()
+static const uint32_t SNAPSHOT_DELTA = 8;    // flag: serialize_delta()
+static const size_t SNAPSHOT_HEADER_SIZE = 52;  // including the magic
+static const uint32_t SNAPSHOT_CHUNK_SIZE = 1 << 16;
+
+struct snapshot_header {
+  uint32_t version;
+  uint32_t flags;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint64_t hasher_tag;
+  uint64_t num_buckets;
+  uint64_t num_elements;
+  uint32_t chunk_size;
+
+  bool indexed() const { return (flags & SNAPSHOT_INDEXED) != 0; }
+  bool delta() const { return (flags & SNAPSHOT_DELTA) != 0; }
+
+  // True if a table described by expected can read this snapshot:
+  // everything but the counts and the layout has to match.
+  bool compatible_with(const snapshot_header& expected) const {
+    return version == expected.version &&
+           (flags & ~SNAPSHOT_INDEXED) == expected.flags &&
+           key_size == expected.key_size &&
+           value_size == expected.value_size &&
+           hasher_tag == expected.hasher_tag && chunk_size > 0 &&
+           chunk_size <= (1u << 30);
+  }
+};
+
+inline bool host_is_little_endian() {
+  const uint32_t one = 1;
+  unsigned char first_byte;
+  memcpy(&first_byte, &one, 1);
+  return first_byte == 1;
+}
+
+// Identifies the hash function, so a table isn't loaded by code that
+// would look its keys up in the wrong buckets.  We can't look inside
+// the hasher, so this goes by the names of its type and of the key
+// type; that catches the common mistakes, but not, say, two builds
+// whose std::hash<> differ.
+template <typename Hasher, typename Key>
+uint64_t snapshot_hasher_tag() {
+  const char* hasher_name = typeid(Hasher).name();
+  const char* key_name = typeid(Key).name();
+  return (static_cast<uint64_t>(crc32c(0, hasher_name, strlen(hasher_name)))
+          << 32) |
+         crc32c(0, key_name, strlen(key_name));
+}
+
+// What a table of this type would write, counts aside.
+template <typename Hasher, typename Key, typename Value>
+snapshot_header expected_snapshot_header(bool sparse) {
+  snapshot_header header;
+  header.version = SNAPSHOT_VERSION;
+  header.flags = (host_is_little_endian() ? SNAPSHOT_LITTLE_ENDIAN : 0) |
+                 (sparse ? SNAPSHOT_SPARSE : 0);
+  header.key_size = sizeof(Key);
+  header.value_size = sizeof(Value);
+  header.hasher_tag = snapshot_hasher_tag<Hasher, Key>();
+  header.num_buckets = 0;
+  header.num_elements = 0;
+  header.chunk_size = SNAPSHOT_CHUNK_SIZE;
+  return header;
+}
+
+inline void put_bigendian(unsigned char** p, uint64_t value, int length) {
+  for (int i = length - 1; i >= 0; --i) {
+    (*p)[i] = static_cast<unsigned char>(value & 255);
+    value >>= 8;
+  }
+  *p += length;
+}
+
+inline uint64_t get_bigendian(const unsigned char** p, int length) {
+  uint64_t value = 0;
+  for (int i = 0; i < length; ++i) value = (value << 8) | (*p)[i];
+  *p += length;
+  return value;
+}
+
+template <typename OUTPUT>
+bool write_snapshot_header(OUTPUT* fp, const snapshot_header& header) {
+  unsigned char bytes[SNAPSHOT_HEADER_SIZE];
+  unsigned char* p = bytes;
+  put_bigendian(&p, SNAPSHOT_MAGIC, 4);
+  put_bigendian(&p, header.version, 4);
+  put_bigendian(&p, header.flags, 4);
+  put_bigendian(&p, header.key_size, 4);
+  put_bigendian(&p, header.value_size, 4);
+  put_bigendian(&p, header.hasher_tag, 8);
+  put_bigendian(&p, header.num_buckets, 8);
+  put_bigendian(&p, header.num_elements, 8);
+  put_bigendian(&p, header.chunk_size, 4);
+  put_bigendian(&p, crc32c(0, bytes, p - bytes), 4);
+  return write_data(fp, bytes, sizeof(bytes));
+}
+
+// Reads the rest of a header whose magic number has already been read
+// (so the caller can tell a snapshot from the older format).  False if
+// it can't be read or its checksum is wrong.
+template <typename INPUT>
+bool read_snapshot_header_after_magic(INPUT* fp, snapshot_header* header) {
+  unsigned char bytes[SNAPSHOT_HEADER_SIZE];
+  unsigned char* magic = bytes;
+  put_bigendian(&magic, SNAPSHOT_MAGIC, 4);
+  if (!read_data(fp, bytes + 4, sizeof(bytes) - 4)) return false;
+  const unsigned char* p = bytes + 4;
+  header->version = static_cast<uint32_t>(get_bigendian(&p, 4));
+  header->flags = static_cast<uint32_t>(get_bigendian(&p, 4));
+  header->key_size = static_cast<uint32_t>(get_bigendian(&p, 4));
+  header->value_size = static_cast<uint32_t>(get_bigendian(&p, 4));
+  header->hasher_tag = get_bigendian(&p, 8);
+  header->num_buckets = get_bigendian(&p, 8);
+  header->num_elements = get_bigendian(&p, 8);
+  header->chunk_size = static_cast<uint32_t>(get_bigendian(&p, 4));
+  const uint32_t crc = crc32c(0, bytes, p - bytes);
+  return get_bigendian(&p, 4) == crc;
+}
+
+// ----- the chunks ----
+
+// An OUTPUT that cuts what's written to it into checksummed chunks of
+// up to SNAPSHOT_CHUNK_SIZE bytes.  finish() writes the last chunk and
+// the end marker, and says whether everything made it out.
+template <typename OUTPUT>
+class checksummed_writer {
+ public:
+  explicit checksummed_writer(OUTPUT* fp) : fp_(fp), ok_(true) {
+    payload_.reserve(SNAPSHOT_CHUNK_SIZE);
+  }
+
+  size_t Write(const void* data, size_t length) {
+    const char* bytes = static_cast<const char*>(data);
+    size_t left = length;
+    while (ok_ && left > 0) {
+      const size_t n = (std::min)(left, SNAPSHOT_CHUNK_SIZE - payload_.size());
+      payload_.insert(payload_.end(), bytes, bytes + n);
+      bytes += n;
+      left -= n;
+      if (payload_.size() == SNAPSHOT_CHUNK_SIZE) write_chunk();
+    }
+    return ok_ ? length : 0;
+  }
+
+  bool finish() {
+    if (!payload_.empty()) write_chunk();
+    write_chunk();  // the empty chunk that ends the snapshot
+    return ok_;
+  }
+
+ private:
+  void write_chunk() {
+    if (!ok_) return;
+    unsigned char frame[8];
+    unsigned char* p = frame;
+    put_bigendian(&p, payload_.size(), 4);
+    put_bigendian(&p, crc32c(0, payload_.data(), payload_.size()), 4);
+    ok_ = write_data(fp_, frame, sizeof(frame)) &&
+          (payload_.empty() ||
+           write_data(fp_, payload_.data(), payload_.size()));
+    payload_.clear();
+  }
+
+  OUTPUT* fp_;
+  std::vector<char> payload_;
+  bool ok_;
+
+  checksummed_writer(const checksummed_writer&);  // not copyable
+  void operator=(const checksummed_writer&);
+};
+
+// Reads one chunk into *payload, checking its CRC.  Returns false if
+// the chunk can't be read, is bigger than max_size, or is corrupt.  An
+// empty payload is the end of the snapshot.
+template <typename INPUT>
+bool read_snapshot_chunk(INPUT* fp, size_t max_size,
+                         std::vector<char>* payload) {
+  unsigned char frame[8];
+  if (!read_data(fp, frame, sizeof(frame))) return false;
+  const unsigned char* p = frame;
+  const size_t length = static_cast<size_t>(get_bigendian(&p, 4));
+  const uint32_t crc = static_cast<uint32_t>(get_bigendian(&p, 4));
+  if (length > max_size) return false;
+  payload->resize(length);
+  if (length > 0 && !read_data(fp, payload->data(), length)) return false;
+  return crc32c(0, payload->data(), length) == crc;
+}
+
+// The INPUT that undoes checksummed_writer.  A chunk is only handed out
+// once its checksum has been verified; a bad or missing chunk makes
+// every later Read() fail.  finish() checks that all the data has been
+// read and that the end marker follows.
+template <typename INPUT>
+class checksummed_reader {
+ public:
+  checksummed_reader(INPUT* fp, size_t chunk_size)
+      : fp_(fp), chunk_size_(chunk_size), pos_(0), ok_(true), done_(false) {}
+
+  size_t Read(void* data, size_t length) {
+    char* out = static_cast<char*>(data);
+    size_t left = length;
+    while (left > 0) {
+      if (pos_ == payload_.size() && !next_chunk()) return 0;
+      const size_t n = (std::min)(left, payload_.size() - pos_);
+      memcpy(out, payload_.data() + pos_, n);
+      pos_ += n;
+      out += n;
+      left -= n;
+    }
+    return length;
+  }
+
+  bool finish() {
+    if (pos_ != payload_.size()) return false;  // data nobody read
+    if (!done_ && next_chunk()) return false;   // ditto
+    return ok_ && done_;
+  }
+
+ private:
+  // Loads the next non-empty chunk; false at the end, or on error.
+  bool next_chunk() {
+    if (!ok_ || done_) return false;
+    pos_ = 0;
+    ok_ = read_snapshot_chunk(fp_, chunk_size_, &payload_);
+    if (!ok_) payload_.clear();
+    done_ = ok_ && payload_.empty();
+    return ok_ && !done_;
+  }
+
+  INPUT* fp_;
+  size_t chunk_size_;
+  std::vector<char> payload_;
+  size_t pos_;  // next byte of payload_ to hand out
+  bool ok_;     // false once anything went wrong
+  bool done_;   // true once we've seen the end marker
+
+  checksummed_reader(const checksummed_reader&);  // not copyable
+  void operator=(const checksummed_reader&);
+};
+
+// An INPUT that first gives back a few bytes we've already read from
+// fp, then carries on with fp.  unserialize_snapshot() uses it to hand
+// a file in the older format, magic number and all, to unserialize().
+template <typename INPUT>
+class replay_reader {
+ public:
+  replay_reader(INPUT* fp, const unsigned char* bytes, size_t length)
+      : fp_(fp), bytes_(bytes, bytes + length), pos_(0) {}
+
+  size_t Read(void* data, size_t length) {
+    const size_t n = (std::min)(length, bytes_.size() - pos_);
+    if (n > 0) memcpy(data, bytes_.data() + pos_, n);
+    pos_ += n;
+    if (n < length &&
+        !read_data(fp_, static_cast<char*>(data) + n, length - n))
+      return 0;
+    return length;
+  }
+
+ private:
+  INPUT* fp_;
+  std::vector<unsigned char> bytes_;
+  size_t pos_;
+};
+
+// ----- indexed snapshots ----
+
+// An OUTPUT that appends to a vector, and an INPUT that reads from a
+// piece of memory.  The chunks of an indexed snapshot are encoded into
+// the one and decoded from the other, each thread with its own.
+class memory_writer {
+ public:
+  explicit memory_writer(std::vector<char>* buffer) : buffer_(buffer) {}
+
+  size_t Write(const void* data, size_t length) {
+    const char* bytes = static_cast<const char*>(data);
+    buffer_->insert(buffer_->end(), bytes, bytes + length);
+    return length;
+  }
+
+ private:
+  std::vector<char>* buffer_;
+};
+
+class memory_reader {
+ public:
+  memory_reader(const char* data, size_t length)
+      : pos_(data), end_(data + length) {}
+
+  size_t Read(void* data, size_t length) {
+    if (length > static_cast<size_t>(end_ - pos_)) return 0;
+    if (length > 0) memcpy(data, pos_, length);
+    pos_ += length;
+    return length;
+  }
+
+  bool at_end() const { return pos_ == end_; }
+
+ private:
+  const char* pos_;
+  const char* end_;
+};
+
+static const size_t SNAPSHOT_FRAME_HEADER_SIZE = 12;
+
+// How many chunks each thread has in flight: one being decoded, say,
+// while the next is read.
+static const size_t SNAPSHOT_CHUNKS_PER_THREAD = 2;
+
+template <typename OUTPUT>
+bool write_snapshot_frame(OUTPUT* fp, const std::vector<char>& payload,
+                          uint32_t crc) {
+  unsigned char frame[SNAPSHOT_FRAME_HEADER_SIZE];
+  unsigned char* p = frame;
+  put_bigendian(&p, payload.size(), 8);
+  put_bigendian(&p, crc, 4);
+  return write_data(fp, frame, sizeof(frame)) &&
+         (payload.empty() || write_data(fp, payload.data(), payload.size()));
+}
+
+// Reads a frame, without checking its CRC.  The payload grows as it's
+// read, so a corrupt length runs into the end of fp rather than into a
+// huge allocation.
+template <typename INPUT>
+bool read_snapshot_frame(INPUT* fp, std::vector<char>* payload,
+                         uint32_t* crc) {
+  unsigned char frame[SNAPSHOT_FRAME_HEADER_SIZE];
+  if (!read_data(fp, frame, sizeof(frame))) return false;
+  const unsigned char* p = frame;
+  const uint64_t length = get_bigendian(&p, 8);
+  *crc = static_cast<uint32_t>(get_bigendian(&p, 4));
+  payload->clear();
+  while (payload->size() < length) {
+    const size_t old_size = payload->size();
+    const size_t n = static_cast<size_t>(
+        (std::min)(length - old_size, static_cast<uint64_t>(1) << 20));
+    payload->resize(old_size + n);
+    if (!read_data(fp, payload->data() + old_size, n)) return false;
+  }
+  return true;
+}
+
+// Writes the end marker and the index of frame offsets.
+template <typename OUTPUT>
+bool write_snapshot_index(OUTPUT* fp, const std::vector<uint64_t>& offsets) {
+  if (!write_snapshot_frame(fp, std::vector<char>(), crc32c(0, "", 0)))
+    return false;
+  std::vector<unsigned char> index(8 * (offsets.size() + 1) + 4);
+  unsigned char* p = index.data();
+  put_bigendian(&p, offsets.size(), 8);
+  for (uint64_t offset : offsets) put_bigendian(&p, offset, 8);
+  put_bigendian(&p, crc32c(0, index.data(), p - index.data()), 4);
+  return write_data(fp, index.data(), index.size());
+}
+
+// Reads the index that follows the end marker, and checks it against
+// the offsets at which we actually found the frames.
+template <typename INPUT>
+bool read_snapshot_index(INPUT* fp, const std::vector<uint64_t>& offsets) {
+  std::vector<unsigned char> index(8 * (offsets.size() + 1) + 4);
+  if (!read_data(fp, index.data(), index.size())) return false;
+  const unsigned char* p = index.data();
+  if (get_bigendian(&p, 8) != offsets.size()) return false;
+  for (uint64_t offset : offsets) {
+    if (get_bigendian(&p, 8) != offset) return false;
+  }
+  const uint32_t crc = crc32c(0, index.data(), p - index.data());
+  return get_bigendian(&p, 4) == crc;
+}
+
+// Writes chunks [0, num_chunks) of an indexed snapshot, and the index.
+// encode(chunk, memory_writer*) appends a chunk's payload, which mustn't
+// be empty, and returns false on error.  Chunks are encoded and
+// checksummed a batch at a time on num_threads threads, then written out
+// in order by the calling thread.
+template <typename OUTPUT, typename Encode>
+bool write_indexed_chunks(OUTPUT* fp, size_t num_chunks, size_t num_threads,
+                          Encode encode) {
+  const size_t batch_size = SNAPSHOT_CHUNKS_PER_THREAD * num_threads;
+  std::vector<std::vector<char>> payloads((std::min)(batch_size, num_chunks));
+  std::vector<uint32_t> crcs(payloads.size());
+  std::vector<char> ok(payloads.size());  // not vector<bool>: we race
+  std::vector<uint64_t> offsets;
+  offsets.reserve(num_chunks);
+  uint64_t offset = 0;
+  for (size_t first = 0; first < num_chunks; first += batch_size) {
+    const size_t n = (std::min)(batch_size, num_chunks - first);
+    run_in_parallel(n, num_threads, [&](size_t k) {
+      payloads[k].clear();
+      memory_writer out(&payloads[k]);
+      ok[k] = encode(first + k, &out) && !payloads[k].empty();
+      crcs[k] = crc32c(0, payloads[k].data(), payloads[k].size());
+    });
+    for (size_t k = 0; k < n; ++k) {
+      if (!ok[k] || !write_snapshot_frame(fp, payloads[k], crcs[k]))
+        return false;
+      offsets.push_back(offset);
+      offset += SNAPSHOT_FRAME_HEADER_SIZE + payloads[k].size();
+    }
+  }
+  return write_snapshot_index(fp, offsets);
+}
+
+// The other half of write_indexed_chunks(): reads num_chunks frames a
+// batch at a time, then checks and decodes the batch on num_threads
+// threads.  decode(chunk, data, length) returns false if the payload is
+// no good.  Succeeds only if every chunk decodes and the index checks
+// out.
+template <typename INPUT, typename Decode>
+bool read_indexed_chunks(INPUT* fp, size_t num_chunks, size_t num_threads,
+                         Decode decode) {
+  const size_t batch_size = SNAPSHOT_CHUNKS_PER_THREAD * num_threads;
+  std::vector<std::vector<char>> payloads((std::min)(batch_size, num_chunks));
+  std::vector<uint32_t> crcs(payloads.size());
+  std::vector<char> ok(payloads.size());
+  std::vector<uint64_t> offsets;
+  offsets.reserve(num_chunks);
+  uint64_t offset = 0;
+  for (size_t first = 0; first < num_chunks; first += batch_size) {
+    const size_t n = (std::min)(batch_size, num_chunks - first);
+    for (size_t k = 0; k < n; ++k) {
+      if (!read_snapshot_frame(fp, &payloads[k], &crcs[k]) ||
+          payloads[k].empty())
+        return false;
+      offsets.push_back(offset);
+      offset += SNAPSHOT_FRAME_HEADER_SIZE + payloads[k].size();
+    }
+    run_in_parallel(n, num_threads, [&](size_t k) {
+      ok[k] = crc32c(0, payloads[k].data(), payloads[k].size()) == crcs[k] &&
+              decode(first + k, payloads[k].data(), payloads[k].size());
+    });
+    for (size_t k = 0; k < n; ++k) {
+      if (!ok[k]) return false;
+    }
+  }
+  std::vector<char> end_marker;
+  uint32_t crc;
+  return read_snapshot_frame(fp, &end_marker, &crc) && end_marker.empty() &&
+         crc == crc32c(0, "", 0) && read_snapshot_index(fp, offsets);
+}
+
+// ----- the memory-mappable layout ----
+
+// sparse_hashtable::serialize_mappable() writes a table so that
+// sparse_hash_map_view can look things up in it where it lies, e.g. in
+// a file mapped into memory.  It starts with this header, written as
+// is, native byte order and all; then come the groups' bitmaps, one
+// after the other; then, at offsets_offset, a uint64_t per group saying
+// how many values precede it, plus one for the total; then, at
+// values_offset, the values themselves, as NopointerSerializer would
+// write them.  Both offsets are from the start of the header and
+// suitably aligned.
+static const uint32_t MAPPABLE_MAGIC = 0x53484d31;  // "SHM1"
+static const uint32_t MAPPABLE_VERSION = 1;
+
+struct mappable_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t flags;  // SNAPSHOT_LITTLE_ENDIAN, or not
+  uint32_t value_size;
+  uint32_t value_align;
+  uint32_t group_size;  // buckets per group
+  uint64_t hasher_tag;  // see snapshot_hasher_tag()
+  uint64_t num_buckets;
+  uint64_t num_elements;
+  uint64_t offsets_offset;
+  uint64_t values_offset;
+  uint64_t file_size;
+  uint32_t header_crc;  // CRC32C of everything above
+  uint32_t unused;
+
+  uint32_t compute_crc() const {
+    return crc32c(0, this, offsetof(mappable_header, header_crc));
+  }
+};
+
+inline uint64_t round_up(uint64_t n, uint64_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+// Fills in a header for a table of num_groups groups whose bitmaps are
+// bitmap_size bytes each, given everything but the offsets.
+inline void set_mappable_layout(mappable_header* header, uint64_t num_groups,
+                                uint64_t bitmap_size) {
+  header->offsets_offset =
+      round_up(sizeof(mappable_header) + num_groups * bitmap_size, 8);
+  header->values_offset =
+      round_up(header->offsets_offset + 8 * (num_groups + 1),
+               (std::max)(uint64_t(8), uint64_t(header->value_align)));
+  header->file_size =
+      header->values_offset + header->num_elements * header->value_size;
+}
+
+// Writes zeros until *written reaches target.
+template <typename OUTPUT>
+bool write_padding(OUTPUT* fp, uint64_t* written, uint64_t target) {
+  static const char zeros[64] = {0};
+  while (*written < target) {
+    const size_t n =
+        static_cast<size_t>((std::min)(target - *written, uint64_t(64)));
+    if (!write_data(fp, zeros, n)) return false;
+    *written += n;
+  }
+  return true;
+}
+
+// ----- copy-on-write snapshots ----
+
+// The state behind a hashtable's begin_snapshot() / write_snapshot() /
+// end_snapshot().  The table is cut into pages (chunks of an indexed
+// snapshot), each of which is, at any time, pending (untouched since
+// the snapshot began, and not yet written), saved (copied aside because
+// the owning thread was about to change it), or written.  The owning
+// thread calls before_write() before changing a page; the thread
+// writing the snapshot calls encode_page() for each page in turn.
+// Both take the lock only while a page is pending, so the owner's
+// writes cost one atomic load once a page is saved or written, and at
+// worst wait while a single page is encoded.
+template <typename Page>
+class cow_snapshot {
+ public:
+  cow_snapshot(const snapshot_header& header, size_t num_pages)
+      : header_(header),
+        num_pages_(num_pages),
+        state_(new std::atomic<unsigned char>[num_pages]()),
+        saved_(num_pages) {}
+
+  const snapshot_header& header() const { return header_; }
+  size_t num_pages() const { return num_pages_; }
+
+  // Called by the owning thread before page p changes.  save() returns
+  // a copy of the live page, as a unique_ptr<Page>.  Pages past the end
+  // are ones the table has grown since the snapshot began, by which time
+  // every page is saved.
+  template <typename Save>
+  void before_write(size_t p, Save save) {
+    if (p >= num_pages_ ||
+        state_[p].load(std::memory_order_acquire) != PENDING)
+      return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_[p].load(std::memory_order_relaxed) != PENDING) return;
+    saved_[p] = save();
+    state_[p].store(SAVED, std::memory_order_release);
+  }
+
+  // Called by the writing thread, once per page: encode(saved) encodes
+  // the copy if there is one, or the live page if saved is NULL (which
+  // the owner can't change meanwhile).  The copy is freed afterwards.
+  template <typename Encode>
+  bool encode_page(size_t p, Encode encode) {
+    std::unique_ptr<Page> saved;
+    bool ok = true;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (state_[p].load(std::memory_order_relaxed) == SAVED) {
+        saved.swap(saved_[p]);
+      } else {
+        ok = encode(static_cast<const Page*>(NULL));
+      }
+      state_[p].store(WRITTEN, std::memory_order_release);
+    }
+    if (saved) ok = encode(static_cast<const Page*>(saved.get()));
+    return ok;
+  }
+
+ private:
+  enum { PENDING = 0, SAVED, WRITTEN };
+
+  const snapshot_header header_;
+  const size_t num_pages_;
+  std::unique_ptr<std::atomic<unsigned char>[]> state_;
+  std::vector<std::unique_ptr<Page>> saved_;  // only for SAVED pages
+  std::mutex mutex_;
+
+  cow_snapshot(const cow_snapshot&);  // not copyable
+  void operator=(const cow_snapshot&);
+};
+
+// What write_snapshot() does for either hashtable: the header, then the
+// pages, encoded one at a time by encode_page(page, memory_writer*).
+template <typename OUTPUT, typename Page, typename EncodePage>
+bool write_cow_snapshot(OUTPUT* fp, cow_snapshot<Page>* snapshot,
+                        EncodePage encode_page) {
+  if (!write_snapshot_header(fp, snapshot->header())) return false;
+  return write_indexed_chunks(
+      fp, snapshot->num_pages(), 1,
+      [&](size_t page, memory_writer* out) {
+        return snapshot->encode_page(page, [&](const Page* saved) {
+          return encode_page(page, saved, out);
+        });
+      });
+}
+
+// Checks a snapshot without loading it: the header has to be intact and
+// match expected (see snapshot_header::compatible_with()), and every
+// chunk's checksum has to be right, through to the end marker (and, for
+// an indexed snapshot, the index).  The older format has no checksums,
+// so it never passes.
+template <typename INPUT>
+bool validate_snapshot(INPUT* fp, const snapshot_header& expected) {
+  uint32_t magic;
+  if (!read_bigendian_number(fp, &magic, 4) || magic != SNAPSHOT_MAGIC)
+    return false;
+  snapshot_header header;
+  if (!read_snapshot_header_after_magic(fp, &header) ||
+      !header.compatible_with(expected))
+    return false;
+  std::vector<char> payload;
+  if (!header.indexed()) {
+    do {
+      if (!read_snapshot_chunk(fp, header.chunk_size, &payload)) return false;
+    } while (!payload.empty());
+    return true;
+  }
+  std::vector<uint64_t> offsets;
+  uint64_t offset = 0;
+  uint32_t crc;
+  do {
+    if (!read_snapshot_frame(fp, &payload, &crc) ||
+        crc32c(0, payload.data(), payload.size()) != crc)
+      return false;
+    if (!payload.empty()) offsets.push_back(offset);
+    offset += SNAPSHOT_FRAME_HEADER_SIZE + payload.size();
+  } while (!payload.empty());
+  return read_snapshot_index(fp, offsets);
+}
+
+}  // namespace sparsehash_internal
+}  // namespace google
@@ -99,18 +99,18 @@
 #include <algorithm>    // For swap(), eg
 #include <iterator>     // for iterator tags
 #include <limits>       // for numeric_limits
+#include <memory>       // for unique_ptr
 #include <utility>      // for pair
 #include <type_traits>  // for remove_const
+#include <vector>
 #include <sparsehash/internal/hashtable-common.h>
+#include <sparsehash/internal/hashtable-parallel.h>
+#include <sparsehash/internal/hashtable-snapshot.h>
 #include <sparsehash/sparsetable>  // IWYU pragma: export
 #include <stdexcept>               // For length_error
 
 namespace google {
 
-#ifndef SPARSEHASH_STAT_UPDATE
-#define SPARSEHASH_STAT_UPDATE(x) ((void)0)
-#endif
-
 // The probing method
 // Linear probing
 // #define JUMP_(key, num_probes)    ( 1 )
@@ -139,28 +139,33 @@ static const uint16_t DEFAULT_GROUP_SIZE = 48;  // fits in 1.5 words
 // EqualKey: Given two Keys, says whether they are the same (that is,
 //           if they are both associated with the same Value).
 // Alloc: STL allocator to use to allocate memory.
+// Stats: no_stats, or count_stats to count lookups, probes and resizes
+//        for stats() (see hashtable-common.h).
 
 template <class Value, class Key, class HashFcn, class ExtractKey, class SetKey,
-          class EqualKey, class Alloc>
+          class EqualKey, class Alloc, class Stats = no_stats>
 class sparse_hashtable;
 
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
 struct sparse_hashtable_iterator;
 
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
 struct sparse_hashtable_const_iterator;
 
 // As far as iterating, we're basically just a sparsetable
 // that skips over deleted elements.
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
 struct sparse_hashtable_iterator {
  private:
   using value_alloc_type =
       typename std::allocator_traits<A>::template rebind_alloc<V>;
 
  public:
-  typedef sparse_hashtable_iterator<V, K, HF, ExK, SetK, EqK, A> iterator;
-  typedef sparse_hashtable_const_iterator<V, K, HF, ExK, SetK, EqK, A>
+  typedef sparse_hashtable_iterator<V, K, HF, ExK, SetK, EqK, A, St> iterator;
+  typedef sparse_hashtable_const_iterator<V, K, HF, ExK, SetK, EqK, A, St>
       const_iterator;
   typedef typename sparsetable<V, DEFAULT_GROUP_SIZE,
                                value_alloc_type>::nonempty_iterator st_iterator;
@@ -174,8 +179,8 @@ struct sparse_hashtable_iterator {
 
   // "Real" constructor and default constructor
   sparse_hashtable_iterator(
-      const sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>* h, st_iterator it,
-      st_iterator it_end)
+      sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>* h,
+      st_iterator it, st_iterator it_end)
       : ht(h), pos(it), end(it_end) {
     advance_past_deleted();
   }
@@ -191,6 +196,7 @@ struct sparse_hashtable_iterator {
   // we're not on a marked-deleted array element
   void advance_past_deleted() {
     while (pos != end && ht->test_deleted(*this)) ++pos;
+    if (pos != end) ht->before_write_at(pos);  // we may change *pos
   }
   iterator& operator++() {
     assert(pos != end);
@@ -209,20 +215,21 @@ struct sparse_hashtable_iterator {
   bool operator!=(const iterator& it) const { return pos != it.pos; }
 
   // The actual data
-  const sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>* ht;
+  sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>* ht;
   st_iterator pos, end;
 };
 
 // Now do it all again, but with const-ness!
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
 struct sparse_hashtable_const_iterator {
  private:
   using value_alloc_type =
       typename std::allocator_traits<A>::template rebind_alloc<V>;
 
  public:
-  typedef sparse_hashtable_iterator<V, K, HF, ExK, SetK, EqK, A> iterator;
-  typedef sparse_hashtable_const_iterator<V, K, HF, ExK, SetK, EqK, A>
+  typedef sparse_hashtable_iterator<V, K, HF, ExK, SetK, EqK, A, St> iterator;
+  typedef sparse_hashtable_const_iterator<V, K, HF, ExK, SetK, EqK, A, St>
       const_iterator;
   typedef typename sparsetable<V, DEFAULT_GROUP_SIZE,
                                value_alloc_type>::const_nonempty_iterator
@@ -237,8 +244,8 @@ struct sparse_hashtable_const_iterator {
 
   // "Real" constructor and default constructor
   sparse_hashtable_const_iterator(
-      const sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>* h, st_iterator it,
-      st_iterator it_end)
+      const sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>* h,
+      st_iterator it, st_iterator it_end)
       : ht(h), pos(it), end(it_end) {
     advance_past_deleted();
   }
@@ -275,19 +282,20 @@ struct sparse_hashtable_const_iterator {
   bool operator!=(const const_iterator& it) const { return pos != it.pos; }
 
   // The actual data
-  const sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>* ht;
+  const sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>* ht;
   st_iterator pos, end;
 };
 
 // And once again, but this time freeing up memory as we iterate
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
 struct sparse_hashtable_destructive_iterator {
  private:
   using value_alloc_type =
       typename std::allocator_traits<A>::template rebind_alloc<V>;
 
  public:
-  typedef sparse_hashtable_destructive_iterator<V, K, HF, ExK, SetK, EqK, A>
+  typedef sparse_hashtable_destructive_iterator<V, K, HF, ExK, SetK, EqK, A, St>
       iterator;
   typedef
       typename sparsetable<V, DEFAULT_GROUP_SIZE,
@@ -302,8 +310,8 @@ struct sparse_hashtable_destructive_iterator {
 
   // "Real" constructor and default constructor
   sparse_hashtable_destructive_iterator(
-      const sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>* h, st_iterator it,
-      st_iterator it_end)
+      const sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>* h,
+      st_iterator it, st_iterator it_end)
       : ht(h), pos(it), end(it_end) {
     advance_past_deleted();
   }
@@ -337,16 +345,18 @@ struct sparse_hashtable_destructive_iterator {
   bool operator!=(const iterator& it) const { return pos != it.pos; }
 
   // The actual data
-  const sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>* ht;
+  const sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>* ht;
   st_iterator pos, end;
 };
 
 template <class Value, class Key, class HashFcn, class ExtractKey, class SetKey,
-          class EqualKey, class Alloc>
+          class EqualKey, class Alloc, class Stats>
 class sparse_hashtable {
  private:
   using value_alloc_type =
       typename std::allocator_traits<Alloc>::template rebind_alloc<Value>;
+  using erased_alloc_type =
+      typename std::allocator_traits<Alloc>::template rebind_alloc<bool>;
 
  public:
   typedef Key key_type;
@@ -362,14 +372,15 @@ class sparse_hashtable {
   typedef typename value_alloc_type::pointer pointer;
   typedef typename value_alloc_type::const_pointer const_pointer;
   typedef sparse_hashtable_iterator<Value, Key, HashFcn, ExtractKey, SetKey,
-                                    EqualKey, Alloc> iterator;
+                                    EqualKey, Alloc, Stats> iterator;
 
-  typedef sparse_hashtable_const_iterator<
-      Value, Key, HashFcn, ExtractKey, SetKey, EqualKey, Alloc> const_iterator;
+  typedef sparse_hashtable_const_iterator<Value, Key, HashFcn, ExtractKey,
+                                          SetKey, EqualKey, Alloc, Stats>
+      const_iterator;
 
   typedef sparse_hashtable_destructive_iterator<Value, Key, HashFcn, ExtractKey,
-                                                SetKey, EqualKey,
-                                                Alloc> destructive_iterator;
+                                                SetKey, EqualKey, Alloc, Stats>
+      destructive_iterator;
 
   // These come from tr1.  For us they're the same as regular iterators.
   typedef iterator local_iterator;
@@ -397,6 +408,10 @@ class sparse_hashtable {
   static const size_type HT_DEFAULT_STARTING_BUCKETS = 32;
 
   // ITERATOR FUNCTIONS
+  // A non-const iterator can change any element it reaches, so while a
+  // snapshot is being written, each chunk is copied aside as an iterator
+  // gets to it, and with delta tracking on each group it reaches is
+  // marked changed (see before_write_at()).
   iterator begin() {
     return iterator(this, table.nonempty_begin(), table.nonempty_end());
   }
@@ -416,10 +431,11 @@ class sparse_hashtable {
   // bucket n to be the n-th element of the sparsetable, if it's occupied,
   // or some empty element, otherwise.
   local_iterator begin(size_type i) {
-    if (table.test(i))
+    if (table.test(i)) {
+      before_write(i);
       return local_iterator(this, table.get_iter(i), table.nonempty_end());
-    else
-      return local_iterator(this, table.nonempty_end(), table.nonempty_end());
+    }
+    return local_iterator(this, table.nonempty_end(), table.nonempty_end());
   }
   local_iterator end(size_type i) {
     local_iterator it = begin(i);
@@ -442,6 +458,7 @@ class sparse_hashtable {
 
   // This is used when resizing
   destructive_iterator destructive_begin() {
+    before_write_all();
     return destructive_iterator(this, table.destructive_begin(),
                                 table.destructive_end());
   }
@@ -450,6 +467,73 @@ class sparse_hashtable {
                                 table.destructive_end());
   }
 
+  // RANGE ITERATION
+  // Iterates over the elements in sparsegroups [first, last), where
+  // group g holds buckets [g * DEFAULT_GROUP_SIZE, (g+1) * DEFAULT_GROUP_SIZE).
+  // The ranges for disjoint group intervals can be walked at the same
+  // time from different threads, so a scan over the whole table can be
+  // split up: see for_each_parallel() below.
+  size_type group_count() const { return table.group_count(); }
+  std::pair<iterator, iterator> group_range(size_type first, size_type last) {
+    before_write_groups(first, last);
+    const std::pair<typename Table::nonempty_iterator,
+                    typename Table::nonempty_iterator>
+        r = table.group_range(first, last);
+    return std::pair<iterator, iterator>(iterator(this, r.first, r.second),
+                                         iterator(this, r.second, r.second));
+  }
+  std::pair<const_iterator, const_iterator> group_range(size_type first,
+                                                        size_type last) const {
+    const std::pair<typename Table::const_nonempty_iterator,
+                    typename Table::const_nonempty_iterator>
+        r = table.group_range(first, last);
+    return std::pair<const_iterator, const_iterator>(
+        const_iterator(this, r.first, r.second),
+        const_iterator(this, r.second, r.second));
+  }
+
+  // Calls fn(value) for every element, splitting the groups between up
+  // to num_threads threads (0 means one per hardware thread).  fn is
+  // called concurrently, and in no particular order.  The table itself
+  // mustn't change while this runs, though fn may modify the non-key
+  // part of the value it's handed.
+  template <class Fn>
+  void for_each_parallel(Fn fn, size_type num_threads = 0) {
+    if (size() == 0) return;
+    before_write_all();
+    sparsehash_internal::for_each_in_pieces(
+        group_count(), num_threads,
+        [this](size_type first, size_type last) {
+          return group_range(first, last);
+        },
+        fn);
+  }
+  template <class Fn>
+  void for_each_parallel(Fn fn, size_type num_threads = 0) const {
+    if (size() == 0) return;
+    sparsehash_internal::for_each_in_pieces(
+        group_count(), num_threads,
+        [this](size_type first, size_type last) {
+          return group_range(first, last);
+        },
+        fn);
+  }
+
+  // Returns combine(...combine(combine(init, map(v1)), map(v2))..., map(vn))
+  // over all elements, computed in pieces on up to num_threads threads.
+  // combine must be associative; map and combine are called concurrently.
+  template <class T, class Map, class Combine>
+  T reduce_parallel(T init, Map map, Combine combine,
+                    size_type num_threads = 0) const {
+    if (size() == 0) return init;
+    return sparsehash_internal::reduce_in_pieces(
+        group_count(), num_threads,
+        [this](size_type first, size_type last) {
+          return group_range(first, last);
+        },
+        init, map, combine);
+  }
+
   // ACCESSOR FUNCTIONS for the things we templatize on, basically
   hasher hash_funct() const { return settings; }
   key_equal key_eq() const { return key_info; }
@@ -458,6 +542,45 @@ class sparse_hashtable {
   // Accessor function for statistics gathering.
   int num_table_copies() const { return settings.num_ht_copies(); }
 
+  // What the Stats policy has counted; all zeros under no_stats.
+  hashtable_stats stats() const { return settings.stats(); }
+
+  // Walks the whole table to see how well it's holding up; see
+  // hashtable_analysis.  Takes time linear in bucket_count().
+  hashtable_analysis analyze() const {
+    sparsehash_internal::table_analyzer analyzer(bucket_count());
+    const size_type bucket_count_minus_one = bucket_count() - 1;
+    size_type group_entries = 0;
+    for (size_type bucknum = 0; bucknum < bucket_count(); ++bucknum) {
+      if (!table.test(bucknum)) {
+        if (test_erased(bucknum)) {
+          analyzer.deleted(bucknum);
+        } else {
+          analyzer.empty();
+        }
+      } else if (test_deleted(bucknum)) {
+        analyzer.deleted(bucknum);
+        ++group_entries;
+      } else {
+        const size_type home =
+            hash(get_key(table.unsafe_get(bucknum))) & bucket_count_minus_one;
+        size_type num_probes = 0;  // retrace find_position()'s steps
+        for (size_type pos = home; pos != bucknum;
+             pos = (pos + JUMP_(key, num_probes)) & bucket_count_minus_one) {
+          ++num_probes;
+        }
+        analyzer.entry(home, num_probes);
+        ++group_entries;
+      }
+      if ((bucknum + 1) % DEFAULT_GROUP_SIZE == 0 ||
+          bucknum + 1 == bucket_count()) {
+        analyzer.group(group_entries);
+        group_entries = 0;
+      }
+    }
+    return analyzer.finish();
+  }
+
  private:
   // We need to copy values when we set the special marker for deleted
   // elements, but, annoyingly, we can't just use the copy assignment
@@ -516,31 +639,95 @@ class sparse_hashtable {
     return key_info.delkey;
   }
 
+  // In physical-erase mode, erase() takes the value out of its
+  // sparsegroup right away, so its memory is freed on the spot, and
+  // there's no need for a deleted key.  What's left behind is one bit
+  // per bucket in erased_buckets, so probe sequences running through
+  // the bucket still work; inserts reuse these buckets, and they all
+  // go away on the next rehash.  The catch is that erase() now
+  // invalidates iterators.
+  void set_physical_erase(bool enable) {
+    // Like changing the deleted key: purge what the old mode left.
+    squash_deleted();
+    settings.set_physical_erase(enable);
+    std::vector<bool, erased_alloc_type>(erased_buckets.get_allocator())
+        .swap(erased_buckets);
+  }
+  bool physical_erase() const { return settings.physical_erase(); }
+
   // These are public so the iterators can use them
+  // The non-const iterators call this before they stop at pos.  A loop
+  // over the table copies chunks one at a time as it reaches them, and
+  // none that the snapshot has already written.
+  template <class NonemptyIterator>
+  void before_write_at(const NonemptyIterator& pos) {
+    if (snapshot_state || table.tracking_dirty_groups()) {
+      before_write(table.get_pos(pos));
+    }
+  }
+
   // True if the item at position bucknum is "deleted" marker
   bool test_deleted(size_type bucknum) const {
-    // Invariant: !use_deleted() implies num_deleted is 0.
-    assert(settings.use_deleted() || num_deleted == 0);
-    return num_deleted > 0 && table.test(bucknum) &&
+    // Invariant: !use_deleted() implies num_deleted is 0, unless we
+    // erase physically, in which case nothing is ever marked deleted.
+    assert(settings.use_deleted() || settings.physical_erase() ||
+           num_deleted == 0);
+    return num_deleted > 0 && !settings.physical_erase() &&
+           table.test(bucknum) &&
            test_deleted_key(get_key(table.unsafe_get(bucknum)));
   }
   bool test_deleted(const iterator& it) const {
     // Invariant: !use_deleted() implies num_deleted is 0.
-    assert(settings.use_deleted() || num_deleted == 0);
-    return num_deleted > 0 && test_deleted_key(get_key(*it));
+    assert(settings.use_deleted() || settings.physical_erase() ||
+           num_deleted == 0);
+    return num_deleted > 0 && !settings.physical_erase() &&
+           test_deleted_key(get_key(*it));
   }
   bool test_deleted(const const_iterator& it) const {
     // Invariant: !use_deleted() implies num_deleted is 0.
-    assert(settings.use_deleted() || num_deleted == 0);
-    return num_deleted > 0 && test_deleted_key(get_key(*it));
+    assert(settings.use_deleted() || settings.physical_erase() ||
+           num_deleted == 0);
+    return num_deleted > 0 && !settings.physical_erase() &&
+           test_deleted_key(get_key(*it));
   }
   bool test_deleted(const destructive_iterator& it) const {
     // Invariant: !use_deleted() implies num_deleted is 0.
-    assert(settings.use_deleted() || num_deleted == 0);
-    return num_deleted > 0 && test_deleted_key(get_key(*it));
+    assert(settings.use_deleted() || settings.physical_erase() ||
+           num_deleted == 0);
+    return num_deleted > 0 && !settings.physical_erase() &&
+           test_deleted_key(get_key(*it));
   }
 
  private:
+  // True if the (empty) bucket at bucknum used to hold a value that
+  // erase() took out in physical-erase mode.  Probes go past it.
+  bool test_erased(size_type bucknum) const {
+    return num_deleted > 0 && settings.physical_erase() &&
+           erased_buckets[bucknum];
+  }
+
+  // Takes the value at bucknum out of the table for good, leaving an
+  // erased bucket behind.  Only used in physical-erase mode.
+  void erase_physically(size_type bucknum) {
+    assert(settings.physical_erase() && table.test(bucknum));
+    if (erased_buckets.size() != bucket_count()) {
+      // By now num_deleted is 0, so there are no bits worth keeping.
+      assert(num_deleted == 0);
+      erased_buckets.assign(bucket_count(), false);
+    }
+    before_write(bucknum);
+    table.erase(bucknum);
+    erased_buckets[bucknum] = true;
+    ++num_deleted;
+  }
+
+  // Buckets that are taking up room in probe sequences: those that
+  // hold values, and, in physical-erase mode, the erased ones.
+  size_type num_occupied() const {
+    return settings.physical_erase() ? table.num_nonempty() + num_deleted
+                                     : table.num_nonempty();
+  }
+
   void check_use_deleted(const char* caller) {
     (void)caller;  // could log it if the assert failed
     assert(settings.use_deleted());
@@ -551,6 +738,8 @@ class sparse_hashtable {
   // TODO(csilvers): make these private (also in densehashtable.h)
   bool set_deleted(iterator& it) {
     check_use_deleted("set_deleted()");
+    if (snapshot_state || table.tracking_dirty_groups())
+      before_write(table.get_pos(const_iterator(it).pos));
     bool retval = !test_deleted(it);
     // &* converts from iterator to value-type.
     set_key(&(*it), key_info.delkey);
@@ -570,6 +759,8 @@ class sparse_hashtable {
   // really matter.
   bool set_deleted(const_iterator& it) {
     check_use_deleted("set_deleted()");
+    if (snapshot_state || table.tracking_dirty_groups())
+      before_write(table.get_pos(it.pos));
     bool retval = !test_deleted(it);
     set_key(const_cast<pointer>(&(*it)), key_info.delkey);
     return retval;
@@ -582,7 +773,7 @@ class sparse_hashtable {
 
   // FUNCTIONS CONCERNING SIZE
  public:
-  size_type size() const { return table.num_nonempty() - num_deleted; }
+  size_type size() const { return num_occupied() - num_deleted; }
   size_type max_size() const { return table.max_size(); }
   bool empty() const { return size() == 0; }
   size_type bucket_count() const { return table.size(); }
@@ -601,7 +792,7 @@ class sparse_hashtable {
   // TODO(csilvers): take a delta so we can take into account inserts
   // done after shrinking.  Maybe make part of the Settings class?
   bool maybe_shrink() {
-    assert(table.num_nonempty() >= num_deleted);
+    assert(num_occupied() >= num_deleted);
     assert((bucket_count() & (bucket_count() - 1)) == 0);  // is a power of two
     assert(bucket_count() >= HT_MIN_BUCKETS);
     bool retval = false;
@@ -611,7 +802,7 @@ class sparse_hashtable {
     // shrink below HT_DEFAULT_STARTING_BUCKETS.  Otherwise, something
     // like "dense_hash_set<int> x; x.insert(4); x.erase(4);" will
     // shrink us down to HT_MIN_BUCKETS buckets, which is too small.
-    const size_type num_remain = table.num_nonempty() - num_deleted;
+    const size_type num_remain = size();
     const size_type shrink_threshold = settings.shrink_threshold();
     if (shrink_threshold > 0 && num_remain < shrink_threshold &&
         bucket_count() > HT_DEFAULT_STARTING_BUCKETS) {
@@ -621,8 +812,11 @@ class sparse_hashtable {
              num_remain < static_cast<size_type>(sz * shrink_factor)) {
         sz /= 2;  // stay a power of 2
       }
+      const size_type old_buckets = bucket_count();
+      settings.begin_rehash();
       sparse_hashtable tmp(MoveDontCopy, *this, sz);
       swap(tmp);  // now we are tmp
+      settings.end_rehash(old_buckets, bucket_count());
       retval = true;
     }
     settings.set_consider_shrink(false);  // because we just considered it
@@ -638,12 +832,11 @@ class sparse_hashtable {
     if (settings.consider_shrink()) {  // see if lots of deletes happened
       if (maybe_shrink()) did_resize = true;
     }
-    if (table.num_nonempty() >=
-        (std::numeric_limits<size_type>::max)() - delta) {
+    if (num_occupied() >= (std::numeric_limits<size_type>::max)() - delta) {
       throw std::length_error("resize overflow");
     }
     if (bucket_count() >= HT_MIN_BUCKETS &&
-        (table.num_nonempty() + delta) <= settings.enlarge_threshold())
+        (num_occupied() + delta) <= settings.enlarge_threshold())
       return did_resize;  // we're ok as we are
 
     // Sometimes, we need to resize just to get rid of all the
@@ -653,12 +846,12 @@ class sparse_hashtable {
     // size to resize to, *don't* count deleted buckets, since they
     // get discarded during the resize.
     const size_type needed_size =
-        settings.min_buckets(table.num_nonempty() + delta, 0);
+        settings.min_buckets(num_occupied() + delta, 0);
     if (needed_size <= bucket_count())  // we have enough buckets
       return did_resize;
 
     size_type resize_to = settings.min_buckets(
-        table.num_nonempty() - num_deleted + delta, bucket_count());
+        size() + delta, bucket_count());
     if (resize_to < needed_size &&  // may double resize_to
         resize_to < (std::numeric_limits<size_type>::max)() / 2) {
       // This situation means that we have enough deleted elements,
@@ -670,15 +863,18 @@ class sparse_hashtable {
       // deleted elements).
       const size_type target =
           static_cast<size_type>(settings.shrink_size(resize_to * 2));
-      if (table.num_nonempty() - num_deleted + delta >= target) {
+      if (size() + delta >= target) {
         // Good, we won't be below the shrink threshhold even if we
         // double.
         resize_to *= 2;
       }
     }
 
+    const size_type old_buckets = bucket_count();
+    settings.begin_rehash();
     sparse_hashtable tmp(MoveDontCopy, *this, resize_to);
     swap(tmp);  // now we are tmp
+    settings.end_rehash(old_buckets, bucket_count());
     return true;
   }
 
@@ -762,8 +958,8 @@ class sparse_hashtable {
   // req_elements==0 will cause us to shrink if we can, saving space.
   void resize(size_type req_elements) {  // resize to this or larger
     if (settings.consider_shrink() || req_elements == 0) maybe_shrink();
-    if (req_elements > table.num_nonempty())  // we only grow
-      resize_delta(req_elements - table.num_nonempty());
+    if (req_elements > num_occupied())  // we only grow
+      resize_delta(req_elements - num_occupied());
   }
 
   // Get and change the value of shrink_factor and enlarge_factor.  The
@@ -792,10 +988,12 @@ class sparse_hashtable {
       : settings(hf),
         key_info(ext, set, eql),
         num_deleted(0),
+        erased_buckets(erased_alloc_type(alloc)),
         table((expected_max_items_in_table == 0
                    ? HT_DEFAULT_STARTING_BUCKETS
                    : settings.min_buckets(expected_max_items_in_table, 0)),
-              alloc) {
+              alloc),
+        epoch(0) {
     settings.reset_thresholds(bucket_count());
   }
 
@@ -808,7 +1006,9 @@ class sparse_hashtable {
       : settings(ht.settings),
         key_info(ht.key_info),
         num_deleted(0),
-        table(0, ht.get_allocator()) {
+        erased_buckets(erased_alloc_type(ht.get_allocator())),
+        table(0, ht.get_allocator()),
+        epoch(0) {
     settings.reset_thresholds(bucket_count());
     copy_from(ht, min_buckets_wanted);  // copy_from() ignores deleted entries
   }
@@ -817,7 +1017,9 @@ class sparse_hashtable {
       : settings(ht.settings),
         key_info(ht.key_info),
         num_deleted(0),
-        table(0, ht.get_allocator()) {
+        erased_buckets(erased_alloc_type(ht.get_allocator())),
+        table(0, ht.get_allocator()),
+        epoch(0) {
     settings.reset_thresholds(bucket_count());
     move_from(mover, ht, min_buckets_wanted);  // ignores deleted entries
   }
@@ -833,11 +1035,16 @@ class sparse_hashtable {
     return *this;
   }
 
-  // Many STL algorithms use swap instead of copy constructors
+  // Many STL algorithms use swap instead of copy constructors.  A
+  // snapshot being written stays with its table, and gets a copy of
+  // whatever it still needs first.
   void swap(sparse_hashtable& ht) {
+    before_write_all();
+    ht.before_write_all();
     std::swap(settings, ht.settings);
     std::swap(key_info, ht.key_info);
     std::swap(num_deleted, ht.num_deleted);
+    erased_buckets.swap(ht.erased_buckets);
     table.swap(ht.table);
     settings.reset_thresholds(bucket_count());  // also resets consider_shrink
     ht.settings.reset_thresholds(ht.bucket_count());
@@ -846,11 +1053,13 @@ class sparse_hashtable {
 
   // It's always nice to be able to clear a table without deallocating it
   void clear() {
+    before_write_all();  // copy_from() resizes the table after this
     if (!empty() || (num_deleted != 0)) {
       table.clear();
     }
     settings.reset_thresholds(bucket_count());
     num_deleted = 0;
+    erased_buckets.clear();
   }
 
   // LOOKUP ROUTINES
@@ -865,18 +1074,21 @@ class sparse_hashtable {
     const size_type bucket_count_minus_one = bucket_count() - 1;
     size_type bucknum = hash(key) & bucket_count_minus_one;
     size_type insert_pos = ILLEGAL_BUCKET;  // where we would insert
-    SPARSEHASH_STAT_UPDATE(total_lookups += 1);
     while (1) {                    // probe until something happens
-      if (!table.test(bucknum)) {  // bucket is empty
-        SPARSEHASH_STAT_UPDATE(total_probes += num_probes);
-        if (insert_pos == ILLEGAL_BUCKET)  // found no prior place to insert
-          return std::pair<size_type, size_type>(ILLEGAL_BUCKET, bucknum);
-        else
-          return std::pair<size_type, size_type>(ILLEGAL_BUCKET, insert_pos);
+      if (!table.test(bucknum)) {
+        if (test_erased(bucknum)) {  // keep searching, but mark to insert
+          if (insert_pos == ILLEGAL_BUCKET) insert_pos = bucknum;
+        } else {  // bucket is empty
+          settings.count_lookup(num_probes, false);
+          if (insert_pos == ILLEGAL_BUCKET)  // found no prior place to insert
+            return std::pair<size_type, size_type>(ILLEGAL_BUCKET, bucknum);
+          else
+            return std::pair<size_type, size_type>(ILLEGAL_BUCKET, insert_pos);
+        }
       } else if (test_deleted(bucknum)) {  // keep searching, but mark to insert
         if (insert_pos == ILLEGAL_BUCKET) insert_pos = bucknum;
       } else if (equals(key, get_key(table.unsafe_get(bucknum)))) {
-        SPARSEHASH_STAT_UPDATE(total_probes += num_probes);
+        settings.count_lookup(num_probes, true);
         return std::pair<size_type, size_type>(bucknum, ILLEGAL_BUCKET);
       }
       ++num_probes;  // we're doing another probe
@@ -892,8 +1104,8 @@ class sparse_hashtable {
     std::pair<size_type, size_type> pos = find_position(key);
     if (pos.first == ILLEGAL_BUCKET)  // alas, not there
       return end();
-    else
-      return iterator(this, table.get_iter(pos.first), table.nonempty_end());
+    before_write(pos.first);  // the caller may change the value
+    return iterator(this, table.get_iter(pos.first), table.nonempty_end());
   }
 
   const_iterator find(const key_type& key) const {
@@ -952,7 +1164,13 @@ class sparse_hashtable {
       // stats
       assert(num_deleted > 0);
       --num_deleted;  // used to be, now it isn't
+      settings.count_deleted_reused();
+    } else if (test_erased(pos)) {
+      erased_buckets[pos] = false;
+      --num_deleted;
+      settings.count_deleted_reused();
     }
+    before_write(pos);
     table.set(pos, obj);
     return iterator(this, table.get_iter(pos), table.nonempty_end());
   }
@@ -965,6 +1183,7 @@ class sparse_hashtable {
         "Inserting the deleted key");
     const std::pair<size_type, size_type> pos = find_position(get_key(obj));
     if (pos.first != ILLEGAL_BUCKET) {  // object was already there
+      before_write(pos.first);
       return std::pair<iterator, bool>(
           iterator(this, table.get_iter(pos.first), table.nonempty_end()),
           false);  // false: we didn't insert
@@ -1008,6 +1227,138 @@ class sparse_hashtable {
            typename std::iterator_traits<InputIterator>::iterator_category());
   }
 
+  // BULK LOADING
+  // Inserts [f, l) using up to num_threads threads (0 means one per
+  // hardware thread).  We size the table for everything up front, hash
+  // the input in parallel, and partition it by home bucket into runs of
+  // whole sparsegroups, so every thread only ever touches its own
+  // groups.  A value whose probe sequence would leave its groups is set
+  // aside and inserted serially at the end.
+  // policy says which value wins when keys repeat; with KeepFirst the
+  // result is the same as insert(f, l).  The hasher, key_equal,
+  // value_type's copy constructor and the allocator are called
+  // concurrently.  Iterators that aren't random-access just get a serial
+  // insert.
+  template <class InputIterator>
+  void build_from(InputIterator f, InputIterator l, size_type num_threads,
+                  DuplicateKeyPolicy policy = KeepFirst) {
+    build_from(f, l, num_threads, policy,
+               typename std::iterator_traits<InputIterator>::iterator_category());
+  }
+
+ private:
+  // Used by build_from() for the values it couldn't place in parallel.
+  void insert_noresize_with_policy(const_reference obj,
+                                   DuplicateKeyPolicy policy) {
+    const std::pair<size_type, size_type> pos = find_position(get_key(obj));
+    if (pos.first == ILLEGAL_BUCKET)
+      insert_at(obj, pos.second);
+    else if (policy == KeepLast) {
+      before_write(pos.first);
+      table.set(pos.first, obj);
+    }
+  }
+
+  template <class InputIterator>
+  void build_from(InputIterator f, InputIterator l, size_type /*num_threads*/,
+                  DuplicateKeyPolicy policy, std::input_iterator_tag) {
+    for (; f != l; ++f) {
+      resize_delta(1);
+      insert_noresize_with_policy(*f, policy);
+    }
+  }
+
+  template <class RandomAccessIterator>
+  void build_from(RandomAccessIterator f, RandomAccessIterator l,
+                  size_type num_threads, DuplicateKeyPolicy policy,
+                  std::random_access_iterator_tag) {
+    const size_t n = static_cast<size_t>(l - f);
+    if (n >= (std::numeric_limits<size_type>::max)()) {
+      throw std::length_error("insert-range overflow");
+    }
+    num_threads = static_cast<size_type>(
+        sparsehash_internal::resolve_num_threads(num_threads));
+    resize_delta(static_cast<size_type>(n));
+    before_write_all();  // the threads below don't stop to copy groups
+
+    // A few regions per thread so one crowded region doesn't hold
+    // everyone up, but at least a couple of groups in each.
+    const size_type num_groups = Table::num_groups(bucket_count());
+    size_type groups_per_region = num_groups / (4 * num_threads + 1) + 1;
+    if (groups_per_region < 2) groups_per_region = 2;
+    const size_type num_regions =
+        (num_groups + groups_per_region - 1) / groups_per_region;
+    if (num_threads <= 1 || num_regions <= 1) {
+      for (size_t i = 0; i < n; ++i) insert_noresize_with_policy(f[i], policy);
+      return;
+    }
+    const size_type buckets_per_region = groups_per_region * DEFAULT_GROUP_SIZE;
+
+    const size_type bucket_count_minus_one = bucket_count() - 1;
+    std::vector<size_type> home(n);
+    sparsehash_internal::run_in_parallel(num_threads, num_threads,
+                                         [&](size_t t) {
+      for (size_t i = n * t / num_threads; i < n * (t + 1) / num_threads; ++i)
+        home[i] = hash(get_key(f[i])) & bucket_count_minus_one;
+    });
+
+    std::vector<size_t> order, region_begin;
+    sparsehash_internal::partition_by_region(
+        n, num_regions, num_threads,
+        [&](size_t i) { return home[i] / buckets_per_region; }, &order,
+        &region_begin);
+
+    // We go straight to the groups, since sparsetable::set() would race
+    // on the table-wide count of non-empty buckets; we recount afterwards.
+    std::vector<std::vector<size_t>> spilled(num_regions);
+    auto place_region = [&](size_t r) {
+      for (size_t j = region_begin[r]; j < region_begin[r + 1]; ++j) {
+        const size_t i = order[j];
+        size_type num_probes = 0;
+        size_type bucknum = home[i];
+        while (1) {
+          if (!table.test(bucknum)) {
+            if (!test_erased(bucknum)) {  // we don't reuse erased buckets
+              table.which_group(bucknum).set(table.pos_in_group(bucknum),
+                                             f[i]);
+              break;
+            }
+          } else if (!test_deleted(bucknum) &&
+                     equals(get_key(f[i]),
+                            get_key(table.unsafe_get(bucknum)))) {
+            if (policy == KeepLast)
+              table.which_group(bucknum).set(table.pos_in_group(bucknum), f[i]);
+            break;
+          }
+          ++num_probes;
+          bucknum = (bucknum + JUMP_(key, num_probes)) & bucket_count_minus_one;
+          if (bucknum / buckets_per_region != r) {  // another thread's groups
+            spilled[r].push_back(i);
+            break;
+          }
+        }
+      }
+    };
+    // Should a thread throw, the values the others put in their groups
+    // stay there, so we recount before passing the exception on.
+    std::exception_ptr error;
+    try {
+      sparsehash_internal::run_in_parallel(num_regions, num_threads,
+                                           place_region);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    table.recount_nonempty();
+    if (error) std::rethrow_exception(error);
+
+    // Spilled values come out in input order within each region, and
+    // equal keys always share a region, so duplicates resolve as above.
+    for (size_type r = 0; r < num_regions; ++r) {
+      for (size_t i : spilled[r]) insert_noresize_with_policy(f[i], policy);
+    }
+  }
+
+ public:
   // DefaultValue is a functor that takes a key and returns a value_type
   // representing the default value to be inserted if none is found.
   template <class DefaultValue>
@@ -1018,6 +1369,7 @@ class sparse_hashtable {
     const std::pair<size_type, size_type> pos = find_position(key);
     DefaultValue default_value;
     if (pos.first != ILLEGAL_BUCKET) {  // object was already there
+      before_write(pos.first);
       return *table.get_iter(pos.first);
     } else if (resize_delta(1)) {  // needed to rehash to make room
       // Since we resized, we can't use pos, so recalculate where to
@@ -1034,6 +1386,14 @@ class sparse_hashtable {
     assert((!settings.use_deleted() || !equals(key, key_info.delkey)) &&
            "Erasing the deleted key");
     assert(!settings.use_deleted() || !equals(key, key_info.delkey));
+    if (settings.physical_erase()) {
+      if (size() == 0) return 0;
+      const size_type bucknum = find_position(key).first;
+      if (bucknum == ILLEGAL_BUCKET) return 0;
+      erase_physically(bucknum);
+      settings.set_consider_shrink(true);
+      return 1;
+    }
     const_iterator pos = find(key);  // shrug: shouldn't need to be const
     if (pos != end()) {
       assert(!test_deleted(pos));  // or find() shouldn't have returned it
@@ -1050,6 +1410,11 @@ class sparse_hashtable {
   // We return the iterator past the deleted item.
   void erase(iterator pos) {
     if (pos == end()) return;  // sanity check
+    if (settings.physical_erase()) {
+      erase_physically(table.get_pos(const_iterator(pos).pos));
+      settings.set_consider_shrink(true);
+      return;
+    }
     if (set_deleted(pos)) {    // true if object has been newly deleted
       ++num_deleted;
       // will think about shrink after next insert
@@ -1058,6 +1423,10 @@ class sparse_hashtable {
   }
 
   void erase(iterator f, iterator l) {
+    if (settings.physical_erase()) {
+      erase(const_iterator(f), const_iterator(l));
+      return;
+    }
     for (; f != l; ++f) {
       if (set_deleted(f))  // should always be true
         ++num_deleted;
@@ -1073,6 +1442,11 @@ class sparse_hashtable {
   // if it's const or not.
   void erase(const_iterator pos) {
     if (pos == end()) return;  // sanity check
+    if (settings.physical_erase()) {
+      erase_physically(table.get_pos(pos.pos));
+      settings.set_consider_shrink(true);
+      return;
+    }
     if (set_deleted(pos)) {    // true if object has been newly deleted
       ++num_deleted;
       // will think about shrink after next insert
@@ -1080,6 +1454,14 @@ class sparse_hashtable {
     }
   }
   void erase(const_iterator f, const_iterator l) {
+    if (settings.physical_erase()) {
+      // Erasing invalidates iterators, so find all the buckets first.
+      std::vector<size_type> bucknums;
+      for (; f != l; ++f) bucknums.push_back(table.get_pos(f.pos));
+      for (size_type bucknum : bucknums) erase_physically(bucknum);
+      settings.set_consider_shrink(true);
+      return;
+    }
     for (; f != l; ++f) {
       if (set_deleted(f))  // should always be true
         ++num_deleted;
@@ -1088,6 +1470,58 @@ class sparse_hashtable {
     settings.set_consider_shrink(true);
   }
 
+  // Erases every element for which pred(value) is true, and returns how
+  // many that was.  pred is called exactly once per element.  Rather
+  // than leaving a tombstone per removal, we take matching values out of
+  // their sparsegroups as we go -- so their memory is freed right away --
+  // and then rehash the survivors into a table sized for them, so there
+  // is at most one copy and no deleted key is needed.  (For erasing just
+  // a few elements out of many, erase() is cheaper.)
+  template <class Predicate>
+  size_type erase_if(Predicate pred) {
+    if (size() == 0) return 0;
+    size_type num_erased = 0;
+    try {
+      // Within a group we go backwards, so erasing doesn't move the
+      // values we've yet to look at.
+      for (size_type bucknum = bucket_count(); bucknum-- > 0;) {
+        if (table.test(bucknum) && !test_deleted(bucknum) &&
+            pred(table.unsafe_get(bucknum))) {
+          before_write(bucknum);
+          table.erase(bucknum);
+          ++num_erased;
+        }
+      }
+    } catch (...) {
+      // The holes we made break probe sequences; rehash before leaving.
+      if (num_erased > 0) rehash_after_erase_if();
+      throw;
+    }
+    if (num_erased > 0) rehash_after_erase_if();
+    return num_erased;
+  }
+
+ private:
+  // erase_if() empties buckets in place, which can cut probe sequences
+  // short, so we have to rehash everything that's left.  We shrink the
+  // way maybe_shrink() would while we're at it.
+  void rehash_after_erase_if() {
+    const size_type num_remain = size();
+    size_type sz = bucket_count();
+    const size_type shrink_threshold = settings.shrink_threshold();
+    if (shrink_threshold > 0 && num_remain < shrink_threshold) {
+      while (sz > HT_DEFAULT_STARTING_BUCKETS &&
+             num_remain < static_cast<size_type>(sz * settings.shrink_factor()))
+        sz /= 2;  // stay a power of 2
+    }
+    const size_type old_buckets = bucket_count();
+    settings.begin_rehash();
+    sparse_hashtable tmp(MoveDontCopy, *this, sz);
+    swap(tmp);  // now we are tmp
+    settings.end_rehash(old_buckets, bucket_count());
+  }
+
+ public:
   // COMPARISON
   bool operator==(const sparse_hashtable& ht) const {
     if (size() != ht.size()) {
@@ -1129,6 +1563,7 @@ class sparse_hashtable {
   template <typename INPUT>
   bool read_metadata(INPUT* fp) {
     num_deleted = 0;  // since we got rid before writing
+    erased_buckets.clear();
     const bool result = table.read_metadata(fp);
     settings.reset_thresholds(bucket_count());
     return result;
@@ -1165,22 +1600,514 @@ class sparse_hashtable {
   template <typename ValueSerializer, typename INPUT>
   bool unserialize(ValueSerializer serializer, INPUT* fp) {
     num_deleted = 0;  // since we got rid before writing
+    erased_buckets.clear();
     const bool result = table.unserialize(serializer, fp);
     settings.reset_thresholds(bucket_count());
     return result;
   }
 
+  // Snapshots: the same data as serialize() writes, plus a header
+  // describing the table and CRC32C checksums over the lot, so a
+  // truncated, corrupt or mismatched file is refused instead of being
+  // loaded.  See hashtable-snapshot.h for the format.  Since the values
+  // are written through a checksumming stream rather than to fp itself,
+  // a ValueSerializer used here must accept any OUTPUT (or INPUT) type;
+  // NopointerSerializer does.
+  template <typename ValueSerializer, typename OUTPUT>
+  bool serialize_snapshot(ValueSerializer serializer, OUTPUT* fp) {
+    squash_deleted();  // so the header's counts match what's written
+    sparsehash_internal::snapshot_header header = expected_snapshot_header();
+    header.num_buckets = bucket_count();
+    header.num_elements = size();
+    if (!sparsehash_internal::write_snapshot_header(fp, header)) return false;
+    sparsehash_internal::checksummed_writer<OUTPUT> out(fp);
+    return serialize(serializer, &out) && out.finish();
+  }
+
+  // Reads any kind of snapshot, or the older serialize() format (which
+  // has nothing to check it against).
+  template <typename ValueSerializer, typename INPUT>
+  bool unserialize_snapshot(ValueSerializer serializer, INPUT* fp) {
+    return load_snapshot(serializer, fp, 1);
+  }
+
+  // Like serialize_snapshot(), but the sparsegroups are cut into chunks
+  // of SNAPSHOT_CHUNK_GROUPS that are encoded and checksummed on up to
+  // num_threads threads (0 means one per hardware thread), and an index
+  // of the chunks follows them.  fp is written only from the calling
+  // thread, in order.  The serializer is copied for each chunk and the
+  // copies are called concurrently.
+  template <typename ValueSerializer, typename OUTPUT>
+  bool serialize_parallel(ValueSerializer serializer, OUTPUT* fp,
+                          size_type num_threads = 0) {
+    squash_deleted();
+    sparsehash_internal::snapshot_header header = expected_snapshot_header();
+    header.flags |= sparsehash_internal::SNAPSHOT_INDEXED;
+    header.num_buckets = bucket_count();
+    header.num_elements = size();
+    header.chunk_size = SNAPSHOT_CHUNK_GROUPS;
+    if (!sparsehash_internal::write_snapshot_header(fp, header)) return false;
+    return sparsehash_internal::write_indexed_chunks(
+        fp, num_snapshot_chunks(table.group_count(), SNAPSHOT_CHUNK_GROUPS),
+        sparsehash_internal::resolve_num_threads(num_threads),
+        [&](size_t chunk, sparsehash_internal::memory_writer* out) {
+          ValueSerializer chunk_serializer = serializer;
+          return table.write_groups(chunk_serializer, out,
+                                    chunk * SNAPSHOT_CHUNK_GROUPS,
+                                    (chunk + 1) * SNAPSHOT_CHUNK_GROUPS);
+        });
+  }
+
+  // Reads what serialize_parallel() writes, sizing the table first and
+  // then decoding chunks straight into their groups on up to
+  // num_threads threads; fp is read only from the calling thread.  The
+  // allocator is called concurrently.  Other snapshots, and the older
+  // format, are read as by unserialize_snapshot().
+  template <typename ValueSerializer, typename INPUT>
+  bool unserialize_parallel(ValueSerializer serializer, INPUT* fp,
+                            size_type num_threads = 0) {
+    return load_snapshot(serializer, fp,
+                         sparsehash_internal::resolve_num_threads(num_threads));
+  }
+
+  // True if fp holds an intact snapshot that a table of this type could
+  // read, checked without loading anything.
+  template <typename INPUT>
+  static bool validate_snapshot(INPUT* fp) {
+    return sparsehash_internal::validate_snapshot(fp,
+                                                  expected_snapshot_header());
+  }
+
+  // Writes the table in the layout sparse_hash_map_view reads in place
+  // (see mappable_header in hashtable-snapshot.h).  Like
+  // write_nopointer_data(), only meaningful if value_type is a POD, and
+  // the values are written in native byte order.
+  template <typename OUTPUT>
+  bool serialize_mappable(OUTPUT* fp) {
+    squash_deleted();  // a view can't skip over deleted entries
+    sparsehash_internal::mappable_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = sparsehash_internal::MAPPABLE_MAGIC;
+    header.version = sparsehash_internal::MAPPABLE_VERSION;
+    header.flags = sparsehash_internal::host_is_little_endian()
+                       ? sparsehash_internal::SNAPSHOT_LITTLE_ENDIAN
+                       : 0;
+    header.value_size = sizeof(value_type);
+    header.value_align = alignof(value_type);
+    header.group_size = DEFAULT_GROUP_SIZE;
+    header.hasher_tag =
+        sparsehash_internal::snapshot_hasher_tag<hasher, key_type>();
+    header.num_buckets = bucket_count();
+    header.num_elements = size();
+    sparsehash_internal::set_mappable_layout(
+        &header, table.group_count(), Table::group_type::bitmap_size());
+    header.header_crc = header.compute_crc();
+
+    uint64_t written = sizeof(header) +
+                       table.group_count() * Table::group_type::bitmap_size();
+    sparsehash_internal::buffered_writer<OUTPUT> out(fp);
+    if (!sparsehash_internal::write_data(&out, &header, sizeof(header)) ||
+        !table.write_bitmaps(&out) ||
+        !sparsehash_internal::write_padding(&out, &written,
+                                            header.offsets_offset) ||
+        !table.write_group_offsets(&out))
+      return false;
+    written += 8 * (table.group_count() + 1);
+    if (!sparsehash_internal::write_padding(&out, &written,
+                                            header.values_offset) ||
+        !out.flush())
+      return false;
+    return table.write_nopointer_data(fp);
+  }
+
+  // Sparsegroups per chunk in serialize_parallel().
+  static const size_t SNAPSHOT_CHUNK_GROUPS = 1 << 10;
+
+  // Background snapshots, as for dense_hashtable: begin_snapshot() fixes
+  // what the snapshot will hold, write_snapshot() writes it, typically
+  // on another thread, while this one goes on changing the table, and
+  // end_snapshot() lets it go.  Here the unit copied before it changes
+  // is a chunk of SNAPSHOT_CHUNK_GROUPS sparsegroups.  Anything that
+  // rewrites the whole table -- a resize, clear(), swap() -- copies all
+  // the chunks not yet written, while a non-const iterator copies just
+  // the chunks it reaches as it goes.
+  //
+  // The file is what serialize_parallel() writes.  begin_snapshot()
+  // first gets rid of deleted entries, which copies the table if there
+  // are any.
+  void begin_snapshot() {
+    static_assert(std::is_copy_constructible<value_type>::value,
+                  "Snapshots copy values that are about to change");
+    assert(!snapshot_state && "A snapshot is already in progress");
+    squash_deleted();
+    sparsehash_internal::snapshot_header header = expected_snapshot_header();
+    header.flags |= sparsehash_internal::SNAPSHOT_INDEXED;
+    header.num_buckets = bucket_count();
+    header.num_elements = size();
+    header.chunk_size = SNAPSHOT_CHUNK_GROUPS;
+    snapshot_state.reset(new SnapshotState(
+        header, num_snapshot_chunks(table.group_count(),
+                                    SNAPSHOT_CHUNK_GROUPS)));
+  }
+
+  // Writes the snapshot begin_snapshot() started.  This may run on any
+  // one thread, concurrently with anything but end_snapshot() and the
+  // destructor.  Returns false on a write error, or if there's no
+  // snapshot to write.
+  template <typename ValueSerializer, typename OUTPUT>
+  bool write_snapshot(ValueSerializer serializer, OUTPUT* fp) const {
+    if (!snapshot_state) return false;
+    return sparsehash_internal::write_cow_snapshot(
+        fp, snapshot_state.get(),
+        [&](size_t page, const SnapshotPage* saved,
+            sparsehash_internal::memory_writer* out) {
+          if (saved)
+            return Table::write_group_range(serializer, out, saved->begin(),
+                                            saved->end());
+          // Not yet changed, so the table still has the snapshot's groups.
+          return table.write_groups(serializer, out,
+                                    page * SNAPSHOT_CHUNK_GROUPS,
+                                    (page + 1) * SNAPSHOT_CHUNK_GROUPS);
+        });
+  }
+
+  // Call once write_snapshot() has returned.
+  void end_snapshot() { snapshot_state.reset(); }
+
+  bool snapshot_in_progress() const { return snapshot_state != nullptr; }
+
+  // DELTAS
+  // With delta tracking on, the table remembers which sparsegroups have
+  // changed (see the dirty groups in sparsetable), and serialize_delta()
+  // writes just those, so a big table that changes a little at a time
+  // can be kept up to date, on disk or in a replica, without writing
+  // all of it each time.  Deltas are numbered by epoch: save the whole
+  // table (with serialize_snapshot(), say) when tracking is turned on,
+  // noting delta_epoch(); after that, each serialize_delta() writes what
+  // changed since the last one and moves the table on to the next
+  // epoch.  apply_delta() brings a table holding that base, whose epoch
+  // has been set to match, forward one delta at a time, and
+  // compact_deltas() folds a base and its deltas into a new base.
+  //
+  // Deltas carry deleted entries as they are -- getting rid of them
+  // would change every group -- so the table reading them needs the
+  // same deleted key, or has to be in physical-erase mode if the writer
+  // was.  Anything that rehashes the table makes the next delta hold
+  // every group.  A non-const iterator marks each group it reaches,
+  // since it may change the value there, so walking one over the whole
+  // table also puts every group in the next delta.
+  void set_delta_tracking(bool enable) { table.track_dirty_groups(enable); }
+  bool delta_tracking() const { return table.tracking_dirty_groups(); }
+  uint64_t delta_epoch() const { return epoch; }
+  void set_delta_epoch(uint64_t e) { epoch = e; }
+
+  // Writes the groups changed since since_epoch, which must be the
+  // current delta_epoch(), and if that works, starts the next epoch.
+  // False, with nothing changed, if tracking is off or the epoch is
+  // wrong; on a write error the groups stay marked, so a retry with the
+  // same epoch writes them all again.
+  template <typename ValueSerializer, typename OUTPUT>
+  bool serialize_delta(ValueSerializer serializer, uint64_t since_epoch,
+                       OUTPUT* fp) {
+    if (!delta_tracking() || since_epoch != epoch) return false;
+    sparsehash_internal::snapshot_header header = expected_snapshot_header();
+    header.flags |= sparsehash_internal::SNAPSHOT_DELTA;
+    header.num_buckets = bucket_count();
+    header.num_elements = size();
+    std::vector<size_type> dirty;
+    for (size_type group = 0; group < table.group_count(); ++group)
+      if (table.group_dirty(group)) dirty.push_back(group);
+    const bool erased_bits = settings.physical_erase();
+    if (!sparsehash_internal::write_snapshot_header(fp, header)) return false;
+    sparsehash_internal::checksummed_writer<OUTPUT> out(fp);
+    bool ok =
+        sparsehash_internal::write_bigendian_number(&out, since_epoch, 8) &&
+        sparsehash_internal::write_bigendian_number(&out, since_epoch + 1,
+                                                    8) &&
+        sparsehash_internal::write_bigendian_number(&out, num_deleted, 8) &&
+        sparsehash_internal::write_bigendian_number(
+            &out, static_cast<unsigned char>(erased_bits), 1) &&
+        sparsehash_internal::write_bigendian_number(&out, dirty.size(), 8);
+    for (size_t i = 0; ok && i < dirty.size(); ++i) {
+      ok = sparsehash_internal::write_bigendian_number(&out, dirty[i], 8) &&
+           table.write_groups(serializer, &out, dirty[i], dirty[i] + 1) &&
+           (!erased_bits || write_erased_bits(&out, dirty[i]));
+    }
+    if (!ok || !out.finish()) return false;
+    table.clear_dirty_groups();
+    ++epoch;
+    return true;
+  }
+
+  // Applies a delta that serialize_delta() wrote at this table's
+  // delta_epoch(), leaving the table at the epoch after it.  The delta
+  // is read and checked in full before any of it goes in, so a
+  // truncated, corrupt or out-of-order one leaves the table as it was.
+  template <typename ValueSerializer, typename INPUT>
+  bool apply_delta(ValueSerializer serializer, INPUT* fp) {
+    unsigned char magic[4];
+    if (!sparsehash_internal::read_data(fp, magic, sizeof(magic)))
+      return false;
+    const unsigned char* p = magic;
+    sparsehash_internal::snapshot_header header;
+    if (sparsehash_internal::get_bigendian(&p, 4) !=
+            sparsehash_internal::SNAPSHOT_MAGIC ||
+        !sparsehash_internal::read_snapshot_header_after_magic(fp, &header) ||
+        !header.delta())
+      return false;
+    header.flags &= ~sparsehash_internal::SNAPSHOT_DELTA;
+    if (header.indexed() ||
+        !header.compatible_with(expected_snapshot_header()))
+      return false;
+
+    sparsehash_internal::checksummed_reader<INPUT> in(fp, header.chunk_size);
+    uint64_t from, to, deleted, count;
+    unsigned char erased_bits;
+    if (!sparsehash_internal::read_bigendian_number(&in, &from, 8) ||
+        !sparsehash_internal::read_bigendian_number(&in, &to, 8) ||
+        !sparsehash_internal::read_bigendian_number(&in, &deleted, 8) ||
+        !sparsehash_internal::read_bigendian_number(&in, &erased_bits, 1) ||
+        !sparsehash_internal::read_bigendian_number(&in, &count, 8))
+      return false;
+    // Tombstones are only any use to a table that can recognize them.
+    if (from != epoch || to != from + 1 ||
+        (erased_bits != 0) != settings.physical_erase() ||
+        (deleted > 0 && !erased_bits && !settings.use_deleted()))
+      return false;
+    // A table with a new size comes with every one of its groups.
+    const uint64_t num_groups =
+        (header.num_buckets + DEFAULT_GROUP_SIZE - 1) / DEFAULT_GROUP_SIZE;
+    const bool resized = header.num_buckets != bucket_count();
+    if (count > num_groups || (resized && count != num_groups)) return false;
+
+    std::vector<size_type> indexes;
+    std::vector<typename Table::group_type> groups;
+    std::vector<unsigned char> erased;
+    indexes.reserve(count);
+    groups.reserve(count);
+    for (uint64_t i = 0; i < count; ++i) {
+      uint64_t index;
+      if (!sparsehash_internal::read_bigendian_number(&in, &index, 8) ||
+          index >= num_groups || (i > 0 && index <= indexes.back()))
+        return false;
+      indexes.push_back(static_cast<size_type>(index));
+      groups.push_back(table.new_group());
+      if (!Table::read_group(serializer, &in, &groups.back())) return false;
+      if (erased_bits) {
+        erased.resize(erased.size() + ERASED_BYTES_PER_GROUP);
+        if (!sparsehash_internal::read_data(
+                &in, &erased[erased.size() - ERASED_BYTES_PER_GROUP],
+                ERASED_BYTES_PER_GROUP))
+          return false;
+      }
+    }
+    if (!in.finish()) return false;
+
+    // Work out what size() will be before changing anything: a delta
+    // whose count doesn't come out right wasn't written for this table.
+    uint64_t nonempty = resized ? 0 : table.num_nonempty();
+    for (size_t i = 0; i < indexes.size(); ++i) {
+      if (!resized)
+        nonempty -= table.which_group(indexes[i] * DEFAULT_GROUP_SIZE)
+                        .num_nonempty();
+      nonempty += groups[i].num_nonempty();
+    }
+    if (!erased_bits && deleted > nonempty) return false;
+    if ((erased_bits ? nonempty : nonempty - deleted) != header.num_elements)
+      return false;
+
+    if (resized) {
+      clear();
+      table.resize(static_cast<size_type>(header.num_buckets));
+    }
+    if (erased_bits && erased_buckets.size() != bucket_count()) {
+      assert(num_deleted == 0);  // so there are no bits worth keeping
+      erased_buckets.assign(bucket_count(), false);
+    }
+    for (size_t i = 0; i < indexes.size(); ++i) {
+      before_write_groups(indexes[i], indexes[i] + 1);
+      table.swap_group(indexes[i], &groups[i]);
+      if (erased_bits)
+        read_erased_bits(&erased[i * ERASED_BYTES_PER_GROUP], indexes[i]);
+    }
+    table.recount_nonempty();
+    num_deleted = static_cast<size_type>(deleted);
+    if (num_deleted == 0) erased_buckets.clear();
+    settings.reset_thresholds(bucket_count());
+    assert(size() == header.num_elements);
+    epoch = to;
+    return true;
+  }
+
+  // Compaction: loads the base snapshot that was saved at base_epoch,
+  // applies the deltas [first, last) -- iterators over INPUT*s -- in
+  // order, and writes the result to out as a new base with
+  // serialize_snapshot(), so the old base and deltas can go.  The table
+  // is left holding the result, at the last delta's epoch.
+  template <typename ValueSerializer, typename INPUT, typename DeltaIterator,
+            typename OUTPUT>
+  bool compact_deltas(ValueSerializer serializer, INPUT* base,
+                      uint64_t base_epoch, DeltaIterator first,
+                      DeltaIterator last, OUTPUT* out) {
+    if (!unserialize_snapshot(serializer, base)) return false;
+    epoch = base_epoch;
+    for (; first != last; ++first)
+      if (!apply_delta(serializer, *first)) return false;
+    return serialize_snapshot(serializer, out);
+  }
+
  private:
+  static sparsehash_internal::snapshot_header expected_snapshot_header() {
+    return sparsehash_internal::expected_snapshot_header<hasher, key_type,
+                                                         value_type>(true);
+  }
+
+  static size_t num_snapshot_chunks(size_t n, size_t chunk_size) {
+    return (n + chunk_size - 1) / chunk_size;
+  }
+
+  // A group's worth of erased_buckets, a bit per bucket, as deltas
+  // carry them in physical-erase mode.
+  static const size_t ERASED_BYTES_PER_GROUP = DEFAULT_GROUP_SIZE / 8;
+  static_assert(DEFAULT_GROUP_SIZE % 8 == 0, "Groups must fill whole bytes");
+
+  template <typename OUTPUT>
+  bool write_erased_bits(OUTPUT* fp, size_type group) const {
+    unsigned char bytes[ERASED_BYTES_PER_GROUP] = {0};
+    if (erased_buckets.size() == bucket_count()) {
+      const size_type first = group * DEFAULT_GROUP_SIZE;
+      for (size_type i = 0;
+           i < DEFAULT_GROUP_SIZE && first + i < bucket_count(); ++i)
+        if (erased_buckets[first + i])
+          bytes[i / 8] |= static_cast<unsigned char>(1 << (i % 8));
+    }
+    return sparsehash_internal::write_data(fp, bytes, sizeof(bytes));
+  }
+
+  void read_erased_bits(const unsigned char* bytes, size_type group) {
+    const size_type first = group * DEFAULT_GROUP_SIZE;
+    for (size_type i = 0;
+         i < DEFAULT_GROUP_SIZE && first + i < bucket_count(); ++i)
+      erased_buckets[first + i] = (bytes[i / 8] >> (i % 8) & 1) != 0;
+  }
+
+  template <typename ValueSerializer, typename INPUT>
+  bool load_snapshot(ValueSerializer& serializer, INPUT* fp,
+                     size_type num_threads) {
+    unsigned char magic[4];
+    if (!sparsehash_internal::read_data(fp, magic, sizeof(magic)))
+      return false;
+    const unsigned char* p = magic;
+    if (sparsehash_internal::get_bigendian(&p, 4) !=
+        sparsehash_internal::SNAPSHOT_MAGIC) {
+      sparsehash_internal::replay_reader<INPUT> in(fp, magic, sizeof(magic));
+      return unserialize(serializer, &in);
+    }
+    sparsehash_internal::snapshot_header header;
+    if (!sparsehash_internal::read_snapshot_header_after_magic(fp, &header) ||
+        !header.compatible_with(expected_snapshot_header()))
+      return false;
+    bool ok;
+    if (header.indexed()) {
+      ok = load_indexed_snapshot(serializer, fp, header, num_threads);
+    } else {
+      sparsehash_internal::checksummed_reader<INPUT> in(fp, header.chunk_size);
+      ok = unserialize(serializer, &in) && in.finish();
+    }
+    if (!ok || bucket_count() != header.num_buckets ||
+        size() != header.num_elements) {
+      clear();
+      return false;
+    }
+    return true;
+  }
+
+  template <typename ValueSerializer, typename INPUT>
+  bool load_indexed_snapshot(ValueSerializer& serializer, INPUT* fp,
+                             const sparsehash_internal::snapshot_header& header,
+                             size_type num_threads) {
+    clear();
+    table.resize(static_cast<size_type>(header.num_buckets));
+    const size_type chunk_size = header.chunk_size;
+    const bool ok = sparsehash_internal::read_indexed_chunks(
+        fp, num_snapshot_chunks(table.group_count(), chunk_size), num_threads,
+        [&](size_t chunk, const char* data, size_t length) {
+          sparsehash_internal::memory_reader in(data, length);
+          ValueSerializer chunk_serializer = serializer;
+          return table.read_groups(chunk_serializer, &in, chunk * chunk_size,
+                                   (chunk + 1) * chunk_size) &&
+                 in.at_end();
+        });
+    table.recount_nonempty();
+    settings.reset_thresholds(bucket_count());
+    return ok;
+  }
+
   // Table is the main storage class.
   typedef sparsetable<value_type, DEFAULT_GROUP_SIZE, value_alloc_type> Table;
 
+ public:
+  // Reads what serialize() wrote a value at a time, holding just one
+  // value: see sparsetable.
+  template <typename ValueSerializer, typename INPUT>
+  using serialized_reader =
+      typename Table::template serialized_reader<ValueSerializer, INPUT>;
+
+ private:
+
+  // What before_write() saves of a chunk of the snapshot.
+  typedef typename Table::group_vector_type SnapshotPage;
+  typedef sparsehash_internal::cow_snapshot<SnapshotPage> SnapshotState;
+
+  // COPY-ON-WRITE
+  // While write_snapshot() runs, every change to the table is preceded
+  // by one of these, so the chunk holding the groups about to change is
+  // copied aside if it hasn't been written yet.  They also mark the
+  // groups dirty for serialize_delta().  With neither a snapshot nor
+  // delta tracking they cost a test of a NULL pointer and of a flag.
+  void before_write(size_type bucknum) {
+    table.mark_dirty(bucknum);
+    if (snapshot_state) {
+      const size_type group = bucknum / DEFAULT_GROUP_SIZE;
+      before_write_groups(group, group + 1);
+    }
+  }
+  void before_write_groups(size_type first, size_type last) {
+    table.mark_dirty_groups(first, last);
+    if (!snapshot_state || first == last) return;
+    for (size_t page = first / SNAPSHOT_CHUNK_GROUPS;
+         page <= (last - 1) / SNAPSHOT_CHUNK_GROUPS; ++page) {
+      snapshot_state->before_write(page, [this, page]() {
+        return save_snapshot_page(
+            page, std::is_copy_constructible<value_type>());
+      });
+    }
+  }
+  void before_write_all() {
+    table.mark_all_dirty();
+    if (snapshot_state) before_write_groups(0, table.group_count());
+  }
+  std::unique_ptr<SnapshotPage> save_snapshot_page(size_t page,
+                                                   std::true_type) const {
+    return std::unique_ptr<SnapshotPage>(new SnapshotPage(table.copy_groups(
+        page * SNAPSHOT_CHUNK_GROUPS, (page + 1) * SNAPSHOT_CHUNK_GROUPS)));
+  }
+  // begin_snapshot() doesn't compile for these, so it never gets here.
+  std::unique_ptr<SnapshotPage> save_snapshot_page(size_t,
+                                                   std::false_type) const {
+    assert(false);
+    return std::unique_ptr<SnapshotPage>();
+  }
+
   // Package templated functors with the other types to eliminate memory
   // needed for storing these zero-size operators.  Since ExtractKey and
   // hasher's operator() might have the same function signature, they
   // must be packaged in different classes.
+  // The Stats policy rides along too, so no_stats costs nothing.
   struct Settings
       : sparsehash_internal::sh_hashtable_settings<key_type, hasher, size_type,
-                                                   HT_MIN_BUCKETS> {
+                                                   HT_MIN_BUCKETS>,
+        Stats {
     explicit Settings(const hasher& hf)
         : sparsehash_internal::sh_hashtable_settings<key_type, hasher,
                                                      size_type, HT_MIN_BUCKETS>(
@@ -1225,32 +2152,59 @@ class sparse_hashtable {
   // Actual data
   Settings settings;
   KeyInfo key_info;
-  size_type num_deleted;  // how many occupied buckets are marked deleted
-  Table table;            // holds num_buckets and num_elements too
+  // How many occupied buckets are marked deleted or, in physical-erase
+  // mode, how many buckets are set in erased_buckets.
+  size_type num_deleted;
+  // In physical-erase mode, one bit per bucket, set for the buckets
+  // erase() emptied.  Sized lazily; all clear when num_deleted is 0.
+  std::vector<bool, erased_alloc_type> erased_buckets;
+  Table table;  // holds num_buckets and num_elements too
+  // Set between begin_snapshot() and end_snapshot().  Never copied or
+  // swapped: it belongs to this table's groups.
+  std::unique_ptr<SnapshotState> snapshot_state;
+  // Which delta the table is at; see serialize_delta().  Like delta
+  // tracking, it stays with this table when swapped.
+  uint64_t epoch;
 };
 
 // We need a global swap as well
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-inline void swap(sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>& x,
-                 sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>& y) {
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
+inline void swap(sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>& x,
+                 sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>& y) {
   x.swap(y);
 }
 
 #undef JUMP_
 
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-const typename sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>::size_type
-    sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>::ILLEGAL_BUCKET;
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
+const typename sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::size_type
+    sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::ILLEGAL_BUCKET;
+
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
+const size_t
+    sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::SNAPSHOT_CHUNK_GROUPS;
+
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
+const size_t
+    sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::ERASED_BYTES_PER_GROUP;
 
 // How full we let the table get before we resize.  Knuth says .8 is
 // good -- higher causes us to probe too much, though saves memory
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-const int sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>::HT_OCCUPANCY_PCT = 80;
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
+const int
+    sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::HT_OCCUPANCY_PCT = 80;
 
 // How empty we let the table get before we resize lower.
 // It should be less than OCCUPANCY_PCT / 2 or we thrash resizing
-template <class V, class K, class HF, class ExK, class SetK, class EqK, class A>
-const int sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>::HT_EMPTY_PCT =
+template <class V, class K, class HF, class ExK, class SetK, class EqK, class A,
+          class St>
+const int sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::HT_EMPTY_PCT =
     static_cast<int>(
-        0.4 * sparse_hashtable<V, K, HF, ExK, SetK, EqK, A>::HT_OCCUPANCY_PCT);
+        0.4 *
+        sparse_hashtable<V, K, HF, ExK, SetK, EqK, A, St>::HT_OCCUPANCY_PCT);
 }
@@ -33,9 +33,11 @@
 // Time various hash map implementations
 //
 // Below, times are per-call.  "Memory use" is "bytes in use by
-// application" as reported by tcmalloc, compared before and after the
-// function call.  This does not really report fragmentation, which is
-// not bad for the sparse* routines but bad for the dense* ones.
+// application" as reported by tcmalloc, or by glibc's mallinfo2()
+// without it, compared before and after the function call.  This does
+// not really report fragmentation, which is not bad for the sparse*
+// routines but bad for the dense* ones.  "map_memory" counts exactly
+// what each map allocates, and how much the process's RSS grew.
 //
 // The tests generally yield best-case performance because the
 // code uses sequential keys; on the other hand, "map_fetch_random" does
@@ -53,7 +55,29 @@
 //    binaries.
 //
 // See PERFORMANCE for the output of one example run.
+//
+// Run with --help for the flags.  Besides choosing which maps and object
+// sizes to test, they can replace the tests above with a single
+// workload described on the command line -- the key type, how the keys
+// are distributed, how often lookups miss, the mix of operations, and
+// the load factors to try -- to match a particular use.  Or, with
+// --workload=threads, the same lookups are run on up to --threads
+// threads sharing one table; --workload=serialize times saving tables
+// and loading them back; and --workload=trace replays the operations
+// recorded from a real program with trace_recorder.h.
+//
+// For tracking performance from one version to the next, --repetitions
+// runs each test several times, --csv and --json save the results, and
+// --baseline compares them with a saved CSV file; "make bench_results"
+// does all three.
+//
+// --latency adds percentiles of single-operation times to each timed
+// loop, and says how many of the slow ones happened while the table was
+// being resized.  --perf_counters adds cache, TLB and branch misses per
+// operation, where the kernel and the CPU let us count them.
 
+#include <cerrno>
+#include <cinttypes>
 #include <cstdint>  // for uintptr_t
 #include <cstdio>
 #include <cstdlib>
@@ -69,6 +93,13 @@ extern "C" {
 #ifdef HAVE_SYS_UTSNAME_H
 #include <sys/utsname.h>
 #endif  // for uname()
+#include <pthread.h>  // for the readers-writer lock
+#ifdef __linux__
+#include <linux/perf_event.h>  // for the hardware counters
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 }
 
 // The functions that we call on each map, that differ for different types.
@@ -77,11 +108,21 @@ extern "C" {
 #include <map>
 #include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <vector>
 #include <chrono>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
 #include <type_traits>
 #include <sparsehash/dense_hash_map>
 #include <sparsehash/sparse_hash_map>
+#include <sparsehash/sparse_hash_map_view>
+#include "trace_recorder.h"
 
 using std::map;
 using std::unordered_map;
@@ -93,6 +134,9 @@ using std::chrono::time_point;
 using std::chrono::nanoseconds;
 using google::dense_hash_map;
 using google::sparse_hash_map;
+using google::libc_allocator_with_realloc;
+
+static const int kDefaultIters = 10000000;
 
 static bool FLAGS_test_sparse_hash_map = true;
 static bool FLAGS_test_dense_hash_map = true;
@@ -103,56 +147,272 @@ static bool FLAGS_test_4_bytes = true;
 static bool FLAGS_test_8_bytes = true;
 static bool FLAGS_test_16_bytes = true;
 static bool FLAGS_test_256_bytes = true;
+static bool FLAGS_test_memory = true;
+
+static int FLAGS_iters = kDefaultIters;
+
+// "suite" runs the fixed tests below on HashObjects of each size;
+// "profile" runs one configurable workload (see time_map_profile()).
+static std::string FLAGS_workload = "suite";
+
+// The profile workload.
+static int FLAGS_elements = 1000000;
+static int FLAGS_ops = 0;  // 0 means as many as there are elements
+static std::string FLAGS_key = "int64";  // int32, int64 or string
+static int FLAGS_string_size = 16;
+static std::string FLAGS_distribution = "uniform";
+static double FLAGS_zipf = 0.99;
+static double FLAGS_hit_ratio = 1.0;
+static int FLAGS_find_percent = 100;
+static int FLAGS_insert_percent = 0;
+static int FLAGS_erase_percent = 0;
+static std::string FLAGS_load_factors = "";  // e.g. "0.5,0.8"; "" is default
+static int FLAGS_seed = 301;
+
+// The threads workload runs the profile's lookups on 1, 2, 4, ... up to
+// this many threads; 0 means as many as there are cores.
+static int FLAGS_threads = 0;
+
+// Where the serialize workload writes its files.
+static std::string FLAGS_serialize_file = "bench.serialized";
+
+// The operations the trace workload replays; see trace_recorder.h.
+static std::string FLAGS_trace = "";
+
+// With --latency the timed loops also time every --latency_batch
+// operations on their own and report percentiles of those times.
+static bool FLAGS_latency = false;
+static int FLAGS_latency_batch = 1;
+
+// Count cache and TLB misses, instructions and branch misses per
+// operation too, on Linux where perf_event_open() allows it.
+static bool FLAGS_perf_counters = false;
+
+// For keeping track of results from run to run: each test is run
+// --repetitions times, and the median time reported; --csv and --json
+// write all the results to files; and given a file --csv wrote before,
+// --baseline lists the tests that got slower, and fails the run if any
+// did by more than --regression_percent (and by more than chance, when
+// there are repetitions to tell by).
+static int FLAGS_repetitions = 1;
+static std::string FLAGS_csv = "";
+static std::string FLAGS_json = "";
+static std::string FLAGS_baseline = "";
+static double FLAGS_regression_percent = 5;
+
+// Every flag can be given as --name=value; booleans also as --name and
+// --noname.
+struct Flag {
+  enum Type { BOOL, INT, DOUBLE, STRING };
+  const char* name;
+  Type type;
+  void* value;
+  const char* help;
+};
 
-static const int kDefaultIters = 10000000;
+static const Flag kFlags[] = {
+    {"test_sparse_hash_map", Flag::BOOL, &FLAGS_test_sparse_hash_map,
+     "google::sparse_hash_map"},
+    {"test_dense_hash_map", Flag::BOOL, &FLAGS_test_dense_hash_map,
+     "google::dense_hash_map"},
+    {"test_hash_map", Flag::BOOL, &FLAGS_test_hash_map,
+     "std::unordered_map"},
+    {"test_map", Flag::BOOL, &FLAGS_test_map, "std::map"},
+    {"test_4_bytes", Flag::BOOL, &FLAGS_test_4_bytes,
+     "suite: 4-byte objects"},
+    {"test_8_bytes", Flag::BOOL, &FLAGS_test_8_bytes,
+     "suite: 8-byte objects"},
+    {"test_16_bytes", Flag::BOOL, &FLAGS_test_16_bytes,
+     "suite: 16-byte objects"},
+    {"test_256_bytes", Flag::BOOL, &FLAGS_test_256_bytes,
+     "suite: 256-byte objects"},
+    {"test_memory", Flag::BOOL, &FLAGS_test_memory,
+     "suite: fill each map once more to measure its memory use"},
+    {"iters", Flag::INT, &FLAGS_iters,
+     "suite iterations (also the first non-flag argument)"},
+    {"workload", Flag::STRING, &FLAGS_workload,
+     "suite, profile, threads, serialize or trace"},
+    {"elements", Flag::INT, &FLAGS_elements, "profile: keys in the table"},
+    {"ops", Flag::INT, &FLAGS_ops, "profile: operations timed"},
+    {"key", Flag::STRING, &FLAGS_key, "profile: int32, int64 or string"},
+    {"string_size", Flag::INT, &FLAGS_string_size,
+     "profile: bytes per string key, at least 8"},
+    {"distribution", Flag::STRING, &FLAGS_distribution,
+     "profile: sequential, uniform, clustered or zipf"},
+    {"zipf", Flag::DOUBLE, &FLAGS_zipf, "profile: skew of the zipf lookups"},
+    {"hit_ratio", Flag::DOUBLE, &FLAGS_hit_ratio,
+     "profile: fraction of finds for keys in the table"},
+    {"find_percent", Flag::INT, &FLAGS_find_percent,
+     "profile: percent of operations that are finds"},
+    {"insert_percent", Flag::INT, &FLAGS_insert_percent,
+     "profile: ... inserts"},
+    {"erase_percent", Flag::INT, &FLAGS_erase_percent,
+     "profile: ... erases"},
+    {"load_factors", Flag::STRING, &FLAGS_load_factors,
+     "profile: max_load_factor()s to sweep, comma-separated"},
+    {"seed", Flag::INT, &FLAGS_seed, "profile: random seed"},
+    {"threads", Flag::INT, &FLAGS_threads,
+     "threads: most threads to try (0: one per core)"},
+    {"serialize_file", Flag::STRING, &FLAGS_serialize_file,
+     "serialize: the file to write and read back"},
+    {"trace", Flag::STRING, &FLAGS_trace, "trace: the trace file to replay"},
+    {"latency", Flag::BOOL, &FLAGS_latency,
+     "report per-operation latency percentiles"},
+    {"latency_batch", Flag::INT, &FLAGS_latency_batch,
+     "latency: operations timed together"},
+    {"perf_counters", Flag::BOOL, &FLAGS_perf_counters,
+     "report hardware counters per operation (Linux)"},
+    {"repetitions", Flag::INT, &FLAGS_repetitions,
+     "runs of each test; the median is reported"},
+    {"csv", Flag::STRING, &FLAGS_csv, "write the results to this CSV file"},
+    {"json", Flag::STRING, &FLAGS_json, "write the results to this JSON file"},
+    {"baseline", Flag::STRING, &FLAGS_baseline,
+     "CSV file from an earlier run to compare with"},
+    {"regression_percent", Flag::DOUBLE, &FLAGS_regression_percent,
+     "baseline: how much slower counts as a regression"},
+};
+
+static void usage(const char* argv0) {
+  printf("usage: %s [iters] [--flag=value ...]\n", argv0);
+  for (const Flag& flag : kFlags) {
+    printf("  --%-22s %s\n", flag.name, flag.help);
+  }
+}
+
+static bool set_flag(const Flag& flag, const char* value) {
+  char* end;
+  switch (flag.type) {
+    case Flag::BOOL:
+      if (strcmp(value, "true") == 0 || strcmp(value, "1") == 0) {
+        *static_cast<bool*>(flag.value) = true;
+      } else if (strcmp(value, "false") == 0 || strcmp(value, "0") == 0) {
+        *static_cast<bool*>(flag.value) = false;
+      } else {
+        return false;
+      }
+      return true;
+    case Flag::INT:
+      *static_cast<int*>(flag.value) = static_cast<int>(strtol(value, &end, 10));
+      return *value != '\0' && *end == '\0';
+    case Flag::DOUBLE:
+      *static_cast<double*>(flag.value) = strtod(value, &end);
+      return *value != '\0' && *end == '\0';
+    case Flag::STRING:
+      *static_cast<std::string*>(flag.value) = value;
+      return true;
+  }
+  return false;
+}
+
+// Returns false, having said why, if an argument makes no sense.
+static bool parse_flags(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--", 2) != 0) {  // the old way to give iters
+      FLAGS_iters = atoi(arg);
+      continue;
+    }
+    arg += 2;
+    if (strcmp(arg, "help") == 0) {
+      usage(argv[0]);
+      return false;
+    }
+    const char* eq = strchr(arg, '=');
+    const std::string name = eq ? std::string(arg, eq) : std::string(arg);
+    bool ok = false;
+    for (const Flag& flag : kFlags) {
+      if (name == flag.name) {
+        ok = set_flag(flag, eq ? eq + 1 : "true");
+      } else if (!eq && flag.type == Flag::BOOL && name == std::string("no") +
+                                                              flag.name) {
+        ok = set_flag(flag, "false");
+      } else {
+        continue;
+      }
+      break;
+    }
+    if (!ok) {
+      fprintf(stderr, "bad flag %s (try --help)\n", argv[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The keys the wrappers below set aside as empty and deleted keys: -1
+// and -2 for int-like keys, and, for strings, ones shorter than any the
+// profile workload makes.
+template <typename K>
+struct ReservedKeys {
+  static K first() { return K(-1); }
+  static K second() { return K(-2); }
+};
+
+template <>
+struct ReservedKeys<std::string> {
+  static std::string first() { return std::string(); }
+  static std::string second() { return std::string(1, '\1'); }
+};
 
 // A version of each of the hashtable classes we test, that has been
 // augumented to provide a common interface.  For instance, the
 // sparse_hash_map and dense_hash_map versions set empty-key and
 // deleted-key (we can do this because all our tests use int-like
-// keys), so the users don't have to.  The hash_map version adds
-// resize(), so users can just call resize() for all tests without
+// keys, or strings), so the users don't have to.  The hash_map version
+// adds resize(), so users can just call resize() for all tests without
 // worrying about whether the map-type supports it or not.
 
-template <typename K, typename V, typename H>
-class EasyUseSparseHashMap : public sparse_hash_map<K, V, H> {
+//
+// Each also takes an allocator, for measuring memory use.
+
+template <typename K, typename V, typename H,
+          typename A = libc_allocator_with_realloc<std::pair<const K, V>>>
+class EasyUseSparseHashMap
+    : public sparse_hash_map<K, V, H, std::equal_to<K>, A> {
  public:
-  EasyUseSparseHashMap() { this->set_deleted_key(-1); }
+  EasyUseSparseHashMap() { this->set_deleted_key(ReservedKeys<K>::first()); }
 };
 
-template <typename K, typename V, typename H>
-class EasyUseDenseHashMap : public dense_hash_map<K, V, H> {
+template <typename K, typename V, typename H,
+          typename A = libc_allocator_with_realloc<std::pair<const K, V>>>
+class EasyUseDenseHashMap
+    : public dense_hash_map<K, V, H, std::equal_to<K>, A> {
  public:
   EasyUseDenseHashMap() {
-    this->set_empty_key(-1);
-    this->set_deleted_key(-2);
+    this->set_empty_key(ReservedKeys<K>::first());
+    this->set_deleted_key(ReservedKeys<K>::second());
   }
 };
 
 // For pointers, we only set the empty key.
-template <typename K, typename V, typename H>
-class EasyUseSparseHashMap<K*, V, H> : public sparse_hash_map<K*, V, H> {
+template <typename K, typename V, typename H, typename A>
+class EasyUseSparseHashMap<K*, V, H, A>
+    : public sparse_hash_map<K*, V, H, std::equal_to<K*>, A> {
  public:
   EasyUseSparseHashMap() {}
 };
 
-template <typename K, typename V, typename H>
-class EasyUseDenseHashMap<K*, V, H> : public dense_hash_map<K*, V, H> {
+template <typename K, typename V, typename H, typename A>
+class EasyUseDenseHashMap<K*, V, H, A>
+    : public dense_hash_map<K*, V, H, std::equal_to<K*>, A> {
  public:
   EasyUseDenseHashMap() { this->set_empty_key((K*)(~0)); }
 };
 
-template <typename K, typename V, typename H>
-class EasyUseHashMap : public unordered_map<K, V, H> {
+template <typename K, typename V, typename H,
+          typename A = std::allocator<std::pair<const K, V>>>
+class EasyUseHashMap : public unordered_map<K, V, H, std::equal_to<K>, A> {
  public:
   // resize() is called rehash() in tr1
   void resize(size_t r) { this->rehash(r); }
 };
 
-template <typename K, typename V>
-class EasyUseMap : public map<K, V> {
+template <typename K, typename V,
+          typename A = std::allocator<std::pair<const K, V>>>
+class EasyUseMap : public map<K, V, std::less<K>, A> {
  public:
   void resize(size_t) {}  // map<> doesn't support resize
+  void max_load_factor(float) {}  // nor load factors
 };
 
 // Returns the number of hashes that have been done since the last
@@ -274,6 +534,213 @@ class HashFn {
   static const size_t min_buckets = 8;
 };
 
+// std::hash, counted like HashObject::Hash(), for the profile workload's
+// plain keys.
+template <typename K>
+class CountingHash {
+ public:
+  size_t operator()(const K& key) const {
+    g_num_hashes++;
+    return std::hash<K>()(key);
+  }
+};
+
+// The bytes allocated through a CountingAllocator and not yet freed, and
+// the most there have been since g_peak_allocated was last reset.
+static size_t g_allocated;
+static size_t g_peak_allocated;
+
+// An allocator that keeps g_allocated up to date.  Our maps don't use
+// realloc() with it, as they do with their default allocator; that
+// changes how they grow, but not how much memory they end up holding.
+template <typename T>
+class CountingAllocator {
+ public:
+  typedef T value_type;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+
+  CountingAllocator() {}
+  template <class U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+
+  pointer address(reference r) const { return &r; }
+  const_pointer address(const_reference r) const { return &r; }
+  pointer allocate(size_type n, const_pointer = 0) {
+    g_allocated += n * sizeof(value_type);
+    g_peak_allocated = std::max(g_peak_allocated, g_allocated);
+    return static_cast<pointer>(malloc(n * sizeof(value_type)));
+  }
+  void deallocate(pointer p, size_type n) {
+    g_allocated -= n * sizeof(value_type);
+    free(p);
+  }
+  size_type max_size() const {
+    return static_cast<size_type>(-1) / sizeof(value_type);
+  }
+  void construct(pointer p, const value_type& val) { new (p) value_type(val); }
+  void destroy(pointer p) { p->~value_type(); }
+
+  template <class U>
+  struct rebind {
+    typedef CountingAllocator<U> other;
+  };
+
+  bool operator==(const CountingAllocator&) const { return true; }
+  bool operator!=(const CountingAllocator&) const { return false; }
+};
+
+/*
+ * Count hardware events.
+ */
+
+// The counters we ask for, per thread and in user space only.  Any the
+// CPU or the kernel won't give us -- perf_event_paranoid, a virtual
+// machine without a PMU -- are just left out.
+class PerfCounters {
+ public:
+  PerfCounters() {
+    for (int i = 0; i < kNumEvents; i++) fds_[i] = -1;
+  }
+  ~PerfCounters() {
+#ifdef __linux__
+    for (int i = 0; i < kNumEvents; i++) {
+      if (fds_[i] >= 0) close(fds_[i]);
+    }
+#endif
+  }
+
+  // Returns false, having said why, if no counter would open.
+  bool Open();
+
+  bool is_open() const {
+    for (int i = 0; i < kNumEvents; i++) {
+      if (fds_[i] >= 0) return true;
+    }
+    return false;
+  }
+
+  void Start();
+  void Stop();
+
+  // Prints what was counted between the last Start() and Stop(), per op.
+  void Report(double ops) const;
+
+ private:
+  enum { kNumEvents = 5 };
+  struct Reading {  // as read() returns it, given our read_format
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+  };
+
+  static const char* const kNames[kNumEvents];
+
+  int fds_[kNumEvents];
+  Reading start_[kNumEvents];
+  double counts_[kNumEvents];  // < 0 if the counter never got to run
+};
+
+const char* const PerfCounters::kNames[kNumEvents] = {
+    "instructions", "branch-misses", "L1D-misses", "LLC-misses",
+    "dTLB-misses"};
+
+#ifdef __linux__
+
+bool PerfCounters::Open() {
+  static const uint64_t kReadMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  static const struct {
+    uint32_t type;
+    uint64_t config;
+  } kEvents[kNumEvents] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | kReadMiss},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | kReadMiss},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | kReadMiss},
+  };
+  int error = 0;
+  for (int i = 0; i < kNumEvents; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = kEvents[i].type;
+    attr.config = kEvents[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // Not a group: if the CPU has too few counters, the kernel takes
+    // turns with them, and time_running says how to scale up.
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    fds_[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    if (fds_[i] < 0) error = errno;
+  }
+  if (!is_open()) {
+    fprintf(stderr, "no hardware counters: %s\n", strerror(error));
+    return false;
+  }
+  return true;
+}
+
+void PerfCounters::Start() {
+  for (int i = 0; i < kNumEvents; i++) {
+    if (fds_[i] < 0) continue;
+    if (read(fds_[i], &start_[i], sizeof(start_[i])) != sizeof(start_[i])) {
+      memset(&start_[i], 0, sizeof(start_[i]));
+    }
+    ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+void PerfCounters::Stop() {
+  for (int i = 0; i < kNumEvents; i++) {
+    counts_[i] = -1;
+    if (fds_[i] < 0) continue;
+    ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+    Reading now;
+    if (read(fds_[i], &now, sizeof(now)) != sizeof(now)) continue;
+    const uint64_t enabled = now.time_enabled - start_[i].time_enabled;
+    const uint64_t running = now.time_running - start_[i].time_running;
+    if (running == 0) continue;
+    counts_[i] = (now.value - start_[i].value) * (1.0 * enabled / running);
+  }
+}
+
+#else  // not __linux__
+
+bool PerfCounters::Open() {
+  fprintf(stderr, "no hardware counters on this platform\n");
+  return false;
+}
+void PerfCounters::Start() {}
+void PerfCounters::Stop() {
+  for (int i = 0; i < kNumEvents; i++) counts_[i] = -1;
+}
+
+#endif  // __linux__
+
+void PerfCounters::Report(double ops) const {
+  printf("  counters/op       ");
+  for (int i = 0; i < kNumEvents; i++) {
+    if (fds_[i] < 0) continue;
+    if (counts_[i] < 0) {
+      printf(" %s n/a", kNames[i]);
+    } else {
+      printf(" %s %.3g", kNames[i], counts_[i] / ops);
+    }
+  }
+  printf("\n");
+}
+
+// Open with --perf_counters; then Rusage runs it along with the clock.
+static PerfCounters g_perf;
+
 /*
  * Measure resource usage.
  */
@@ -296,14 +763,157 @@ class Rusage {
 inline void Rusage::Reset() { 
   g_num_copies = 0;
   g_num_hashes = 0;  
+  g_perf.Start();
   start_ = steady_clock::now(); 
 }
 
 inline double Rusage::UserTime() {
   auto diff = steady_clock::now() - start_;
+  g_perf.Stop();
   return duration_cast<nanoseconds>(diff).count();
 }
 
+/*
+ * Measure the latency of single operations.
+ */
+
+// Latencies in nanoseconds, bucketed the way HdrHistogram does it: exactly
+// below 64ns, and in 32 steps per power of two above that, so that any
+// percentile is within about 3% of the truth.
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : counts_(kNumBuckets), count_(0), total_(0), max_(0) {}
+
+  void Clear() {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    count_ = total_ = max_ = 0;
+  }
+
+  void Record(uint64_t ns) {
+    counts_[Bucket(ns)]++;
+    count_++;
+    total_ += ns;
+    max_ = std::max(max_, ns);
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t total() const { return total_; }
+  uint64_t max() const { return max_; }
+
+  // The latency that fraction p of the samples are no slower than.
+  uint64_t Percentile(double p) const {
+    const uint64_t rank = std::max<uint64_t>(1, ceil(p * count_));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); i++) {
+      seen += counts_[i];
+      if (seen >= rank) return std::min(Top(i), max_);
+    }
+    return max_;
+  }
+
+  // How many samples were slower than ns, give or take a bucket.
+  uint64_t CountAbove(uint64_t ns) const {
+    uint64_t n = 0;
+    for (size_t i = Bucket(ns) + 1; i < counts_.size(); i++) n += counts_[i];
+    return n;
+  }
+
+ private:
+  static const int kSubBits = 5;  // 32 buckets per power of two
+  static const size_t kExact = 2 << kSubBits;
+  static const size_t kNumBuckets = kExact + ((64 - kSubBits - 1) << kSubBits);
+
+  static size_t Bucket(uint64_t ns) {
+    if (ns < kExact) return ns;
+    int msb = kSubBits + 1;
+    while (ns >> (msb + 1)) msb++;
+    const size_t sub = (ns >> (msb - kSubBits)) & ((1 << kSubBits) - 1);
+    return kExact + ((msb - kSubBits - 1) << kSubBits) + sub;
+  }
+
+  // The slowest latency that lands in bucket i.
+  static uint64_t Top(size_t i) {
+    if (i < kExact) return i;
+    const int msb = kSubBits + 1 + static_cast<int>((i - kExact) >> kSubBits);
+    const uint64_t sub = (i - kExact) & ((1 << kSubBits) - 1);
+    return (((uint64_t(1) << kSubBits) + sub + 1) << (msb - kSubBits)) - 1;
+  }
+
+  vector<uint64_t> counts_;
+  uint64_t count_;
+  uint64_t total_;
+  uint64_t max_;
+};
+
+// What the timed loops record with --latency, until report() prints and
+// clears it.  Batches during which the table was rebuilt also go into
+// rebuilds, to tell how much of the tail is resizing.
+struct LatencyStats {
+  LatencyHistogram all;
+  LatencyHistogram rebuilds;
+  int batch;  // operations per sample; samples are per-operation averages
+};
+static LatencyStats g_latency;
+
+// Something that changes whenever the map rebuilds its table: the number
+// of table copies for our maps, the bucket count for unordered_map, and
+// nothing at all for std::map, which never rebuilds.
+template <int N>
+struct Rank : Rank<N - 1> {};
+template <>
+struct Rank<0> {};
+
+template <class MapType>
+static auto rebuild_marker(const MapType& set, Rank<2>)
+    -> decltype(size_t(set.num_table_copies())) {
+  return set.num_table_copies();
+}
+template <class MapType>
+static auto rebuild_marker(const MapType& set, Rank<1>)
+    -> decltype(size_t(set.bucket_count())) {
+  return set.bucket_count();
+}
+template <class MapType>
+static size_t rebuild_marker(const MapType&, Rank<0>) {
+  return 0;
+}
+
+// Runs op(0) through op(n - 1) on set.  With --latency, it also times
+// them a batch at a time into g_latency; the clock readings then show up
+// in the overall time as well.
+template <class MapType, class Op>
+static void timed_loop(const MapType& set, size_t n, Op op) {
+  if (!FLAGS_latency) {
+    for (size_t i = 0; i < n; i++) op(i);
+    return;
+  }
+  const size_t batch = g_latency.batch = std::max(1, FLAGS_latency_batch);
+  for (size_t i = 0; i < n;) {
+    const size_t end = std::min(n, i + batch);
+    const size_t marker = rebuild_marker(set, Rank<2>());
+    const steady_clock::time_point start = steady_clock::now();
+    for (size_t j = i; j < end; j++) op(j);
+    const uint64_t ns =
+        duration_cast<nanoseconds>(steady_clock::now() - start).count() /
+        (end - i);
+    g_latency.all.Record(ns);
+    if (rebuild_marker(set, Rank<2>()) != marker) g_latency.rebuilds.Record(ns);
+    i = end;
+  }
+}
+
+// How long it takes to read the clock, which every latency includes.
+static uint64_t clock_overhead() {
+  uint64_t best = ~uint64_t(0);
+  for (int i = 0; i < 1000; i++) {
+    const steady_clock::time_point start = steady_clock::now();
+    const uint64_t ns =
+        duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    best = std::min(best, ns);
+  }
+  return best;
+}
+
 static void print_uname() {
 #ifdef HAVE_SYS_UTSNAME_H
   struct utsname u;
@@ -324,6 +934,11 @@ static void stamp_run(int iters) {
   fflush(stdout);
   // don't need asctime_r/gmtime_r: we're not threaded
   printf("Current time (GMT): %s", asctime(gmtime(&now)));
+  if (FLAGS_latency) {
+    printf("Latencies per op over batches of %d, counting %" PRIu64
+           " ns to read the clock\n",
+           std::max(1, FLAGS_latency_batch), clock_overhead());
+  }
 }
 
 // This depends on the malloc implementation for exactly what it does
@@ -344,23 +959,363 @@ static size_t CurrentMemoryUsage() {
   }
 }
 
+static void ReleaseFreeMemory() {
+  MallocExtension::instance()->ReleaseFreeMemory();
+}
+
+#elif defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+
+// glibc's count of the bytes malloc has handed out, big blocks it
+// mmap()s included.  Unlike tcmalloc's, this includes malloc's overhead.
+static size_t CurrentMemoryUsage() {
+  const struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+static void ReleaseFreeMemory() { malloc_trim(0); }
+
 #else /* not HAVE_GOOGLE_MALLOC_EXTENSION_H */
 static size_t CurrentMemoryUsage() { return 0; }
+static void ReleaseFreeMemory() {}
 
 #endif
 
+// The process's resident set size and its high-water mark, in bytes.
+// Returns false where /proc/self/status isn't there to say.
+static bool ProcessMemory(size_t* rss, size_t* peak_rss) {
+  FILE* fp = fopen("/proc/self/status", "r");
+  if (!fp) return false;
+  char line[256];
+  unsigned long kb;
+  *rss = *peak_rss = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "VmRSS: %lu kB", &kb) == 1) *rss = kb << 10;
+    if (sscanf(line, "VmHWM: %lu kB", &kb) == 1) *peak_rss = kb << 10;
+  }
+  fclose(fp);
+  return *rss > 0;
+}
+
+// Starts the high-water mark over at the current RSS, where Linux lets us.
+static void ResetPeakRss() {
+  FILE* fp = fopen("/proc/self/clear_refs", "w");
+  if (fp) {
+    fputs("5", fp);
+    fclose(fp);
+  }
+}
+
+// Prints the percentiles, and how much of the time and of the slowest
+// 0.1% went to batches that rebuilt the table.
+static void report_latency() {
+  const LatencyHistogram& all = g_latency.all;
+  const LatencyHistogram& rebuilds = g_latency.rebuilds;
+  const uint64_t p999 = all.Percentile(0.999);
+  printf("  latency            p50 %" PRIu64 "  p99 %" PRIu64 "  p99.9 %" PRIu64
+         "  max %" PRIu64 " ns\n",
+         all.Percentile(0.5), all.Percentile(0.99), p999, all.max());
+  if (rebuilds.count() > 0) {
+    printf("  resizing           %" PRIu64 " batches, %.1f%% of the time, %" PRIu64
+           " of the %" PRIu64 " past p99.9\n",
+           rebuilds.count(), 100.0 * rebuilds.total() / all.total(),
+           rebuilds.CountAbove(p999), all.CountAbove(p999));
+  }
+}
+
+/*
+ * Keep the results, to write out and to compare with older ones.
+ */
+
+// One test on one map, run --repetitions times.  Everything but the
+// times comes from the last run.
+struct Result {
+  std::string test;
+  std::string container;
+  int object_size;  // the key's size, for the profile workload
+  int iters;
+  vector<double> ns;  // per op, for each repetition
+  int hashes;
+  int copies;
+  size_t memory;        // heap growth, where CurrentMemoryUsage() knows it
+  uint64_t latency[4];  // p50, p99, p99.9 and max, with --latency
+
+  double Median() const {
+    vector<double> sorted(ns);
+    std::sort(sorted.begin(), sorted.end());
+    const size_t n = sorted.size();
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+  }
+  double Mean() const {
+    double sum = 0;
+    for (double x : ns) sum += x;
+    return sum / ns.size();
+  }
+  double Stddev() const {  // of a sample; 0 for a single run
+    if (ns.size() < 2) return 0;
+    const double mean = Mean();
+    double sum = 0;
+    for (double x : ns) sum += (x - mean) * (x - mean);
+    return sqrt(sum / (ns.size() - 1));
+  }
+};
+
+// A deque, so that next_result() can hand out pointers that last.
+static std::deque<Result> g_results;
+
+// What report() files results under: the map, and the size of the
+// objects or keys in it.
+static std::string g_container;
+static int g_object_size;
+
+// The result for another run of test: the last one for it on this map,
+// unless that has had all its repetitions.
+static Result* next_result(const char* test, int iters) {
+  for (size_t i = g_results.size(); i-- > 0;) {
+    Result& result = g_results[i];
+    if (result.test == test && result.container == g_container &&
+        result.object_size == g_object_size &&
+        result.ns.size() < static_cast<size_t>(FLAGS_repetitions)) {
+      return &result;
+    }
+  }
+  Result result = Result();
+  result.test = test;
+  result.container = g_container;
+  result.object_size = g_object_size;
+  result.iters = iters;
+  g_results.push_back(result);
+  return &g_results.back();
+}
+
+// Runs a test --repetitions times; report() prints it after the last.
+template <class Fn>
+static void repeat(Fn fn) {
+  for (int i = 0; i < FLAGS_repetitions; i++) fn();
+}
+
 static void report(char const* title, double t, int iters, size_t start_memory,
                    size_t end_memory) {
-  // Construct heap growth report text if applicable
-  char heap[100] = "";
-  if (end_memory > start_memory) {
-    snprintf(heap, sizeof(heap), "%7.1f MB",
-             (end_memory - start_memory) / 1048576.0);
+  Result* result = next_result(title, iters);
+  result->ns.push_back(t / iters);
+  result->hashes = NumHashesSinceLastCall();
+  result->copies = NumCopiesSinceLastCall();
+  result->memory = end_memory > start_memory ? end_memory - start_memory : 0;
+  const bool latency = FLAGS_latency && g_latency.all.count() > 0;
+  if (latency) {
+    result->latency[0] = g_latency.all.Percentile(0.5);
+    result->latency[1] = g_latency.all.Percentile(0.99);
+    result->latency[2] = g_latency.all.Percentile(0.999);
+    result->latency[3] = g_latency.all.max();
   }
 
-  printf("%-20s %6.1f ns  (%8d hashes, %8d copies)%s\n", title, (t / iters),
-         NumHashesSinceLastCall(), NumCopiesSinceLastCall(), heap);
-  fflush(stdout);
+  if (result->ns.size() == static_cast<size_t>(FLAGS_repetitions)) {
+    // Construct heap growth report text if applicable
+    char heap[100] = "";
+    if (result->memory > 0) {
+      snprintf(heap, sizeof(heap), "%7.1f MB", result->memory / 1048576.0);
+    }
+    char spread[32] = "";
+    if (result->ns.size() > 1) {
+      snprintf(spread, sizeof(spread), " sd %4.1f%%",
+               100 * result->Stddev() / result->Mean());
+    }
+
+    printf("%-20s %6.1f ns%s  (%8d hashes, %8d copies)%s\n", title,
+           result->Median(), spread, result->hashes, result->copies, heap);
+    if (g_perf.is_open()) g_perf.Report(iters);
+    if (latency) report_latency();
+    fflush(stdout);
+  }
+  g_latency.all.Clear();
+  g_latency.rebuilds.Clear();
+}
+
+static bool write_csv(const char* path) {
+  FILE* fp = fopen(path, "w");
+  if (!fp) return false;
+  fprintf(fp,
+          "test,container,object_size,iterations,repetitions,ns_per_op,"
+          "ns_mean,ns_stddev,hashes,copies,memory_bytes,p50_ns,p99_ns,"
+          "p999_ns,max_ns\n");
+  for (const Result& r : g_results) {
+    // None of our names have commas or quotes in them.
+    fprintf(fp, "%s,%s,%d,%d,%d,%.3f,%.3f,%.3f,%d,%d,%zu", r.test.c_str(),
+            r.container.c_str(), r.object_size, r.iters,
+            static_cast<int>(r.ns.size()), r.Median(), r.Mean(), r.Stddev(),
+            r.hashes, r.copies, r.memory);
+    for (uint64_t ns : r.latency) fprintf(fp, ",%" PRIu64, ns);
+    fprintf(fp, "\n");
+  }
+  return fclose(fp) == 0;
+}
+
+static bool write_json(const char* path) {
+  FILE* fp = fopen(path, "w");
+  if (!fp) return false;
+  const time_t now = time(0);
+  char date[32];
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  fprintf(fp, "{\n  \"date\": \"%s\",\n  \"workload\": \"%s\",\n", date,
+          FLAGS_workload.c_str());
+  fprintf(fp, "  \"repetitions\": %d,\n  \"results\": [", FLAGS_repetitions);
+  for (size_t i = 0; i < g_results.size(); i++) {
+    const Result& r = g_results[i];
+    fprintf(fp,
+            "%s\n    {\"test\": \"%s\", \"container\": \"%s\", "
+            "\"object_size\": %d, \"iterations\": %d,\n     "
+            "\"ns_per_op\": %.3f, \"ns_mean\": %.3f, \"ns_stddev\": %.3f, "
+            "\"samples\": [",
+            i ? "," : "", r.test.c_str(), r.container.c_str(), r.object_size,
+            r.iters, r.Median(), r.Mean(), r.Stddev());
+    for (size_t j = 0; j < r.ns.size(); j++) {
+      fprintf(fp, "%s%.3f", j ? ", " : "", r.ns[j]);
+    }
+    fprintf(fp, "],\n     \"hashes\": %d, \"copies\": %d, \"memory_bytes\": %zu",
+            r.hashes, r.copies, r.memory);
+    if (FLAGS_latency) {
+      fprintf(fp,
+              ",\n     \"latency_ns\": {\"p50\": %" PRIu64 ", \"p99\": %" PRIu64
+              ", \"p99.9\": %" PRIu64 ", \"max\": %" PRIu64 "}",
+              r.latency[0], r.latency[1], r.latency[2], r.latency[3]);
+    }
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  return fclose(fp) == 0;
+}
+
+// The t that a one-sided Welch test at 95% must beat, for df degrees of
+// freedom; rounding df down errs on the side of "not significant".
+static double t_critical(double df) {
+  static const double kSmall[] = {6.314, 2.920, 2.353, 2.132, 2.015,
+                                  1.943, 1.895, 1.860, 1.833, 1.812};
+  if (df < 1) return kSmall[0];
+  if (df < 11) return kSmall[static_cast<int>(df) - 1];
+  if (df < 20) return 1.812;
+  if (df < 30) return 1.725;
+  if (df < 60) return 1.697;
+  return 1.671;
+}
+
+// A row of a file that --csv wrote.
+struct Baseline {
+  double median;
+  double mean;
+  double stddev;
+  int repetitions;
+};
+
+static std::string result_key(const std::string& test,
+                              const std::string& container, int object_size) {
+  char size[16];
+  snprintf(size, sizeof(size), "%d", object_size);
+  return test + "|" + container + "|" + size;
+}
+
+static bool read_baseline(const char* path, map<std::string, Baseline>* rows) {
+  FILE* fp = fopen(path, "r");
+  if (!fp) return false;
+  char line[1024];
+  vector<std::string> names;
+  while (fgets(line, sizeof(line), fp)) {
+    vector<std::string> fields;
+    std::string field;
+    for (const char* p = line; *p && *p != '\n'; p++) {
+      if (*p == ',') {
+        fields.push_back(field);
+        field.clear();
+      } else {
+        field += *p;
+      }
+    }
+    fields.push_back(field);
+    if (names.empty()) {  // the header
+      names = fields;
+      continue;
+    }
+    map<std::string, std::string> row;
+    for (size_t i = 0; i < names.size() && i < fields.size(); i++) {
+      row[names[i]] = fields[i];
+    }
+    Baseline b;
+    b.median = atof(row["ns_per_op"].c_str());
+    b.mean = atof(row["ns_mean"].c_str());
+    b.stddev = atof(row["ns_stddev"].c_str());
+    b.repetitions = atoi(row["repetitions"].c_str());
+    (*rows)[result_key(row["test"], row["container"],
+                       atoi(row["object_size"].c_str()))] = b;
+  }
+  fclose(fp);
+  return !names.empty();
+}
+
+// Lists the tests that got more than --regression_percent slower than
+// in the baseline, by their medians -- and, where both sides were run
+// more than once, by a Welch t-test on their means as well.  Returns
+// false if there were any, or if the baseline can't be read.
+static bool compare_with_baseline(const char* path) {
+  map<std::string, Baseline> baseline;
+  if (!read_baseline(path, &baseline)) {
+    fprintf(stderr, "can't read baseline %s\n", path);
+    return false;
+  }
+  printf("\nCompared with %s:\n", path);
+  int compared = 0, slower = 0, faster = 0;
+  for (const Result& r : g_results) {
+    const map<std::string, Baseline>::const_iterator it =
+        baseline.find(result_key(r.test, r.container, r.object_size));
+    if (it == baseline.end() || it->second.median <= 0) continue;
+    const Baseline& b = it->second;
+    compared++;
+    const double change = 100 * (r.Median() / b.median - 1);
+    if (fabs(change) <= FLAGS_regression_percent) continue;
+
+    char stats[64] = "";
+    bool significant = true;  // for all we can tell, with single runs
+    const int n = static_cast<int>(r.ns.size());
+    if (n > 1 && b.repetitions > 1) {
+      const double v1 = r.Stddev() * r.Stddev() / n;
+      const double v0 = b.stddev * b.stddev / b.repetitions;
+      if (v1 + v0 > 0) {
+        const double t = fabs(r.Mean() - b.mean) / sqrt(v1 + v0);
+        const double df = (v1 + v0) * (v1 + v0) /
+                          (v1 * v1 / (n - 1) + v0 * v0 / (b.repetitions - 1));
+        significant = t > t_critical(df);
+        snprintf(stats, sizeof(stats), "  (t = %.1f, df = %.0f)", t, df);
+      }
+    }
+    if (!significant) continue;
+    if (change > 0) {
+      slower++;
+    } else {
+      faster++;
+    }
+    printf("  %-8s %-24s %4d %-20s %8.1f -> %8.1f ns  %+6.1f%%%s\n",
+           change > 0 ? "SLOWER" : "faster", r.container.c_str(),
+           r.object_size, r.test.c_str(), b.median, r.Median(), change, stats);
+  }
+  printf("%d tests compared: %d slower and %d faster by more than %.1f%%\n",
+         compared, slower, faster, FLAGS_regression_percent);
+  return slower == 0;
+}
+
+// Writes out the results and compares them, as the flags ask.  Returns
+// false if something failed or got slower.
+static bool finish_results() {
+  bool ok = true;
+  if (!FLAGS_csv.empty() && !write_csv(FLAGS_csv.c_str())) {
+    fprintf(stderr, "can't write %s\n", FLAGS_csv.c_str());
+    ok = false;
+  }
+  if (!FLAGS_json.empty() && !write_json(FLAGS_json.c_str())) {
+    fprintf(stderr, "can't write %s\n", FLAGS_json.c_str());
+    ok = false;
+  }
+  if (!FLAGS_baseline.empty() && !compare_with_baseline(FLAGS_baseline.c_str()))
+    ok = false;
+  return ok;
 }
 
 template <class MapType>
@@ -370,9 +1325,7 @@ static void time_map_grow(int iters) {
 
   const size_t start = CurrentMemoryUsage();
   t.Reset();
-  for (int i = 0; i < iters; i++) {
-    set[i] = i + 1;
-  }
+  timed_loop(set, iters, [&](int i) { set[i] = i + 1; });
   double ut = t.UserTime();
   const size_t finish = CurrentMemoryUsage();
   report("map_grow", ut, iters, start, finish);
@@ -386,9 +1339,7 @@ static void time_map_grow_predicted(int iters) {
   const size_t start = CurrentMemoryUsage();
   set.resize(iters);
   t.Reset();
-  for (int i = 0; i < iters; i++) {
-    set[i] = i + 1;
-  }
+  timed_loop(set, iters, [&](int i) { set[i] = i + 1; });
   double ut = t.UserTime();
   const size_t finish = CurrentMemoryUsage();
   report("map_predict/grow", ut, iters, start, finish);
@@ -405,9 +1356,7 @@ static void time_map_replace(int iters) {
   }
 
   t.Reset();
-  for (i = 0; i < iters; i++) {
-    set[i] = i + 1;
-  }
+  timed_loop(set, iters, [&](int i) { set[i] = i + 1; });
   double ut = t.UserTime();
 
   report("map_replace", ut, iters, 0, 0);
@@ -427,9 +1376,9 @@ static void time_map_fetch(int iters, const vector<int>& indices,
 
   r = 1;
   t.Reset();
-  for (i = 0; i < iters; i++) {
+  timed_loop(set, iters, [&](int i) {
     r ^= static_cast<int>(set.find(indices[i]) != set.end());
-  }
+  });
   double ut = t.UserTime();
 
   srand(r);  // keep compiler from optimizing away r (we never call rand())
@@ -468,13 +1417,12 @@ static void time_map_fetch_empty(int iters) {
   MapType set;
   Rusage t;
   int r;
-  int i;
 
   r = 1;
   t.Reset();
-  for (i = 0; i < iters; i++) {
+  timed_loop(set, iters, [&](int i) {
     r ^= static_cast<int>(set.find(i) != set.end());
-  }
+  });
   double ut = t.UserTime();
 
   srand(r);  // keep compiler from optimizing away r (we never call rand())
@@ -492,9 +1440,7 @@ static void time_map_remove(int iters) {
   }
 
   t.Reset();
-  for (i = 0; i < iters; i++) {
-    set.erase(i);
-  }
+  timed_loop(set, iters, [&](int i) { set.erase(i); });
   double ut = t.UserTime();
 
   report("map_remove", ut, iters, 0, 0);
@@ -504,14 +1450,13 @@ template <class MapType>
 static void time_map_toggle(int iters) {
   MapType set;
   Rusage t;
-  int i;
 
   const size_t start = CurrentMemoryUsage();
   t.Reset();
-  for (i = 0; i < iters; i++) {
+  timed_loop(set, iters, [&](int i) {
     set[i] = i + 1;
     set.erase(i);
-  }
+  });
 
   double ut = t.UserTime();
   const size_t finish = CurrentMemoryUsage();
@@ -543,6 +1488,44 @@ static void time_map_iterate(int iters) {
   report("map_iterate", ut, iters, 0, 0);
 }
 
+// Fills a map that allocates through CountingAllocator and reports the
+// bytes it holds per entry, the bits per entry that go to something other
+// than the entries themselves, and how much more than that it held at
+// its peak, while resizing.  Then malloc's view and the kernel's: what
+// the heap and RSS grew by, and how high RSS went on the way.
+template <class MapType>
+static void map_memory(int iters) {
+  typedef typename MapType::value_type value_type;
+  size_t rss_start, peak_start, rss_end, peak_end;
+
+  ReleaseFreeMemory();  // so that RSS has to grow with the map
+  ResetPeakRss();
+  const bool have_rss = ProcessMemory(&rss_start, &peak_start);
+  const size_t start = CurrentMemoryUsage();
+  g_peak_allocated = g_allocated;
+  MapType set;
+  for (int i = 0; i < iters; i++) {
+    set[i] = i + 1;
+  }
+  const double live = g_allocated;
+  const size_t finish = CurrentMemoryUsage();
+
+  printf("%-20s %6.1f B/entry  (%6.1f overhead bits/entry, peak %.2fx)",
+         "map_memory", live / iters,
+         (live - 1.0 * iters * sizeof(value_type)) * 8 / iters,
+         g_peak_allocated / live);
+  if (finish > start) {
+    printf("  malloc %.1f B/entry", (finish - start) / (1.0 * iters));
+  }
+  if (have_rss && ProcessMemory(&rss_end, &peak_end)) {
+    printf("  RSS +%.1f MB, peak +%.1f MB",
+           (1.0 * rss_end - rss_start) / 1048576.0,
+           (1.0 * peak_end - rss_start) / 1048576.0);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
 template <class MapType>
 static void stresshashfunction(int desired_insertions, int map_size,
                                int stride) {
@@ -589,19 +1572,22 @@ static void stresshashfunction(int num_inserts) {
   }
 }
 
-template <class MapType, class StressMapType>
+template <class MapType, class StressMapType, class MemoryMapType>
 static void measure_map(const char* label, int obj_size, int iters,
                         bool stress_hash_function) {
   printf("\n%s (%d byte objects, %d iterations):\n", label, obj_size, iters);
-  if (1) time_map_grow<MapType>(iters);
-  if (1) time_map_grow_predicted<MapType>(iters);
-  if (1) time_map_replace<MapType>(iters);
-  if (1) time_map_fetch_random<MapType>(iters);
-  if (1) time_map_fetch_sequential<MapType>(iters);
-  if (1) time_map_fetch_empty<MapType>(iters);
-  if (1) time_map_remove<MapType>(iters);
-  if (1) time_map_toggle<MapType>(iters);
-  if (1) time_map_iterate<MapType>(iters);
+  g_container = label;
+  g_object_size = obj_size;
+  if (1) repeat([&] { time_map_grow<MapType>(iters); });
+  if (1) repeat([&] { time_map_grow_predicted<MapType>(iters); });
+  if (1) repeat([&] { time_map_replace<MapType>(iters); });
+  if (1) repeat([&] { time_map_fetch_random<MapType>(iters); });
+  if (1) repeat([&] { time_map_fetch_sequential<MapType>(iters); });
+  if (1) repeat([&] { time_map_fetch_empty<MapType>(iters); });
+  if (1) repeat([&] { time_map_remove<MapType>(iters); });
+  if (1) repeat([&] { time_map_toggle<MapType>(iters); });
+  if (1) repeat([&] { time_map_iterate<MapType>(iters); });
+  if (FLAGS_test_memory) map_memory<MemoryMapType>(iters);
   // This last test is useful only if the map type uses hashing.
   // And it's slow, so use fewer iterations.
   if (stress_hash_function) {
@@ -615,32 +1601,977 @@ static void measure_map(const char* label, int obj_size, int iters,
 template <class ObjType>
 static void test_all_maps(int obj_size, int iters) {
   const bool stress_hash_function = obj_size <= 8;
+  typedef CountingAllocator<std::pair<const ObjType, int>> A;
 
   if (FLAGS_test_sparse_hash_map)
     measure_map<EasyUseSparseHashMap<ObjType, int, HashFn>,
-                EasyUseSparseHashMap<ObjType*, int, HashFn>>(
+                EasyUseSparseHashMap<ObjType*, int, HashFn>,
+                EasyUseSparseHashMap<ObjType, int, HashFn, A>>(
         "SPARSE_HASH_MAP", obj_size, iters, stress_hash_function);
 
   if (FLAGS_test_dense_hash_map)
     measure_map<EasyUseDenseHashMap<ObjType, int, HashFn>,
-                EasyUseDenseHashMap<ObjType*, int, HashFn>>(
+                EasyUseDenseHashMap<ObjType*, int, HashFn>,
+                EasyUseDenseHashMap<ObjType, int, HashFn, A>>(
         "DENSE_HASH_MAP", obj_size, iters, stress_hash_function);
 
   if (FLAGS_test_hash_map)
     measure_map<EasyUseHashMap<ObjType, int, HashFn>,
-                EasyUseHashMap<ObjType*, int, HashFn>>(
+                EasyUseHashMap<ObjType*, int, HashFn>,
+                EasyUseHashMap<ObjType, int, HashFn, A>>(
         "STANDARD HASH_MAP", obj_size, iters, stress_hash_function);
 
   if (FLAGS_test_map)
-    measure_map<EasyUseMap<ObjType, int>, EasyUseMap<ObjType*, int>>(
-        "STANDARD MAP", obj_size, iters, false);
+    measure_map<EasyUseMap<ObjType, int>, EasyUseMap<ObjType*, int>,
+                EasyUseMap<ObjType, int, A>>("STANDARD MAP", obj_size, iters,
+                                             false);
+}
+
+// ----- the profile workload -----
+//
+// Builds a table of --elements keys, then times --ops operations drawn
+// from the --*_percent mix: finds, which look for a key in the table
+// --hit_ratio of the time and for one that was never there otherwise;
+// inserts of new keys; and erases of keys in the table.  Keys are made
+// from their indices by --distribution:
+//   sequential  0, 1, 2, ...; lookups go in order too
+//   uniform     indices scrambled over the key type's positive values
+//   clustered   runs of 64 consecutive values at scrambled places
+//   zipf        as uniform, but lookups favor some keys with zipf skew
+// All the random choices are made up front, so only the operations on
+// the table are timed.  With --load_factors the whole thing is run
+// once for each max_load_factor().
+
+// A bijection on [0, 2^bits), so distinct indices make distinct keys.
+static uint64_t scramble(uint64_t x, int bits) {
+  const uint64_t mask = (uint64_t(1) << bits) - 1;  // bits < 64
+  x = (x * 0x9E3779B97F4A7C15ULL) & mask;
+  x ^= x >> (bits / 2);
+  x = (x * 0xBF58476D1CE4E5B9ULL) & mask;
+  x ^= x >> (bits / 2);
+  return x;
+}
+
+// Key i as a number of at most bits bits, so it's never negative (and
+// so never one of the ReservedKeys).
+static uint64_t key_number(uint64_t i, int bits) {
+  if (FLAGS_distribution == "sequential") return i;
+  if (FLAGS_distribution == "clustered")
+    return (scramble(i >> 6, bits - 6) << 6) | (i & 63);
+  return scramble(i, bits);
+}
+
+template <typename K>
+struct KeyMaker;
+
+template <>
+struct KeyMaker<int32_t> {
+  static int32_t make(uint64_t i) {
+    return static_cast<int32_t>(key_number(i, 31));
+  }
+};
+
+template <>
+struct KeyMaker<int64_t> {
+  static int64_t make(uint64_t i) {
+    return static_cast<int64_t>(key_number(i, 63));
+  }
+};
+
+template <>
+struct KeyMaker<std::string> {
+  // The number goes at the end, after a prefix all the keys share, as
+  // with many real string keys.
+  static std::string make(uint64_t i) {
+    const uint64_t n = key_number(i, 63);
+    std::string key(FLAGS_string_size, 'k');
+    memcpy(&key[key.size() - sizeof(n)], &n, sizeof(n));
+    return key;
+  }
+};
+
+// Draws ranks in [0, n), rank k with probability proportional to
+// 1 / (k + 1)^s.
+class ZipfDistribution {
+ public:
+  ZipfDistribution(size_t n, double s) : cdf_(n) {
+    double sum = 0;
+    for (size_t k = 0; k < n; k++) {
+      sum += pow(k + 1.0, -s);
+      cdf_[k] = sum;
+    }
+  }
+
+  template <class RNG>
+  size_t operator()(RNG& rng) const {
+    std::uniform_real_distribution<double> unit(0, cdf_.back());
+    const size_t k =
+        std::lower_bound(cdf_.begin(), cdf_.end(), unit(rng)) - cdf_.begin();
+    return (std::min)(k, cdf_.size() - 1);
+  }
+
+ private:
+  vector<double> cdf_;
+};
+
+enum ProfileOpType { OP_FIND, OP_INSERT, OP_ERASE };
+
+struct ProfileOp {
+  ProfileOpType type;
+  size_t key;  // an index into ProfileWorkload::keys
+};
+
+// Keys [0, num_initial) start out in the table; inserts add num_initial,
+// num_initial + 1, ...; misses look for keys past all of those.
+template <typename K>
+struct ProfileWorkload {
+  vector<K> keys;
+  size_t num_initial;
+  vector<ProfileOp> ops;
+};
+
+template <typename K>
+static void make_profile(ProfileWorkload<K>* w) {
+  const size_t n = FLAGS_elements;
+  const size_t num_ops = FLAGS_ops > 0 ? FLAGS_ops : n;
+  const size_t miss_base = n + num_ops;
+  const bool sequential = FLAGS_distribution == "sequential";
+  const bool zipf = FLAGS_distribution == "zipf";
+  std::mt19937_64 rng(FLAGS_seed);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_real_distribution<double> unit(0, 1);
+  const ZipfDistribution ranks(zipf ? n : 1, FLAGS_zipf);
+
+  vector<size_t> live(n);  // the keys in the table, as of each op
+  for (size_t i = 0; i < n; i++) live[i] = i;
+  size_t next_insert = n, next_hit = 0, next_miss = 0;
+  w->num_initial = n;
+  w->ops.clear();
+  w->ops.reserve(num_ops);
+  for (size_t i = 0; i < num_ops; i++) {
+    const int p = percent(rng);
+    if (p >= FLAGS_find_percent && p < FLAGS_find_percent + FLAGS_insert_percent) {
+      live.push_back(next_insert);
+      w->ops.push_back(ProfileOp{OP_INSERT, next_insert++});
+    } else if (p >= FLAGS_find_percent && !live.empty()) {
+      const size_t pos = std::uniform_int_distribution<size_t>(
+          0, live.size() - 1)(rng);
+      w->ops.push_back(ProfileOp{OP_ERASE, live[pos]});
+      live[pos] = live.back();
+      live.pop_back();
+    } else if (!live.empty() && unit(rng) < FLAGS_hit_ratio) {
+      size_t pos;
+      if (sequential) {
+        pos = next_hit++ % live.size();
+      } else if (zipf) {
+        pos = ranks(rng) % live.size();
+      } else {
+        pos = std::uniform_int_distribution<size_t>(0, live.size() - 1)(rng);
+      }
+      w->ops.push_back(ProfileOp{OP_FIND, live[pos]});
+    } else {
+      const size_t miss =
+          sequential ? next_miss++ % (n + 1)
+                     : std::uniform_int_distribution<size_t>(0, n)(rng);
+      w->ops.push_back(ProfileOp{OP_FIND, miss_base + miss});
+    }
+  }
+  w->keys.clear();
+  w->keys.reserve(miss_base + n + 1);
+  for (size_t i = 0; i < miss_base + n + 1; i++) {
+    w->keys.push_back(KeyMaker<K>::make(i));
+  }
+}
+
+template <class MapType, typename K>
+static void time_map_profile(const ProfileWorkload<K>& w, float load_factor) {
+  MapType set;
+  Rusage t;
+  int r;
+
+  if (load_factor > 0) set.max_load_factor(load_factor);
+  const size_t start = CurrentMemoryUsage();
+  t.Reset();
+  timed_loop(set, w.num_initial,
+             [&](size_t i) { set[w.keys[i]] = static_cast<int>(i); });
+  double ut = t.UserTime();
+  const size_t finish = CurrentMemoryUsage();
+  report("profile_build", ut, w.num_initial, start, finish);
+
+  r = 1;
+  t.Reset();
+  timed_loop(set, w.ops.size(), [&](size_t i) {
+    const ProfileOp& op = w.ops[i];
+    switch (op.type) {
+      case OP_FIND:
+        r ^= static_cast<int>(set.find(w.keys[op.key]) != set.end());
+        break;
+      case OP_INSERT:
+        set[w.keys[op.key]] = 1;
+        break;
+      case OP_ERASE:
+        set.erase(w.keys[op.key]);
+        break;
+    }
+  });
+  ut = t.UserTime();
+
+  srand(r);  // keep compiler from optimizing away r (we never call rand())
+  report("profile_ops", ut, w.ops.size(), 0, 0);
+}
+
+template <class MapType, typename K>
+static void measure_profile(const char* label, const ProfileWorkload<K>& w,
+                            float load_factor) {
+  g_container = label;
+  if (load_factor > 0) {
+    printf("\n%s (max_load_factor %.2f):\n", label, load_factor);
+    char lf[32];
+    snprintf(lf, sizeof(lf), " lf=%.2f", load_factor);
+    g_container += lf;
+  } else {
+    printf("\n%s:\n", label);
+  }
+  g_object_size = FLAGS_key == "string" ? FLAGS_string_size
+                                        : static_cast<int>(sizeof(K));
+  repeat([&] { time_map_profile<MapType>(w, load_factor); });
+}
+
+template <typename K>
+static void profile_all_maps() {
+  ProfileWorkload<K> w;
+  make_profile(&w);
+
+  vector<float> load_factors;
+  for (const char* p = FLAGS_load_factors.c_str(); *p;) {
+    char* end;
+    const float lf = strtof(p, &end);
+    if (end == p) break;  // not a number
+    load_factors.push_back(lf);
+    p = *end == ',' ? end + 1 : end;
+  }
+  if (load_factors.empty()) load_factors.push_back(0);  // the default
+
+  typedef CountingHash<K> H;
+  for (size_t i = 0; i < load_factors.size(); i++) {
+    const float lf = load_factors[i];
+    if (FLAGS_test_sparse_hash_map)
+      measure_profile<EasyUseSparseHashMap<K, int, H>>("SPARSE_HASH_MAP", w,
+                                                       lf);
+    if (FLAGS_test_dense_hash_map)
+      measure_profile<EasyUseDenseHashMap<K, int, H>>("DENSE_HASH_MAP", w, lf);
+    if (FLAGS_test_hash_map)
+      measure_profile<EasyUseHashMap<K, int, H>>("STANDARD HASH_MAP", w, lf);
+    if (FLAGS_test_map && i == 0)  // load factors mean nothing to it
+      measure_profile<EasyUseMap<K, int>>("STANDARD MAP", w, 0);
+  }
+}
+
+// Returns false, having said why, if the flags don't describe a workload.
+static bool profile_flags_ok() {
+  if (FLAGS_elements <= 0 || FLAGS_ops < 0 || FLAGS_find_percent < 0 ||
+      FLAGS_insert_percent < 0 || FLAGS_erase_percent < 0 ||
+      FLAGS_find_percent + FLAGS_insert_percent + FLAGS_erase_percent != 100) {
+    fprintf(stderr, "need --elements > 0 and percents adding up to 100\n");
+    return false;
+  }
+  if (FLAGS_distribution != "sequential" && FLAGS_distribution != "uniform" &&
+      FLAGS_distribution != "clustered" && FLAGS_distribution != "zipf") {
+    fprintf(stderr, "unknown --distribution %s\n", FLAGS_distribution.c_str());
+    return false;
+  }
+  if (FLAGS_key != "int32" && FLAGS_key != "int64" &&
+      (FLAGS_key != "string" || FLAGS_string_size < 8)) {
+    fprintf(stderr, "--key must be int32, int64 or string (of 8+ bytes)\n");
+    return false;
+  }
+  return true;
+}
+
+// Returns false if the flags don't describe a workload.
+static bool run_profile() {
+  if (!profile_flags_ok()) return false;
+  stamp_run(FLAGS_ops > 0 ? FLAGS_ops : FLAGS_elements);
+  printf("%d %s keys, %s; %d%% find (%.0f%% hits), %d%% insert, %d%% erase\n",
+         FLAGS_elements, FLAGS_key.c_str(), FLAGS_distribution.c_str(),
+         FLAGS_find_percent, 100 * FLAGS_hit_ratio, FLAGS_insert_percent,
+         FLAGS_erase_percent);
+  if (FLAGS_key == "int32") {
+    profile_all_maps<int32_t>();
+  } else if (FLAGS_key == "int64") {
+    profile_all_maps<int64_t>();
+  } else {
+    profile_all_maps<std::string>();
+  }
+  return true;
+}
+
+// ----- the threads workload -----
+//
+// Builds one table of --elements keys, as the profile workload does, and
+// has 1, 2, 4, ... --threads threads run --ops lookups each on it at the
+// same time, to show how lookups scale with cores.  All threads run
+// through the same operations, each starting at a different place.
+//
+// With --insert_percent or --erase_percent, that share of the operations
+// add or remove keys from a small pool of their own instead.  None of our
+// maps can be read while it's written, so then every operation takes a
+// readers-writer lock around the table, which is what sharing a changing
+// map costs.
+
+// A pthread readers-writer lock.
+class ReadWriteLock {
+ public:
+  ReadWriteLock() { pthread_rwlock_init(&lock_, NULL); }
+  ~ReadWriteLock() { pthread_rwlock_destroy(&lock_); }
+
+  void ReadLock() { pthread_rwlock_rdlock(&lock_); }
+  void WriteLock() { pthread_rwlock_wrlock(&lock_); }
+  void Unlock() { pthread_rwlock_unlock(&lock_); }
+
+ private:
+  pthread_rwlock_t lock_;
+
+  ReadWriteLock(const ReadWriteLock&);
+  void operator=(const ReadWriteLock&);
+};
+
+// What one thread did, on a cache line of its own so that threads don't
+// slow each other down by writing it.
+struct alignas(64) ThreadResult {
+  double ns;
+  int found;
+};
+
+// Keys [0, num_initial) are in the table; lookups that miss look for
+// [num_initial, 2 * num_initial]; the writers' pool comes after that.
+template <typename K>
+static void make_threads_workload(ProfileWorkload<K>* w) {
+  const size_t n = FLAGS_elements;
+  const size_t num_ops = FLAGS_ops > 0 ? FLAGS_ops : n;
+  const size_t pool = n / 16 + 1;
+  const bool zipf = FLAGS_distribution == "zipf";
+  std::mt19937_64 rng(FLAGS_seed);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_real_distribution<double> unit(0, 1);
+  const ZipfDistribution ranks(zipf ? n : 1, FLAGS_zipf);
+
+  w->num_initial = n;
+  w->ops.clear();
+  w->ops.reserve(num_ops);
+  for (size_t i = 0; i < num_ops; i++) {
+    const int p = percent(rng);
+    if (p >= FLAGS_find_percent) {
+      const ProfileOpType type =
+          p < FLAGS_find_percent + FLAGS_insert_percent ? OP_INSERT : OP_ERASE;
+      const size_t key = std::uniform_int_distribution<size_t>(0, pool - 1)(rng);
+      w->ops.push_back(ProfileOp{type, 2 * n + 1 + key});
+    } else if (unit(rng) < FLAGS_hit_ratio) {
+      size_t pos;
+      if (FLAGS_distribution == "sequential") {
+        pos = i % n;
+      } else if (zipf) {
+        pos = ranks(rng);
+      } else {
+        pos = std::uniform_int_distribution<size_t>(0, n - 1)(rng);
+      }
+      w->ops.push_back(ProfileOp{OP_FIND, pos});
+    } else {
+      w->ops.push_back(
+          ProfileOp{OP_FIND, n + std::uniform_int_distribution<size_t>(0, n)(rng)});
+    }
+  }
+  w->keys.clear();
+  w->keys.reserve(2 * n + 1 + pool);
+  for (size_t i = 0; i < 2 * n + 1 + pool; i++) {
+    w->keys.push_back(KeyMaker<K>::make(i));
+  }
+}
+
+// Runs w.ops on num_threads threads at once and reports the total rate,
+// how that compares to *one_thread (set here, the first time), and how
+// evenly the threads fared.
+template <class MapType, typename K>
+static void time_map_threads(MapType& set, const ProfileWorkload<K>& w,
+                             int num_threads, double* one_thread) {
+  const bool writes = FLAGS_find_percent < 100;
+  const size_t n = w.ops.size();
+  ReadWriteLock lock;
+  vector<ThreadResult> results(num_threads);
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+
+  auto worker = [&](int id) {
+    const MapType& table = set;
+    int found = 0;
+    size_t i = id * n / num_threads;
+    ready++;
+    while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+    const steady_clock::time_point start = steady_clock::now();
+    for (size_t done = 0; done < n; done++) {
+      const ProfileOp& op = w.ops[i];
+      if (!writes) {
+        found += table.find(w.keys[op.key]) != table.end();
+      } else if (op.type == OP_FIND) {
+        lock.ReadLock();
+        found += table.find(w.keys[op.key]) != table.end();
+        lock.Unlock();
+      } else {
+        lock.WriteLock();
+        if (op.type == OP_INSERT) {
+          set[w.keys[op.key]] = 1;
+        } else {
+          set.erase(w.keys[op.key]);
+        }
+        lock.Unlock();
+      }
+      if (++i == n) i = 0;
+    }
+    results[id].ns =
+        duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    results[id].found = found;
+  };
+
+  vector<std::thread> threads;
+  for (int id = 0; id < num_threads; id++) threads.emplace_back(worker, id);
+  while (ready.load() < num_threads) std::this_thread::yield();
+  const steady_clock::time_point start = steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (std::thread& thread : threads) thread.join();
+  const double wall = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  // Rates in millions of operations a second.
+  double sum = 0, sum_squares = 0, slowest = 1e300, fastest = 0;
+  int found = 0;
+  for (const ThreadResult& result : results) {
+    const double rate = n / result.ns * 1e3;
+    sum += rate;
+    sum_squares += rate * rate;
+    slowest = std::min(slowest, rate);
+    fastest = std::max(fastest, rate);
+    found += result.found;
+  }
+  const double total = 1e3 * n * num_threads / wall;
+  const double mean = sum / num_threads;
+  const double stddev = sqrt(std::max(0.0, sum_squares / num_threads - mean * mean));
+  if (num_threads == 1) *one_thread = total;
+
+  srand(found);  // keep compiler from optimizing away found
+  printf("%3d threads %8.1f Mops/s  x%5.2f  (per thread %.1f Mops/s, "
+         "stddev %.1f%%, %.1f to %.1f)\n",
+         num_threads, total, total / *one_thread, mean, 100 * stddev / mean,
+         slowest, fastest);
+  fflush(stdout);
+}
+
+template <class MapType, typename K>
+static void measure_threads(const char* label, const ProfileWorkload<K>& w) {
+  printf("\n%s:\n", label);
+  MapType set;
+  for (size_t i = 0; i < w.num_initial; i++) {
+    set[w.keys[i]] = static_cast<int>(i);
+  }
+  double one_thread = 0;
+  for (int t = 1;; t = std::min(2 * t, FLAGS_threads)) {
+    time_map_threads(set, w, t, &one_thread);
+    if (t == FLAGS_threads) break;
+  }
+}
+
+template <typename K>
+static void threads_all_maps() {
+  ProfileWorkload<K> w;
+  make_threads_workload(&w);
+
+  // No CountingHash here: the threads would fight over g_num_hashes.
+  typedef std::hash<K> H;
+  if (FLAGS_test_sparse_hash_map)
+    measure_threads<EasyUseSparseHashMap<K, int, H>>("SPARSE_HASH_MAP", w);
+  if (FLAGS_test_dense_hash_map)
+    measure_threads<EasyUseDenseHashMap<K, int, H>>("DENSE_HASH_MAP", w);
+  if (FLAGS_test_hash_map)
+    measure_threads<EasyUseHashMap<K, int, H>>("STANDARD HASH_MAP", w);
+  if (FLAGS_test_map) measure_threads<EasyUseMap<K, int>>("STANDARD MAP", w);
+}
+
+// Returns false if the flags don't describe a workload.
+static bool run_threads() {
+  if (!profile_flags_ok()) return false;
+  if (FLAGS_threads <= 0) {
+    FLAGS_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  stamp_run(FLAGS_ops > 0 ? FLAGS_ops : FLAGS_elements);
+  printf("%d %s keys, %s; %d%% find (%.0f%% hits), %d%% insert, %d%% erase; "
+         "up to %d threads%s\n",
+         FLAGS_elements, FLAGS_key.c_str(), FLAGS_distribution.c_str(),
+         FLAGS_find_percent, 100 * FLAGS_hit_ratio, FLAGS_insert_percent,
+         FLAGS_erase_percent, FLAGS_threads,
+         FLAGS_find_percent < 100 ? ", locking" : "");
+  if (FLAGS_key == "int32") {
+    threads_all_maps<int32_t>();
+  } else if (FLAGS_key == "int64") {
+    threads_all_maps<int64_t>();
+  } else {
+    threads_all_maps<std::string>();
+  }
+  return true;
+}
+
+// ----- the serialize workload -----
+//
+// Fills a dense and a sparse table with --elements keys, and saves each
+// with serialize() and loads it back with unserialize(): to a FILE*, to
+// an fstream, and to a buffer in memory.  It does this once with int64
+// keys and values and NopointerSerializer, and once with strings of
+// --string_size and StringSerializer.  Reports how fast the serialized
+// form was written and read, and how long it was from starting to load
+// until a find() could answer.  For the sparse int64 table the same goes
+// for the deprecated write_metadata()/write_nopointer_data() and for a
+// sparse_hash_map_view of a serialize_mappable() file, which needn't load
+// anything first.  Files go to --serialize_file, and will usually still
+// be in the page cache when they're read back: this times our code and
+// the system calls, not the disk.
+
+// Writes the length of a string, then its bytes.
+struct StringSerializer {
+  typedef std::pair<const std::string, std::string> value_type;
+
+  template <typename OUTPUT>
+  bool operator()(OUTPUT* fp, const value_type& value) const {
+    return Write(fp, value.first) && Write(fp, value.second);
+  }
+  template <typename INPUT>
+  bool operator()(INPUT* fp, value_type* value) const {
+    return Read(fp, const_cast<std::string*>(&value->first)) &&
+           Read(fp, &value->second);
+  }
+
+ private:
+  template <typename OUTPUT>
+  static bool Write(OUTPUT* fp, const std::string& s) {
+    const uint32_t size = s.size();
+    return google::sparsehash_internal::write_data(fp, &size, sizeof(size)) &&
+           google::sparsehash_internal::write_data(fp, s.data(), size);
+  }
+  // The tables hand us raw memory to read into, so the string is
+  // constructed in place.
+  template <typename INPUT>
+  static bool Read(INPUT* fp, std::string* s) {
+    uint32_t size;
+    if (!google::sparsehash_internal::read_data(fp, &size, sizeof(size)))
+      return false;
+    std::string data(size, '\0');
+    if (size > 0 &&
+        !google::sparsehash_internal::read_data(fp, &data[0], size))
+      return false;
+    new (s) std::string(std::move(data));
+    return true;
+  }
+};
+
+// A stream in memory, for timing serialization without the system calls.
+class MemoryStream {
+ public:
+  MemoryStream() : pos_(0) {}
+
+  size_t Write(const void* data, size_t length) {
+    const char* p = static_cast<const char*>(data);
+    data_.insert(data_.end(), p, p + length);
+    return length;
+  }
+  size_t Read(void* data, size_t length) {
+    length = std::min(length, data_.size() - pos_);
+    memcpy(data, &data_[pos_], length);
+    pos_ += length;
+    return length;
+  }
+
+  size_t size() const { return data_.size(); }
+
+ private:
+  vector<char> data_;
+  size_t pos_;
+};
+
+static size_t file_size(const char* path) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) return 0;
+  fseek(fp, 0, SEEK_END);
+  const long size = ftell(fp);
+  fclose(fp);
+  return size > 0 ? size : 0;
+}
+
+// Files one run of saving and loading through stream, and prints the
+// medians after the last run.  Times are per entry in the results.
+static void report_serialize(const char* stream, size_t n, size_t bytes,
+                             double save_ns, double load_ns, double first_ns) {
+  const std::string name(stream);
+  Result* save = next_result((name + " save").c_str(), n);
+  Result* load = next_result((name + " load").c_str(), n);
+  Result* first = next_result((name + " first_lookup").c_str(), n);
+  save->ns.push_back(save_ns / n);
+  load->ns.push_back(load_ns / n);
+  first->ns.push_back(first_ns / n);
+  save->memory = load->memory = first->memory = bytes;
+  if (save->ns.size() < static_cast<size_t>(FLAGS_repetitions)) return;
+
+  // MB/s is bytes per microsecond, near enough.
+  const double mb = bytes / 1048576.0;
+  printf("  %-16s %8.1f MB  save %7.1f MB/s  load %7.1f MB/s  "
+         "first lookup %8.3f ms\n",
+         stream, mb, mb / (save->Median() * n / 1e9),
+         mb / (load->Median() * n / 1e9), first->Median() * n / 1e6);
+  fflush(stdout);
+}
+
+// Saves set and loads it back through each kind of stream.  Returns
+// false if a loaded table doesn't have probe, or the wrong size.
+template <class MapType, class Serializer>
+static bool time_map_serialize(MapType& set,
+                               const typename MapType::key_type& probe) {
+  const size_t n = set.size();
+  const char* path = FLAGS_serialize_file.c_str();
+  Rusage t;
+  bool ok = true;
+
+  {
+    t.Reset();
+    FILE* fp = fopen(path, "wb");
+    ok &= fp && set.serialize(Serializer(), fp);
+    ok &= fp && fclose(fp) == 0;
+    const double save = t.UserTime();
+    MapType loaded;
+    t.Reset();
+    fp = fopen(path, "rb");
+    ok &= fp && loaded.unserialize(Serializer(), fp);
+    if (fp) fclose(fp);
+    const double load = t.UserTime();
+    ok &= loaded.find(probe) != loaded.end();
+    const double first = t.UserTime();
+    ok &= loaded.size() == n;
+    report_serialize("FILE*", n, file_size(path), save, load, first);
+  }
+
+  {
+    t.Reset();
+    std::ofstream* out = new std::ofstream(path, std::ios::binary);
+    ok &= set.serialize(Serializer(), out);
+    delete out;  // flushes, and closes the file
+    const double save = t.UserTime();
+    MapType loaded;
+    t.Reset();
+    std::ifstream in(path, std::ios::binary);
+    ok &= loaded.unserialize(Serializer(), &in);
+    const double load = t.UserTime();
+    ok &= loaded.find(probe) != loaded.end();
+    const double first = t.UserTime();
+    ok &= loaded.size() == n;
+    report_serialize("fstream", n, file_size(path), save, load, first);
+  }
+
+  {
+    MemoryStream stream;
+    t.Reset();
+    ok &= set.serialize(Serializer(), &stream);
+    const double save = t.UserTime();
+    MapType loaded;
+    t.Reset();
+    ok &= loaded.unserialize(Serializer(), &stream);
+    const double load = t.UserTime();
+    ok &= loaded.find(probe) != loaded.end();
+    const double first = t.UserTime();
+    ok &= loaded.size() == n;
+    report_serialize("memory", n, stream.size(), save, load, first);
+  }
+  return ok;
+}
+
+// The sparse table's other ways to be saved, to a FILE*.
+template <class MapType, class ViewType>
+static bool time_map_serialize_sparse(MapType& set,
+                                      const typename MapType::key_type& probe) {
+  const size_t n = set.size();
+  const char* path = FLAGS_serialize_file.c_str();
+  Rusage t;
+  bool ok = true;
+
+  {
+    t.Reset();
+    FILE* fp = fopen(path, "wb");
+    ok &= fp && set.write_metadata(fp) && set.write_nopointer_data(fp);
+    ok &= fp && fclose(fp) == 0;
+    const double save = t.UserTime();
+    MapType loaded;
+    t.Reset();
+    fp = fopen(path, "rb");
+    ok &= fp && loaded.read_metadata(fp) && loaded.read_nopointer_data(fp);
+    if (fp) fclose(fp);
+    const double load = t.UserTime();
+    ok &= loaded.find(probe) != loaded.end();
+    const double first = t.UserTime();
+    ok &= loaded.size() == n;
+    report_serialize("nopointer_data", n, file_size(path), save, load, first);
+  }
+
+#ifdef SPARSEHASH_HAVE_MMAP
+  {
+    t.Reset();
+    FILE* fp = fopen(path, "wb");
+    ok &= fp && set.serialize_mappable(fp);
+    ok &= fp && fclose(fp) == 0;
+    const double save = t.UserTime();
+    ViewType view;
+    t.Reset();
+    ok &= view.open_file(path);
+    const double load = t.UserTime();
+    ok &= view.find(probe) != NULL;
+    const double first = t.UserTime();
+    ok &= view.size() == n;
+    report_serialize("mappable view", n, file_size(path), save, load, first);
+  }
+#endif
+  return ok;
+}
+
+template <class MapType, class Serializer, typename K, typename V>
+static bool measure_serialize(const char* label, const char* types,
+                              const vector<K>& keys, const vector<V>& values,
+                              MapType* set) {
+  printf("\n%s %s (%zu entries):\n", label, types, keys.size());
+  g_container = std::string(label) + " " + types;
+  g_object_size = static_cast<int>(sizeof(typename MapType::value_type));
+  for (size_t i = 0; i < keys.size(); i++) (*set)[keys[i]] = values[i];
+  bool ok = true;
+  repeat([&] { ok &= time_map_serialize<MapType, Serializer>(*set, keys[0]); });
+  return ok;
+}
+
+// Returns false if the flags don't describe a workload, or something
+// didn't load back as it was saved.
+static bool run_serialize() {
+  if (FLAGS_elements <= 0 || FLAGS_string_size < 8) {
+    fprintf(stderr, "need --elements > 0 and --string_size >= 8\n");
+    return false;
+  }
+  stamp_run(FLAGS_elements);
+  const size_t n = FLAGS_elements;
+  bool ok = true;
+
+  {
+    vector<int64_t> keys, values;
+    for (size_t i = 0; i < n; i++) {
+      keys.push_back(KeyMaker<int64_t>::make(i));
+      values.push_back(i);
+    }
+    typedef std::hash<int64_t> H;
+    typedef EasyUseDenseHashMap<int64_t, int64_t, H> Dense;
+    typedef EasyUseSparseHashMap<int64_t, int64_t, H> Sparse;
+    if (FLAGS_test_dense_hash_map) {
+      Dense set;
+      ok &= measure_serialize<Dense, Dense::NopointerSerializer>(
+          "DENSE_HASH_MAP", "int64", keys, values, &set);
+    }
+    if (FLAGS_test_sparse_hash_map) {
+      Sparse set;
+      ok &= measure_serialize<Sparse, Sparse::NopointerSerializer>(
+          "SPARSE_HASH_MAP", "int64", keys, values, &set);
+      repeat([&] {
+        ok &= time_map_serialize_sparse<
+            Sparse, google::sparse_hash_map_view<int64_t, int64_t, H>>(
+            set, keys[0]);
+      });
+    }
+  }
+
+  {
+    vector<std::string> keys, values;
+    for (size_t i = 0; i < n; i++) {
+      keys.push_back(KeyMaker<std::string>::make(i));
+      values.push_back(KeyMaker<std::string>::make(n + i));
+    }
+    typedef std::hash<std::string> H;
+    typedef EasyUseDenseHashMap<std::string, std::string, H> Dense;
+    typedef EasyUseSparseHashMap<std::string, std::string, H> Sparse;
+    if (FLAGS_test_dense_hash_map) {
+      Dense set;
+      ok &= measure_serialize<Dense, StringSerializer>("DENSE_HASH_MAP",
+                                                       "string", keys, values,
+                                                       &set);
+    }
+    if (FLAGS_test_sparse_hash_map) {
+      Sparse set;
+      ok &= measure_serialize<Sparse, StringSerializer>("SPARSE_HASH_MAP",
+                                                        "string", keys, values,
+                                                        &set);
+    }
+  }
+
+  remove(FLAGS_serialize_file.c_str());
+  if (!ok) fprintf(stderr, "a table didn't load back as it was saved\n");
+  return ok;
+}
+
+// ----- the trace workload -----
+//
+// Replays a trace of operations recorded from a real program with
+// TraceRecorder (in trace_recorder.h) against each map, with int64 keys
+// and values.  Reports the time per operation and its percentiles, and
+// the map's size and heap use after each tenth of the trace.  The whole
+// trace is read in before anything is timed.  Keys that our maps keep
+// for themselves (see ReservedKeys) can't be replayed; operations on
+// them are left out, and resizes to more entries than the trace has
+// operations are cut down to that (the map can never need more room,
+// and a hint recorded from a bigger program could exceed max_size()).
+
+template <class MapType>
+static void time_map_trace(const vector<TraceRecord>& trace, bool last) {
+  static const int kSteps = 10;
+  MapType set;
+  Rusage t;
+  int r = 1;
+  size_t sizes[kSteps], heap[kSteps];
+  steady_clock::duration sampling(0);
+
+  const size_t n = trace.size();
+  const size_t start = CurrentMemoryUsage();
+  t.Reset();
+  for (int step = 0; step < kSteps; step++) {
+    const size_t begin = n * step / kSteps;
+    timed_loop(set, n * (step + 1) / kSteps - begin, [&](size_t i) {
+      const TraceRecord& op = trace[begin + i];
+      const int64_t key = static_cast<int64_t>(op.key);
+      switch (op.op) {
+        case TRACE_INSERT:
+          set[key] = static_cast<int64_t>(op.value);
+          break;
+        case TRACE_FIND:
+          r ^= static_cast<int>(set.find(key) != set.end());
+          break;
+        case TRACE_ERASE:
+          set.erase(key);
+          break;
+        case TRACE_CLEAR:
+          set.clear();
+          break;
+        case TRACE_RESIZE:
+          set.resize(op.key);
+          break;
+      }
+    });
+    // Sampling the heap isn't free, so keep it out of the time we report.
+    const steady_clock::time_point sample = steady_clock::now();
+    sizes[step] = set.size();
+    heap[step] = CurrentMemoryUsage();
+    sampling += steady_clock::now() - sample;
+  }
+  double ut = t.UserTime() - duration_cast<nanoseconds>(sampling).count();
+  const size_t finish = CurrentMemoryUsage();
+
+  srand(r);  // keep compiler from optimizing away r (we never call rand())
+  report("trace_replay", ut, n, start, finish);
+  if (!last) return;
+  printf("  entries by tenths ");
+  for (int step = 0; step < kSteps; step++) printf(" %zu", sizes[step]);
+  printf("\n");
+  if (finish > 0) {
+    printf("  heap MB by tenths ");
+    for (int step = 0; step < kSteps; step++) {
+      printf(" %.1f", heap[step] > start ? (heap[step] - start) / 1048576.0 : 0);
+    }
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+template <class MapType>
+static void measure_trace(const char* label, const vector<TraceRecord>& trace) {
+  printf("\n%s:\n", label);
+  g_container = label;
+  g_object_size = sizeof(int64_t);
+  for (int i = 0; i < FLAGS_repetitions; i++) {
+    time_map_trace<MapType>(trace, i + 1 == FLAGS_repetitions);
+  }
+}
+
+// Returns false if there's no trace to replay.
+static bool run_trace() {
+  vector<TraceRecord> trace;
+  if (FLAGS_trace.empty() || !ReadTrace(FLAGS_trace.c_str(), &trace)) {
+    fprintf(stderr, "can't read a trace from --trace=%s\n", FLAGS_trace.c_str());
+    return false;
+  }
+  const int64_t reserved[] = {ReservedKeys<int64_t>::first(),
+                              ReservedKeys<int64_t>::second()};
+  const uint64_t max_resize = trace.size();
+  size_t kept = 0, clamped = 0, counts[TRACE_RESIZE + 1] = {0};
+  for (TraceRecord op : trace) {
+    const bool keyed = op.op != TRACE_CLEAR && op.op != TRACE_RESIZE;
+    const int64_t key = static_cast<int64_t>(op.key);
+    if (keyed && (key == reserved[0] || key == reserved[1])) continue;
+    if (op.op == TRACE_RESIZE && op.key > max_resize) {
+      op.key = max_resize;
+      clamped++;
+    }
+    counts[op.op]++;
+    trace[kept++] = op;
+  }
+  if (kept < trace.size()) {
+    printf("Left out %zu operations on reserved keys\n", trace.size() - kept);
+  }
+  if (clamped > 0) {
+    printf("Cut %zu resizes down to %zu entries\n", clamped,
+           static_cast<size_t>(max_resize));
+  }
+  trace.resize(kept);
+  if (trace.empty()) {
+    fprintf(stderr, "--trace=%s has nothing to replay\n", FLAGS_trace.c_str());
+    return false;
+  }
+
+  FLAGS_latency = true;  // percentiles are half the point
+  stamp_run(static_cast<int>(trace.size()));
+  printf("%s: %zu inserts, %zu finds, %zu erases, %zu clears, %zu resizes\n",
+         FLAGS_trace.c_str(), counts[TRACE_INSERT], counts[TRACE_FIND],
+         counts[TRACE_ERASE], counts[TRACE_CLEAR], counts[TRACE_RESIZE]);
+
+  typedef CountingHash<int64_t> H;
+  if (FLAGS_test_sparse_hash_map)
+    measure_trace<EasyUseSparseHashMap<int64_t, int64_t, H>>("SPARSE_HASH_MAP",
+                                                             trace);
+  if (FLAGS_test_dense_hash_map)
+    measure_trace<EasyUseDenseHashMap<int64_t, int64_t, H>>("DENSE_HASH_MAP",
+                                                            trace);
+  if (FLAGS_test_hash_map)
+    measure_trace<EasyUseHashMap<int64_t, int64_t, H>>("STANDARD HASH_MAP",
+                                                       trace);
+  if (FLAGS_test_map)
+    measure_trace<EasyUseMap<int64_t, int64_t>>("STANDARD MAP", trace);
+  return true;
 }
 
 int main(int argc, char** argv) {
-  int iters = kDefaultIters;
-  if (argc > 1) {  // first arg is # of iterations
-    iters = atoi(argv[1]);
+  if (!parse_flags(argc, argv)) return 1;
+  if (FLAGS_repetitions < 1) {
+    fprintf(stderr, "--repetitions must be at least 1\n");
+    return 1;
+  }
+  if (FLAGS_perf_counters) g_perf.Open();  // carry on without, if need be
+  if (FLAGS_workload == "profile") {
+    return run_profile() && finish_results() ? 0 : 1;
+  }
+  if (FLAGS_workload == "threads") return run_threads() ? 0 : 1;
+  if (FLAGS_workload == "serialize") {
+    return run_serialize() && finish_results() ? 0 : 1;
   }
+  if (FLAGS_workload == "trace") {
+    return run_trace() && finish_results() ? 0 : 1;
+  }
+  if (FLAGS_workload != "suite") {
+    fprintf(stderr, "unknown --workload %s\n", FLAGS_workload.c_str());
+    return 1;
+  }
+  const int iters = FLAGS_iters;
 
   stamp_run(iters);
 
@@ -661,5 +2592,5 @@ int main(int argc, char** argv) {
   if (FLAGS_test_256_bytes)
     test_all_maps<HashObject<256, 32>>(256, iters / 32);
 
-  return 0;
+  return finish_results() ? 0 : 1;
 }
@@ -295,6 +295,10 @@ class BaseHashtableInterface {
   void erase(typename HT::iterator f, typename HT::iterator l) {
     ht_.erase(f, l);
   }
+  template <class Predicate>
+  size_type erase_if(Predicate pred) {
+    return ht_.erase_if(pred);
+  }
 
   bool operator==(const BaseHashtableInterface& other) const {
     return ht_ == other.ht_;
@@ -311,6 +315,37 @@ class BaseHashtableInterface {
   bool unserialize(ValueSerializer serializer, INPUT* fp) {
     return ht_.unserialize(serializer, fp);
   }
+  template <typename ValueSerializer, typename INPUT>
+  using serialized_reader =
+      typename HT::template serialized_reader<ValueSerializer, INPUT>;
+  template <typename ValueSerializer, typename OUTPUT>
+  bool serialize_snapshot(ValueSerializer serializer, OUTPUT* fp) {
+    return ht_.serialize_snapshot(serializer, fp);
+  }
+  template <typename ValueSerializer, typename INPUT>
+  bool unserialize_snapshot(ValueSerializer serializer, INPUT* fp) {
+    return ht_.unserialize_snapshot(serializer, fp);
+  }
+  template <typename ValueSerializer, typename OUTPUT>
+  bool serialize_parallel(ValueSerializer serializer, OUTPUT* fp,
+                          size_type num_threads = 0) {
+    return ht_.serialize_parallel(serializer, fp, num_threads);
+  }
+  template <typename ValueSerializer, typename INPUT>
+  bool unserialize_parallel(ValueSerializer serializer, INPUT* fp,
+                            size_type num_threads = 0) {
+    return ht_.unserialize_parallel(serializer, fp, num_threads);
+  }
+  template <typename INPUT>
+  static bool validate_snapshot(INPUT* fp) {
+    return HT::validate_snapshot(fp);
+  }
+  void begin_snapshot() { ht_.begin_snapshot(); }
+  template <typename ValueSerializer, typename OUTPUT>
+  bool write_snapshot(ValueSerializer serializer, OUTPUT* fp) const {
+    return ht_.write_snapshot(serializer, fp);
+  }
+  void end_snapshot() { ht_.end_snapshot(); }
 
   template <typename OUTPUT>
   bool write_metadata(OUTPUT* fp) {
@@ -44,6 +44,7 @@
 // to call every public method on the class: not just to make sure
 // they work, but to make sure they even compile.
 
+#include <atomic>
 #include <cmath>
 #include <cstddef>  // for size_t
 #include <cstdlib>
@@ -52,9 +53,12 @@
 #include <iostream>
 #include <set>
 #include <sstream>
+#include <thread>
 #include <typeinfo>  // for class typeinfo (returned by typeid)
 #include <vector>
 #include <type_traits>
+#include <sparsehash/durable_hash_map>
+#include <sparsehash/sparse_hash_map_view>
 #include <sparsehash/sparsetable>
 #include "hashtable_test_interface.h"
 #include "fixture_unittests.h"
@@ -63,26 +67,35 @@
 using std::cout;
 using std::set;
 using std::vector;
+using google::KeepFirst;
+using google::KeepLast;
+using google::durable_hash_map;
+using google::sparse_hash_map_view;
 
 using namespace testing;
 
 class ValueSerializer {
  public:
-  bool operator()(FILE* fp, const int& value) {
-    return fwrite(&value, sizeof(value), 1, fp) == 1;
+  template <typename OUTPUT>
+  bool operator()(OUTPUT* fp, const int& value) {
+    return sparsehash_internal::write_data(fp, &value, sizeof(value));
   }
-  bool operator()(FILE* fp, int* value) {
-    return fread(value, sizeof(*value), 1, fp) == 1;
+  template <typename INPUT>
+  bool operator()(INPUT* fp, int* value) {
+    return sparsehash_internal::read_data(fp, value, sizeof(*value));
   }
-  bool operator()(FILE* fp, const string& value) {
+  template <typename OUTPUT>
+  bool operator()(OUTPUT* fp, const string& value) {
     const int size = value.size();
-    return (*this)(fp, size) && fwrite(value.c_str(), size, 1, fp) == 1;
+    return (*this)(fp, size) &&
+           sparsehash_internal::write_data(fp, value.c_str(), size);
   }
-  bool operator()(FILE* fp, string* value) {
+  template <typename INPUT>
+  bool operator()(INPUT* fp, string* value) {
     int size;
     if (!(*this)(fp, &size)) return false;
     char* buf = new char[size];
-    if (fread(buf, size, 1, fp) != 1) {
+    if (!sparsehash_internal::read_data(fp, buf, size)) {
       delete[] buf;
       return false;
     }
@@ -157,6 +170,56 @@ TEST(HashtableCommonTest, HashMunging) {
   }
 }
 
+TEST(HashtableCommonTest, BufferedIO) {
+  // Small pieces, a piece bigger than the buffer, and more small pieces.
+  const size_t kBig = sparsehash_internal::buffered_writer<FILE>::kBufferSize;
+  std::vector<char> big(kBig + 10, 'x');
+  std::stringstream ss;
+  {
+    sparsehash_internal::buffered_writer<std::ostream> out(&ss);
+    EXPECT_TRUE(sparsehash_internal::write_bigendian_number(&out, 0x1234u, 2));
+    EXPECT_EQ(0u, ss.str().size());  // still in the buffer
+    EXPECT_TRUE(sparsehash_internal::write_data(&out, big.data(), big.size()));
+    EXPECT_TRUE(sparsehash_internal::write_bigendian_number(&out, 77u, 4));
+    EXPECT_TRUE(out.flush());
+  }
+  ss << "rest";
+  EXPECT_EQ(2 + big.size() + 4 + 4, ss.str().size());
+
+  // The reader doesn't read past what it's told is its own.
+  sparsehash_internal::buffered_reader<std::istream> in(&ss, 2);
+  unsigned int n = 0;
+  EXPECT_TRUE(sparsehash_internal::read_bigendian_number(&in, &n, 2));
+  EXPECT_EQ(0x1234u, n);
+  std::vector<char> big_in(big.size());
+  EXPECT_TRUE(sparsehash_internal::read_data(&in, big_in.data(), big_in.size()));
+  EXPECT_TRUE(big == big_in);
+  in.add_readahead(4);
+  EXPECT_TRUE(sparsehash_internal::read_bigendian_number(&in, &n, 4));
+  EXPECT_EQ(77u, n);
+  string rest;
+  ss >> rest;
+  EXPECT_EQ("rest", rest);
+  EXPECT_FALSE(sparsehash_internal::read_data(&in, &n, 1));  // at eof
+}
+
+TEST(HashtableCommonTest, Crc32c) {
+  // The check value from the CRC catalogue, then the same in pieces.
+  const char kCheck[] = "123456789";
+  EXPECT_EQ(0xE3069283u, sparsehash_internal::crc32c(0, kCheck, 9));
+  EXPECT_EQ(0xE3069283u, sparsehash_internal::crc32c(
+                             sparsehash_internal::crc32c(0, kCheck, 4),
+                             kCheck + 4, 5));
+  // Long enough to take the 8-bytes-at-a-time path, if there is one.
+  std::vector<unsigned char> bytes(1000);
+  for (size_t i = 0; i < bytes.size(); ++i) bytes[i] = i * 7;
+  uint32_t bytewise = 0;
+  for (size_t i = 0; i < bytes.size(); ++i)
+    bytewise = sparsehash_internal::crc32c(bytewise, &bytes[i], 1);
+  EXPECT_EQ(bytewise,
+            sparsehash_internal::crc32c(0, bytes.data(), bytes.size()));
+}
+
 // ------------------------------------------------------------------------
 // If the first arg to TYPED_TEST is HashtableIntTest, it will run
 // this test on all the hashtable types, with key=int and value=int.
@@ -911,6 +974,246 @@ TEST(HashtableTest, InsertValueToMap) {
   EXPECT_EQ(4, dhm[2]);
 }
 
+template <class MapType>
+void TestBuildFrom(MapType* first_wins, MapType* last_wins) {
+  // Lots of repeated keys, and a mix of clustered and scattered ones so
+  // some values have to spill out of their thread's region.
+  vector<pair<int, int>> input;
+  for (int i = 0; i < 20000; ++i) {
+    const int key = (i % 2 ? i % 3000 : (i % 5000) * 7919) + 1;
+    input.push_back(pair<int, int>(key, i));
+  }
+  MapType expected_first = *first_wins, expected_last = *last_wins;
+  for (size_t i = 0; i < input.size(); ++i) {
+    expected_first.insert(input[i]);
+    expected_last[input[i].first] = input[i].second;
+  }
+
+  first_wins->build_from(input.begin(), input.end(), 4);
+  last_wins->build_from(input.begin(), input.end(), 4, KeepLast);
+  const size_t num_unique = expected_first.size();
+  EXPECT_EQ(num_unique, first_wins->size());
+  EXPECT_TRUE(expected_first == *first_wins);
+  EXPECT_TRUE(expected_last == *last_wins);
+
+  // Adding to a table that already has elements keeps the old values.
+  vector<pair<int, int>> more;
+  for (int i = 0; i < 5000; ++i) more.push_back(pair<int, int>(i + 1, -i));
+  first_wins->build_from(more.begin(), more.end(), 3);
+  expected_first.insert(more.begin(), more.end());
+  EXPECT_TRUE(expected_first == *first_wins);
+
+  // A non-random-access range, and a single thread, both work too.
+  std::set<pair<int, int>> ordered(more.begin(), more.end());
+  last_wins->build_from(ordered.begin(), ordered.end(), 4, KeepLast);
+  for (size_t i = 0; i < more.size(); ++i)
+    expected_last[more[i].first] = more[i].second;
+  EXPECT_TRUE(expected_last == *last_wins);
+  MapType serial = expected_first;
+  serial.clear();
+  serial.build_from(input.begin(), input.end(), 1, KeepLast);
+  EXPECT_EQ(num_unique, serial.size());
+  MapType all_threads = expected_first;  // 0: one per hardware thread
+  all_threads.clear();
+  all_threads.build_from(input.begin(), input.end(), 0, KeepLast);
+  EXPECT_TRUE(serial == all_threads);
+}
+
+TEST(HashtableTest, BuildFrom) {
+  sparse_hash_map<int, int> shm1, shm2;
+  shm1.set_deleted_key(-1);
+  shm1[-5] = 1;
+  shm1.erase(-5);  // a deleted bucket in the way shouldn't matter
+  TestBuildFrom(&shm1, &shm2);
+
+  dense_hash_map<int, int> dhm1, dhm2;
+  dhm1.set_empty_key(0);
+  dhm2.set_empty_key(0);
+  dhm1.set_deleted_key(-1);
+  dhm1[-5] = 1;
+  dhm1.erase(-5);
+  TestBuildFrom(&dhm1, &dhm2);
+}
+
+// Copying a Poison of -1 throws, once g_poison_armed is set.
+bool g_poison_armed = false;
+struct Poison {
+  Poison() : value(0) {}
+  explicit Poison(int v) : value(v) {}
+  Poison(const Poison& other) : value(other.value) {
+    if (g_poison_armed && value == -1) throw std::runtime_error("poison");
+  }
+  Poison& operator=(const Poison& other) = default;
+  int value;
+};
+
+// When one thread throws, the table still counts what the others placed.
+template <class MapType>
+void TestBuildFromThrows(MapType* ht) {
+  vector<typename MapType::value_type> input;  // nothing to convert
+  for (int i = 1; i <= 20000; ++i)
+    input.push_back(pair<const int, Poison>(i, Poison(i == 12345 ? -1 : i)));
+  g_poison_armed = true;
+  EXPECT_THROW(ht->build_from(input.begin(), input.end(), 4),
+               std::runtime_error);
+  g_poison_armed = false;
+  size_t walked = 0;
+  for (typename MapType::iterator it = ht->begin(); it != ht->end(); ++it)
+    ++walked;
+  EXPECT_GT(walked, 0u);
+  EXPECT_EQ(walked, ht->size());
+  ht->clear();
+  EXPECT_TRUE(ht->begin() == ht->end());
+}
+
+TEST(HashtableTest, BuildFromThrows) {
+  sparse_hash_map<int, Poison> shm;
+  TestBuildFromThrows(&shm);
+  dense_hash_map<int, Poison> dhm;
+  dhm.set_empty_key(0);
+  TestBuildFromThrows(&dhm);
+}
+
+// dense tables split by bucket, sparse ones by sparsegroup.
+template <class K, class T>
+size_t RangeLimit(dense_hash_map<K, T>* ht) {
+  return ht->bucket_count();
+}
+template <class K, class T>
+size_t RangeLimit(sparse_hash_map<K, T>* ht) {
+  return ht->group_count();
+}
+template <class K, class T>
+pair<typename dense_hash_map<K, T>::iterator,
+     typename dense_hash_map<K, T>::iterator>
+ElementRange(dense_hash_map<K, T>* ht, size_t first, size_t last) {
+  return ht->bucket_range(first, last);
+}
+template <class K, class T>
+pair<typename sparse_hash_map<K, T>::iterator,
+     typename sparse_hash_map<K, T>::iterator>
+ElementRange(sparse_hash_map<K, T>* ht, size_t first, size_t last) {
+  return ht->group_range(first, last);
+}
+
+template <class MapType, class SetType>
+void TestParallelIteration(MapType* map, SetType* set) {
+  long long expected_sum = 0;
+  for (int i = 1; i <= 5000; ++i) {
+    (*map)[i * 3] = i;
+    set->insert(i * 3);
+    expected_sum += i * 3;
+  }
+  map->erase(3);  // skipping deleted entries is the ranges' job
+  set->erase(3);
+  expected_sum -= 3;
+
+  // The ranges partition the elements.
+  std::set<int> seen;
+  const size_t num_ranges = 7, range_end = RangeLimit(map);
+  for (size_t r = 0; r < num_ranges; ++r) {
+    auto range = ElementRange(map, range_end * r / num_ranges,
+                              range_end * (r + 1) / num_ranges);
+    for (; range.first != range.second; ++range.first)
+      EXPECT_TRUE(seen.insert(range.first->first).second);
+  }
+  EXPECT_EQ(map->size(), seen.size());
+
+  map->for_each_parallel(
+      [](typename MapType::value_type& v) { v.second = v.first * 2; }, 4);
+  const MapType& const_map = *map;
+  std::atomic<long long> sum(0);
+  const_map.for_each_parallel(
+      [&sum](const typename MapType::value_type& v) { sum += v.second; });
+  EXPECT_EQ(2 * expected_sum, sum.load());
+
+  // init is used once, so it needn't be the identity.
+  EXPECT_EQ(expected_sum + 7,
+            set->reduce_parallel(
+                7LL, [](int k) { return static_cast<long long>(k); },
+                [](long long a, long long b) { return a + b; }, 3));
+  EXPECT_EQ(15000, const_map.reduce_parallel(
+                       0, [](const typename MapType::value_type& v) {
+                         return v.first;
+                       }, [](int a, int b) { return a > b ? a : b; }));
+  MapType empty_map = *map;
+  empty_map.clear();
+  EXPECT_EQ(-1, empty_map.reduce_parallel(
+                    -1, [](const typename MapType::value_type&) { return 1; },
+                    [](int a, int b) { return a + b; }));
+}
+
+TEST(HashtableTest, ParallelIteration) {
+  dense_hash_map<int, int> dhm;
+  dense_hash_set<int> dhs;
+  dhm.set_empty_key(0);
+  dhm.set_deleted_key(-1);
+  dhs.set_empty_key(0);
+  dhs.set_deleted_key(-1);
+  TestParallelIteration(&dhm, &dhs);
+
+  sparse_hash_map<int, int> shm;
+  sparse_hash_set<int> shs;
+  shm.set_deleted_key(-1);
+  shs.set_deleted_key(-1);
+  TestParallelIteration(&shm, &shs);
+}
+
+TEST(HashtableTest, DenseOccupancyScan) {
+  dense_hash_map<int, int> dhm;
+  dhm.set_empty_key(0);
+  dhm.set_deleted_key(-1);
+  dhm.resize(5000);  // lots of empty buckets, spanning many 64-bit words
+  for (int i = 1; i <= 1000; ++i) dhm[i * 7] = i;
+  for (int i = 3; i <= 1000; i += 3) dhm.erase(i * 7);
+  dhm[7 * 3] = 3;  // back into a deleted bucket
+
+  std::set<int> walked;
+  for (dense_hash_map<int, int>::const_iterator it = dhm.begin();
+       it != dhm.end(); ++it) {
+    EXPECT_TRUE(walked.insert(it->first).second);
+  }
+  EXPECT_EQ(dhm.size(), walked.size());
+
+  // for_each() sees the same elements, in the same order.
+  std::vector<int> visited;
+  dhm.for_each([&visited](std::pair<const int, int>& v) {
+    visited.push_back(v.first);
+    v.second = -v.first;
+  });
+  std::vector<int> iterated;
+  for (const auto& v : dhm) iterated.push_back(v.first);
+  EXPECT_EQ(iterated, visited);
+  const dense_hash_map<int, int>& const_dhm = dhm;
+  long long sum = 0;
+  const_dhm.for_each(
+      [&sum](const std::pair<const int, int>& v) { sum += v.first + v.second; });
+  EXPECT_EQ(0, sum);
+
+  // Ranges that start and end mid-word.
+  size_t num_in_ranges = 0;
+  for (size_t first = 0; first < dhm.bucket_count(); first += 37) {
+    auto r = dhm.bucket_range(
+        first, std::min<size_t>(first + 37, dhm.bucket_count()));
+    for (; r.first != r.second; ++r.first) ++num_in_ranges;
+  }
+  EXPECT_EQ(dhm.size(), num_in_ranges);
+
+  dhm.clear_no_resize();
+  EXPECT_TRUE(dhm.begin() == dhm.end());
+  dhm.for_each([](std::pair<const int, int>&) { ADD_FAILURE(); });
+  dhm[5] = 5;
+  EXPECT_EQ(5, dhm.begin()->first);
+  EXPECT_TRUE(++dhm.begin() == dhm.end());
+
+  dense_hash_set<int> dhs;
+  dhs.set_empty_key(0);
+  for (int i = 1; i <= 100; ++i) dhs.insert(i);
+  int count = 0;
+  dhs.for_each([&count](int) { ++count; });
+  EXPECT_EQ(100, count);
+}
+
 TYPED_TEST(HashtableStringTest, EmptyKey) {
   // Only run the string tests, to make it easier to know what the
   // empty key should be.
@@ -957,6 +1260,157 @@ TYPED_TEST(HashtableAllTest, Erase) {
   EXPECT_EQ(0u, this->ht_.size());
 }
 
+TYPED_TEST(HashtableAllTest, EraseIf) {
+  // No deleted key: erase_if() doesn't need one.
+  for (int i = 10; i < 2000; i++) this->ht_.insert(this->UniqueObject(i));
+  std::set<typename TypeParam::key_type> doomed;
+  for (int i = 10; i < 2000; i += 3) doomed.insert(this->UniqueKey(i));
+  int num_calls = 0;
+  auto pred = [&](const typename TypeParam::value_type& v) {
+    ++num_calls;
+    return doomed.count(this->ht_.get_key(v)) > 0;
+  };
+  const int pre_copies = this->ht_.num_table_copies();
+  EXPECT_EQ(doomed.size(), this->ht_.erase_if(pred));
+  EXPECT_EQ(1990, num_calls);  // once per element
+  EXPECT_EQ(1990 - doomed.size(), this->ht_.size());
+  if (this->ht_.supports_num_table_copies()) {  // rebuilt exactly once
+    EXPECT_EQ(pre_copies + 1, this->ht_.num_table_copies());
+  }
+  for (int i = 10; i < 2000; i++) {
+    EXPECT_EQ(doomed.count(this->UniqueKey(i)) ? 0u : 1u,
+              this->ht_.count(this->UniqueKey(i)));
+  }
+
+  // Nothing matches: no copy.
+  EXPECT_EQ(0u, this->ht_.erase_if(pred));
+  if (this->ht_.supports_num_table_copies()) {
+    EXPECT_EQ(pre_copies + 1, this->ht_.num_table_copies());
+  }
+
+  // Deleted entries are skipped, and purged with the rest.
+  this->ht_.set_deleted_key(this->UniqueKey(1));
+  this->ht_.erase(this->UniqueKey(11));
+  const typename TypeParam::size_type num_left = this->ht_.size();
+  EXPECT_EQ(num_left,
+            this->ht_.erase_if(
+                [&](const typename TypeParam::value_type&) { return true; }));
+  EXPECT_TRUE(this->ht_.empty());
+  EXPECT_GT(1990u, this->ht_.bucket_count());  // shrunk along the way
+  this->ht_.insert(this->UniqueObject(11));
+  EXPECT_EQ(1u, this->ht_.count(this->UniqueKey(11)));
+}
+
+TEST(HashtableTest, DenseBitmapUsesAllocator) {
+  int alloc_count = 0;
+  typedef dense_hash_map<int, int, Hasher, Hasher, Alloc<int>> Map;
+  Map ht(0, Hasher(0), Hasher(0), Alloc<int>(1, &alloc_count));
+  ht.set_empty_key(-1);
+  EXPECT_EQ(2, alloc_count);  // the buckets, and their occupancy bitmap
+}
+
+TEST(HashtableTest, SparseErasedBitmapUsesAllocator) {
+  int alloc_count = 0;
+  typedef sparse_hash_map<int, int, Hasher, Hasher, Alloc<int>> Map;
+  Map ht(0, Hasher(0), Hasher(0), Alloc<int>(1, &alloc_count));
+  ht.set_physical_erase(true);
+  ht[1] = 1;
+  ht[2] = 2;
+  const int count_before = alloc_count;
+  ht.erase(1);
+  EXPECT_EQ(count_before + 2, alloc_count);  // the group, and the bitmap
+}
+
+TEST(HashtableTest, SparseDirtyBitmapUsesAllocator) {
+  int alloc_count = 0;
+  typedef sparse_hash_map<int, int, Hasher, Hasher, Alloc<int>> Map;
+  Map ht(0, Hasher(0), Hasher(0), Alloc<int>(1, &alloc_count));
+  const int count_before = alloc_count;
+  ht.set_delta_tracking(true);
+  EXPECT_EQ(count_before + 1, alloc_count);
+}
+
+TEST(HashtableTest, SparsePhysicalErase) {
+  int alloc_count = 0;
+  typedef sparse_hash_map<int, int, Hasher, Hasher, Alloc<int>> Map;
+  Map ht(0, Hasher(0), Hasher(0), Alloc<int>(1, &alloc_count));
+  ht.set_physical_erase(true);  // and no deleted key
+  EXPECT_TRUE(ht.physical_erase());
+  for (int i = 0; i < 2000; i++) ht[i] = i + 1;
+  const Map::size_type num_buckets = ht.bucket_count();
+
+  // Every erase gives memory back to the allocator.
+  for (int i = 0; i < 2000; i += 2) {
+    const int count_before = alloc_count;
+    EXPECT_EQ(1u, ht.erase(i));
+    EXPECT_LT(count_before, alloc_count);
+  }
+  EXPECT_EQ(0u, ht.erase(0));
+  EXPECT_EQ(1000u, ht.size());
+  EXPECT_EQ(num_buckets, ht.bucket_count());
+  for (int i = 0; i < 2000; i++) {
+    EXPECT_EQ(i % 2 ? 1u : 0u, ht.count(i));
+    if (i % 2) {
+      EXPECT_EQ(i + 1, ht.find(i)->second);
+    }
+  }
+  int num_seen = 0;
+  for (Map::const_iterator it = ht.begin(); it != ht.end(); ++it) {
+    EXPECT_EQ(1, it->first % 2);
+    ++num_seen;
+  }
+  EXPECT_EQ(1000, num_seen);
+
+  // Inserts reuse erased buckets without losing anything behind them.
+  for (int i = 0; i < 2000; i += 4) ht[i] = -i;
+  EXPECT_EQ(1500u, ht.size());
+  for (int i = 0; i < 2000; i++) {
+    EXPECT_EQ(i % 4 == 2 ? 0u : 1u, ht.count(i));
+  }
+  Map::iterator it = ht.find(3);
+  ht.erase(it);
+  EXPECT_EQ(0u, ht.count(3));
+  EXPECT_EQ(1499u, ht.size());
+
+  // Copies, swaps and serialization only ever see the live elements.
+  Map copy(ht);
+  EXPECT_TRUE(copy.physical_erase());
+  EXPECT_EQ(ht, copy);
+  auto fp = tmpfile();
+  EXPECT_TRUE(fp != NULL);
+  EXPECT_TRUE(ht.serialize(Map::NopointerSerializer(), fp));
+  rewind(fp);
+  Map loaded;
+  EXPECT_TRUE(loaded.unserialize(Map::NopointerSerializer(), fp));
+  fclose(fp);
+  EXPECT_EQ(ht, loaded);
+  Map other;
+  other.swap(ht);
+  EXPECT_TRUE(other.physical_erase());
+  EXPECT_FALSE(ht.physical_erase());
+  EXPECT_EQ(1499u, other.size());
+
+  other.erase(other.begin(), other.end());
+  EXPECT_TRUE(other.empty());
+  other[7] = 7;
+  EXPECT_EQ(1u, other.size());
+
+  // Switching modes purges what the old mode left behind.
+  sparse_hash_set<string> strings;
+  strings.set_deleted_key("deleted");
+  for (int i = 0; i < 100; i++) strings.insert(std::to_string(i));
+  EXPECT_EQ(1u, strings.erase("50"));
+  strings.set_physical_erase(true);
+  EXPECT_EQ(99u, strings.size());
+  EXPECT_EQ(1u, strings.erase("51"));
+  EXPECT_EQ(0u, strings.count("51"));
+  strings.set_physical_erase(false);
+  EXPECT_EQ(98u, strings.size());
+  EXPECT_EQ(1u, strings.erase("52"));
+  EXPECT_EQ(97u, strings.size());
+  EXPECT_EQ(1u, strings.count("53"));
+}
+
 TYPED_TEST(HashtableAllTest, EraseDoesNotResize) {
   this->ht_.set_deleted_key(this->UniqueKey(1));
   for (int i = 10; i < 2000; i++) {
@@ -1243,6 +1697,592 @@ TYPED_TEST(HashtableIntTest, SerializingToStringStream) {
   EXPECT_FALSE(ht_in.count(this->UniqueKey(56)));
 }
 
+// Big enough to go through the I/O buffers more than once, and followed
+// by a second table in the same stream, which the first mustn't eat into.
+TYPED_TEST(HashtableIntTest, SerializingBackToBack) {
+  if (!this->ht_.supports_serialization()) return;
+  TypeParam big, small;
+  for (int i = 1; i <= 300000; i++) big.insert(this->UniqueObject(i));
+  for (int i = 1; i <= 10; i++) small.insert(this->UniqueObject(-i));
+
+  std::stringstream string_buffer;
+  EXPECT_TRUE(big.serialize(typename TypeParam::NopointerSerializer(),
+                            &string_buffer));
+  EXPECT_TRUE(small.serialize(typename TypeParam::NopointerSerializer(),
+                              &string_buffer));
+
+  TypeParam big_in, small_in;
+  EXPECT_TRUE(big_in.unserialize(typename TypeParam::NopointerSerializer(),
+                                 &string_buffer));
+  EXPECT_TRUE(small_in.unserialize(typename TypeParam::NopointerSerializer(),
+                                   &string_buffer));
+  EXPECT_EQ(big.size(), big_in.size());
+  EXPECT_EQ(this->UniqueObject(300000), *big_in.find(this->UniqueKey(300000)));
+  EXPECT_EQ(10u, small_in.size());
+  EXPECT_EQ(this->UniqueObject(-7), *small_in.find(this->UniqueKey(-7)));
+}
+
+// The pod path reads through its own buffer; it mustn't read past the
+// table it is streaming.
+TYPED_TEST(HashtableIntTest, SerializedReaderBackToBack) {
+  if (!this->ht_.supports_serialization()) return;
+  TypeParam big, small;
+  for (int i = 1; i <= 300000; i++) big.insert(this->UniqueObject(i));
+  for (int i = 1; i <= 10; i++) small.insert(this->UniqueObject(-i));
+
+  std::stringstream string_buffer;
+  EXPECT_TRUE(big.serialize(typename TypeParam::NopointerSerializer(),
+                            &string_buffer));
+  EXPECT_TRUE(small.serialize(typename TypeParam::NopointerSerializer(),
+                              &string_buffer));
+
+  typename TypeParam::template serialized_reader<
+      typename TypeParam::NopointerSerializer, std::stringstream>
+      reader(typename TypeParam::NopointerSerializer(), &string_buffer);
+  size_t num_read = 0;
+  while (const typename TypeParam::value_type* v = reader.next()) {
+    EXPECT_TRUE(big.count(this->ht_.get_key(*v)));
+    ++num_read;
+  }
+  EXPECT_TRUE(reader.ok());
+  EXPECT_EQ(big.size(), num_read);
+
+  TypeParam small_in;
+  EXPECT_TRUE(small_in.unserialize(typename TypeParam::NopointerSerializer(),
+                                   &string_buffer));
+  EXPECT_EQ(10u, small_in.size());
+  EXPECT_EQ(this->UniqueObject(-7), *small_in.find(this->UniqueKey(-7)));
+}
+
+TYPED_TEST(HashtableIntTest, SerializingSnapshots) {
+  if (!this->ht_.supports_serialization()) return;
+  TypeParam ht_out;
+  ht_out.set_deleted_key(this->UniqueKey(200000));
+  for (int i = 1; i <= 100000; i++) ht_out.insert(this->UniqueObject(i));
+  ht_out.erase(this->UniqueKey(50));
+
+  std::stringstream snapshot;
+  EXPECT_TRUE(ht_out.serialize_snapshot(
+      typename TypeParam::NopointerSerializer(), &snapshot));
+  const string bytes = snapshot.str();
+  EXPECT_TRUE(TypeParam::validate_snapshot(&snapshot));
+
+  std::stringstream in(bytes);
+  TypeParam ht_in;
+  EXPECT_TRUE(ht_in.unserialize_snapshot(
+      typename TypeParam::NopointerSerializer(), &in));
+  EXPECT_EQ(ht_out.size(), ht_in.size());
+  EXPECT_EQ(this->UniqueObject(1000), *ht_in.find(this->UniqueKey(1000)));
+  EXPECT_TRUE(ht_in.find(this->UniqueKey(50)) == ht_in.end());
+
+  // The older format can still be read, but isn't a valid snapshot.
+  std::stringstream legacy;
+  EXPECT_TRUE(ht_out.serialize(typename TypeParam::NopointerSerializer(),
+                               &legacy));
+  std::stringstream legacy_copy(legacy.str());
+  EXPECT_FALSE(TypeParam::validate_snapshot(&legacy_copy));
+  TypeParam ht_legacy;
+  EXPECT_TRUE(ht_legacy.unserialize_snapshot(
+      typename TypeParam::NopointerSerializer(), &legacy));
+  EXPECT_EQ(ht_out.size(), ht_legacy.size());
+
+  // A flipped bit anywhere -- header or data -- is caught.
+  for (size_t pos : {size_t(20), bytes.size() / 2, bytes.size() - 12}) {
+    string corrupt = bytes;
+    corrupt[pos] ^= 0x10;
+    std::stringstream corrupt_in(corrupt);
+    EXPECT_FALSE(TypeParam::validate_snapshot(&corrupt_in));
+    corrupt_in.clear();
+    corrupt_in.seekg(0);
+    TypeParam ht_corrupt;
+    EXPECT_FALSE(ht_corrupt.unserialize_snapshot(
+        typename TypeParam::NopointerSerializer(), &corrupt_in));
+  }
+
+  // So is a snapshot that stops short, even at a chunk boundary.
+  for (size_t length : {bytes.size() / 2, bytes.size() - 8}) {
+    std::stringstream truncated(bytes.substr(0, length));
+    EXPECT_FALSE(TypeParam::validate_snapshot(&truncated));
+    truncated.clear();
+    truncated.seekg(0);
+    TypeParam ht_truncated;
+    EXPECT_FALSE(ht_truncated.unserialize_snapshot(
+        typename TypeParam::NopointerSerializer(), &truncated));
+  }
+}
+TEST(HashtableTest, SnapshotTypeMismatch) {
+  // A snapshot is only read back into a table with the same layout.
+  dense_hash_map<int, int> ints;
+  ints.set_empty_key(0);
+  ints[1] = 2;
+  std::stringstream snapshot;
+  EXPECT_TRUE(ints.serialize_snapshot(
+      dense_hash_map<int, int>::NopointerSerializer(), &snapshot));
+  const string bytes = snapshot.str();
+
+  typedef dense_hash_map<int, int64_t> WiderMap;
+  std::stringstream in(bytes);
+  WiderMap wider;
+  wider.set_empty_key(0);
+  EXPECT_FALSE(WiderMap::validate_snapshot(&in));
+  in.clear();
+  in.seekg(0);
+  EXPECT_FALSE(wider.unserialize_snapshot(WiderMap::NopointerSerializer(),
+                                          &in));
+
+  std::stringstream sparse_in(bytes);
+  sparse_hash_map<int, int> sparse;
+  EXPECT_FALSE(sparse.unserialize_snapshot(
+      sparse_hash_map<int, int>::NopointerSerializer(), &sparse_in));
+
+  std::stringstream same_in(bytes);
+  dense_hash_map<int, int> same;
+  same.set_empty_key(0);
+  EXPECT_TRUE(same.unserialize_snapshot(
+      dense_hash_map<int, int>::NopointerSerializer(), &same_in));
+  EXPECT_EQ(2, same[1]);
+}
+
+
+TYPED_TEST(HashtableAllTest, SerializingParallel) {
+  if (!this->ht_.supports_serialization()) return;
+  TypeParam ht_out;
+  ht_out.set_deleted_key(this->UniqueKey(200000));
+  for (int i = 1; i <= 100000; i++) ht_out.insert(this->UniqueObject(i));
+  ht_out.erase(this->UniqueKey(56));
+
+  std::stringstream snapshot;
+  EXPECT_TRUE(ht_out.serialize_parallel(ValueSerializer(), &snapshot, 4));
+  const string bytes = snapshot.str();
+  EXPECT_TRUE(TypeParam::validate_snapshot(&snapshot));
+
+  // Read back on several threads, and on one.
+  for (int num_threads : {3, 1}) {
+    std::stringstream in(bytes);
+    TypeParam ht_in;
+    EXPECT_TRUE(ht_in.unserialize_parallel(ValueSerializer(), &in,
+                                           num_threads));
+    EXPECT_EQ(ht_out.size(), ht_in.size());
+    EXPECT_EQ(this->UniqueObject(99999), *ht_in.find(this->UniqueKey(99999)));
+    EXPECT_FALSE(ht_in.count(this->UniqueKey(56)));
+  }
+  std::stringstream in(bytes);
+  TypeParam ht_in;
+  EXPECT_TRUE(ht_in.unserialize_snapshot(ValueSerializer(), &in));
+  EXPECT_EQ(ht_out.size(), ht_in.size());
+
+  // The other formats can be read in parallel too.
+  std::stringstream legacy;
+  EXPECT_TRUE(ht_out.serialize(ValueSerializer(), &legacy));
+  TypeParam ht_legacy;
+  EXPECT_TRUE(ht_legacy.unserialize_parallel(ValueSerializer(), &legacy));
+  EXPECT_EQ(ht_out.size(), ht_legacy.size());
+}
+
+TYPED_TEST(HashtableAllTest, SerializedReader) {
+  if (!this->ht_.supports_serialization()) return;
+  TypeParam ht_out;
+  ht_out.set_deleted_key(this->UniqueKey(500000));
+  for (int i = 1; i <= 3000; i++) ht_out.insert(this->UniqueObject(i));
+  ht_out.erase(this->UniqueKey(10));
+  std::stringstream data;
+  EXPECT_TRUE(ht_out.serialize(ValueSerializer(), &data));
+  const string bytes = data.str();
+
+  typedef typename TypeParam::template serialized_reader<ValueSerializer,
+                                                         std::stringstream>
+      Reader;
+  Reader reader(ValueSerializer(), &data);
+  EXPECT_TRUE(reader.ok());
+  size_t num_read = 0;
+  while (const typename TypeParam::value_type* v = reader.next()) {
+    typename TypeParam::const_iterator it =
+        ht_out.find(this->ht_.get_key(*v));
+    ASSERT_TRUE(it != ht_out.end());
+    EXPECT_EQ(*it, *v);
+    ++num_read;
+  }
+  EXPECT_TRUE(reader.ok());
+  EXPECT_EQ(ht_out.size(), num_read);
+  EXPECT_TRUE(reader.next() == NULL);
+
+  // A file cut short stops the reader, and says so.
+  std::stringstream truncated(bytes.substr(0, bytes.size() / 2));
+  Reader short_reader(ValueSerializer(), &truncated);
+  num_read = 0;
+  while (short_reader.next()) ++num_read;
+  EXPECT_FALSE(short_reader.ok());
+  EXPECT_LT(num_read, ht_out.size());
+}
+
+TYPED_TEST(HashtableAllTest, BackgroundSnapshot) {
+  if (!this->ht_.supports_serialization()) return;
+  TypeParam ht;
+  ht.set_deleted_key(this->UniqueKey(500000));
+  for (int i = 1; i <= 100000; i++) ht.insert(this->UniqueObject(i));
+
+  // Once on this thread, with the changes all made before the snapshot
+  // is written, then on another, with the two racing.
+  for (bool threaded : {false, true}) {
+    TypeParam copy(ht);
+    std::stringstream snapshot;
+    bool ok = false;
+    copy.begin_snapshot();
+    std::thread writer;
+    if (threaded) writer = std::thread([&] {
+      ok = copy.write_snapshot(ValueSerializer(), &snapshot);
+    });
+    for (int i = 2; i <= 100000; i += 2) copy.erase(this->UniqueKey(i));
+    for (int i = 100001; i <= 150000; i++) copy.insert(this->UniqueObject(i));
+    if (threaded)
+      writer.join();
+    else
+      ok = copy.write_snapshot(ValueSerializer(), &snapshot);
+    copy.end_snapshot();
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(100000u, copy.size());
+
+    // The snapshot has the table as it was at begin_snapshot().
+    TypeParam ht_in;
+    EXPECT_TRUE(ht_in.unserialize_parallel(ValueSerializer(), &snapshot, 2));
+    EXPECT_EQ(ht.size(), ht_in.size());
+    for (int i = 1; i <= 100000; i += 999) {
+      ASSERT_TRUE(ht_in.find(this->UniqueKey(i)) != ht_in.end());
+      EXPECT_EQ(this->UniqueObject(i), *ht_in.find(this->UniqueKey(i)));
+    }
+    EXPECT_FALSE(ht_in.count(this->UniqueKey(100001)));
+  }
+}
+
+// Values changed through a plain iterator loop while a snapshot is
+// being written are copied aside page by page, as the loop reaches them.
+template <class Map>
+void CheckSnapshotWriteThroughIterator(Map* ht) {
+  for (int i = 1; i <= 20000; i++) (*ht)[i] = i;
+  ht->begin_snapshot();
+  for (auto& kv : *ht) kv.second = -kv.second;
+  std::stringstream snapshot;
+  EXPECT_TRUE(ht->write_snapshot(typename Map::NopointerSerializer(),
+                                 &snapshot));
+  ht->end_snapshot();
+  EXPECT_EQ(-7, (*ht)[7]);
+
+  Map ht_in;
+  EXPECT_TRUE(ht_in.unserialize_parallel(typename Map::NopointerSerializer(),
+                                         &snapshot, 1));
+  EXPECT_EQ(20000u, ht_in.size());
+  for (int i = 1; i <= 20000; i++) EXPECT_EQ(i, ht_in.find(i)->second);
+}
+
+TEST(HashtableTest, SnapshotWriteThroughIterator) {
+  dense_hash_map<int, int> dense;
+  dense.set_empty_key(0);
+  CheckSnapshotWriteThroughIterator(&dense);
+  sparse_hash_map<int, int> sparse;
+  CheckSnapshotWriteThroughIterator(&sparse);
+}
+
+#ifdef SPARSEHASH_HAVE_MMAP  // for mkstemp()
+TYPED_TEST(HashtableAllTest, DurableHashMap) {
+  if (!this->ht_.supports_serialization()) return;
+  char temp[] = "/tmp/sparsehash_walXXXXXX";
+  const int fd = mkstemp(temp);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  const string path = temp;
+  const string checkpoint_path = path + ".checkpoint";
+  unlink(temp);  // the log gets created from scratch
+  TypeParam prototype;
+  prototype.set_deleted_key(this->UniqueKey(500000));
+  typedef durable_hash_map<TypeParam, ValueSerializer, ValueSerializer> Durable;
+
+  {
+    Durable m(prototype);
+    ASSERT_TRUE(m.open(path.c_str()));
+    m.set_batch_size(100);
+    for (int i = 1; i <= 1000; i++) m.insert(this->UniqueObject(i));
+    for (int i = 2; i <= 200; i += 2) EXPECT_EQ(1u, m.erase(this->UniqueKey(i)));
+    EXPECT_EQ(0u, m.erase(this->UniqueKey(2)));
+    m.put(this->UniqueObject(1));
+    EXPECT_TRUE(m.commit());
+    EXPECT_EQ(900u, m.size());
+  }
+
+  // Replayed from the log alone; then from a checkpoint and a log.
+  for (int round = 0; round < 2; round++) {
+    Durable m(prototype);
+    ASSERT_TRUE(m.open(path.c_str()));
+    EXPECT_EQ(round == 0 ? 900u : 1900u, m.size());
+    EXPECT_EQ(0u, m.count(this->UniqueKey(100)));
+    EXPECT_EQ(1u, m.count(this->UniqueKey(101)));
+    EXPECT_EQ(this->UniqueObject(999), *m.find(this->UniqueKey(999)));
+    if (round == 0) {
+      EXPECT_TRUE(m.checkpoint());
+      for (int i = 1001; i <= 2000; i++) m.insert(this->UniqueObject(i));
+    }
+  }  // closing commits
+
+  // A batch torn by a crash is dropped, and logging carries on after
+  // the batches before it.
+  FILE* fp = fopen(path.c_str(), "ab");
+  ASSERT_TRUE(fp != NULL);
+  fputs("a batch that was never finished", fp);
+  fclose(fp);
+  {
+    Durable m(prototype);
+    ASSERT_TRUE(m.open(path.c_str()));
+    EXPECT_EQ(1900u, m.size());
+    m.clear();
+    m.insert(this->UniqueObject(7));
+  }
+  {
+    Durable m(prototype);
+    ASSERT_TRUE(m.open(path.c_str()));
+    EXPECT_EQ(1u, m.size());
+    EXPECT_EQ(1u, m.count(this->UniqueKey(7)));
+  }
+
+  // A corrupt checkpoint is refused.
+  fp = fopen(checkpoint_path.c_str(), "r+b");
+  ASSERT_TRUE(fp != NULL);
+  fputc('x', fp);
+  fclose(fp);
+  Durable m(prototype);
+  EXPECT_FALSE(m.open(path.c_str()));
+  EXPECT_FALSE(m.is_open());
+  unlink(path.c_str());
+  unlink(checkpoint_path.c_str());
+}
+
+// put() on a map assigns the value in place, so it needs no deleted key.
+TEST(HashtableTest, DurableHashMapPutWithoutDeletedKey) {
+  char temp[] = "/tmp/sparsehash_walXXXXXX";
+  const int fd = mkstemp(temp);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  unlink(temp);
+  dense_hash_map<int, int> prototype;
+  prototype.set_empty_key(-1);
+  {
+    durable_hash_map<dense_hash_map<int, int>> m(prototype);
+    ASSERT_TRUE(m.open(temp));
+    m.insert(std::make_pair(1, 2));
+    m.put(std::make_pair(1, 3));
+    EXPECT_EQ(3, m.find(1)->second);
+  }
+  durable_hash_map<dense_hash_map<int, int>> m(prototype);
+  ASSERT_TRUE(m.open(temp));  // replays both puts
+  EXPECT_EQ(1u, m.size());
+  EXPECT_EQ(3, m.find(1)->second);
+  unlink(temp);
+  unlink((string(temp) + ".checkpoint").c_str());
+}
+#endif
+
+TYPED_TEST(HashtableIntTest, SerializingParallelCorruption) {
+  if (!this->ht_.supports_serialization()) return;
+  TypeParam ht_out;
+  for (int i = 1; i <= 100000; i++) ht_out.insert(this->UniqueObject(i));
+  std::stringstream snapshot;
+  EXPECT_TRUE(ht_out.serialize_parallel(
+      typename TypeParam::NopointerSerializer(), &snapshot));
+  const string bytes = snapshot.str();
+
+  // A flipped bit in the header, a chunk, or the index; a snapshot cut
+  // short in a chunk or in the index.
+  std::vector<string> bad;
+  for (size_t pos : {size_t(20), bytes.size() / 2, bytes.size() - 6}) {
+    bad.push_back(bytes);
+    bad.back()[pos] ^= 0x10;
+  }
+  bad.push_back(bytes.substr(0, bytes.size() / 2));
+  bad.push_back(bytes.substr(0, bytes.size() - 4));
+  for (const string& b : bad) {
+    std::stringstream in(b);
+    EXPECT_FALSE(TypeParam::validate_snapshot(&in));
+    in.clear();
+    in.seekg(0);
+    TypeParam ht_in;
+    EXPECT_FALSE(ht_in.unserialize_parallel(
+        typename TypeParam::NopointerSerializer(), &in, 2));
+    EXPECT_EQ(0u, ht_in.size());
+  }
+}
+
+TEST(HashtableTest, SparseDeltaSnapshots) {
+  typedef sparse_hash_map<int, int> Map;
+  Map ht;
+  ht.set_deleted_key(-1);
+  for (int i = 0; i < 100000; i++) ht[i] = i;
+  ht.set_delta_tracking(true);
+  std::stringstream base;
+  EXPECT_TRUE(ht.serialize_snapshot(Map::NopointerSerializer(), &base));
+  const string base_bytes = base.str();
+  const uint64_t base_epoch = ht.delta_epoch();
+
+  // A few changes make a small delta; the epoch has to match.
+  for (int i = 0; i < 100; i++) ht[i * 997] = -i;
+  ht.erase(5);
+  std::stringstream delta1;
+  EXPECT_FALSE(ht.serialize_delta(Map::NopointerSerializer(), base_epoch + 1,
+                                  &delta1));
+  EXPECT_TRUE(ht.serialize_delta(Map::NopointerSerializer(), base_epoch,
+                                 &delta1));
+  EXPECT_EQ(base_epoch + 1, ht.delta_epoch());
+  EXPECT_LT(delta1.str().size() * 10, base_bytes.size());
+
+  // Enough inserts to rehash: this one has every group.
+  for (int i = 100000; i < 200000; i++) ht[i] = i;
+  std::stringstream delta2;
+  EXPECT_TRUE(ht.serialize_delta(Map::NopointerSerializer(), ht.delta_epoch(),
+                                 &delta2));
+  ht.erase(7);
+  std::stringstream delta3;
+  EXPECT_TRUE(ht.serialize_delta(Map::NopointerSerializer(), ht.delta_epoch(),
+                                 &delta3));
+  const string delta_bytes[] = {delta1.str(), delta2.str(), delta3.str()};
+
+  // A replica follows along; a delta out of order, or damaged, is
+  // refused and leaves it alone.
+  Map replica;
+  replica.set_deleted_key(-1);
+  std::stringstream base_in(base_bytes);
+  EXPECT_TRUE(replica.unserialize_snapshot(Map::NopointerSerializer(),
+                                           &base_in));
+  replica.set_delta_epoch(base_epoch);
+  std::stringstream early(delta_bytes[1]);
+  EXPECT_FALSE(replica.apply_delta(Map::NopointerSerializer(), &early));
+  string damaged = delta_bytes[0];
+  damaged[damaged.size() / 2] ^= 0x10;
+  std::stringstream damaged_in(damaged);
+  EXPECT_FALSE(replica.apply_delta(Map::NopointerSerializer(), &damaged_in));
+  EXPECT_EQ(100000u, replica.size());
+  EXPECT_EQ(base_epoch, replica.delta_epoch());
+
+  // So is one applied to a table that doesn't hold its base, which
+  // shows when the counts don't come out.
+  Map stranger;
+  stranger.set_deleted_key(-1);
+  std::stringstream stranger_base(base_bytes);
+  EXPECT_TRUE(stranger.unserialize_snapshot(Map::NopointerSerializer(),
+                                            &stranger_base));
+  stranger.set_delta_epoch(base_epoch);
+  stranger[-5] = 5;
+  std::stringstream stranger_delta(delta_bytes[0]);
+  EXPECT_FALSE(stranger.apply_delta(Map::NopointerSerializer(),
+                                    &stranger_delta));
+  EXPECT_EQ(100001u, stranger.size());
+  EXPECT_EQ(5, stranger[-5]);
+  EXPECT_EQ(997, stranger[997]);  // not -1, as in the delta
+  EXPECT_EQ(base_epoch, stranger.delta_epoch());
+
+  for (const string& bytes : delta_bytes) {
+    std::stringstream in(bytes);
+    EXPECT_TRUE(replica.apply_delta(Map::NopointerSerializer(), &in));
+  }
+  EXPECT_EQ(ht.delta_epoch(), replica.delta_epoch());
+  EXPECT_EQ(ht.bucket_count(), replica.bucket_count());
+  EXPECT_TRUE(ht == replica);
+  EXPECT_EQ(0u, replica.count(5));
+  EXPECT_EQ(-3, replica[3 * 997]);
+
+  // Or the base and deltas are compacted into a new base.
+  std::stringstream compact_base(base_bytes);
+  std::vector<std::stringstream*> deltas;
+  for (const string& bytes : delta_bytes)
+    deltas.push_back(new std::stringstream(bytes));
+  std::stringstream compacted;
+  Map merged;
+  merged.set_deleted_key(-1);
+  EXPECT_TRUE(merged.compact_deltas(Map::NopointerSerializer(), &compact_base,
+                                    base_epoch, deltas.begin(), deltas.end(),
+                                    &compacted));
+  for (std::stringstream* delta : deltas) delete delta;
+  Map from_compacted;
+  EXPECT_TRUE(from_compacted.unserialize_snapshot(Map::NopointerSerializer(),
+                                                  &compacted));
+  EXPECT_TRUE(ht == from_compacted);
+
+  // In physical-erase mode the erased buckets travel with the groups.
+  Map erasing;
+  erasing.set_physical_erase(true);
+  for (int i = 0; i < 1000; i++) erasing[i] = i;
+  std::stringstream erasing_base;
+  EXPECT_TRUE(erasing.serialize_snapshot(Map::NopointerSerializer(),
+                                         &erasing_base));
+  erasing.set_delta_tracking(true);
+  for (int i = 0; i < 1000; i += 3) erasing.erase(i);
+  std::stringstream erasing_delta;
+  EXPECT_TRUE(erasing.serialize_delta(Map::NopointerSerializer(), 0,
+                                      &erasing_delta));
+  Map erasing_replica;
+  erasing_replica.set_physical_erase(true);
+  EXPECT_TRUE(erasing_replica.unserialize_snapshot(Map::NopointerSerializer(),
+                                                   &erasing_base));
+  EXPECT_TRUE(erasing_replica.apply_delta(Map::NopointerSerializer(),
+                                          &erasing_delta));
+  EXPECT_TRUE(erasing == erasing_replica);
+  for (int i = 0; i < 1000; i++)
+    EXPECT_EQ(i % 3 ? 1u : 0u, erasing_replica.count(i));
+}
+
+TEST(HashtableTest, SparseHashMapView) {
+  sparse_hash_map<int, int64_t> m;
+  m.set_deleted_key(-1);
+  for (int i = 0; i < 100000; i++) m[i * 3] = i;
+  for (int i = 0; i < 1000; i++) m.erase(i * 30);
+
+  std::stringstream out;
+  EXPECT_TRUE(m.serialize_mappable(&out));
+  const string bytes = out.str();
+  // The view wants its memory aligned, as a mapping would be.
+  std::vector<uint64_t> memory(bytes.size() / 8 + 1);
+  memcpy(memory.data(), bytes.data(), bytes.size());
+
+  sparse_hash_map_view<int, int64_t> view;
+  ASSERT_TRUE(view.open(memory.data(), bytes.size()));
+  EXPECT_EQ(m.size(), view.size());
+  EXPECT_EQ(m.bucket_count(), view.bucket_count());
+  for (int i = 0; i < 100000; i++) {
+    if (i < 10000 && i % 10 == 0) {  // erased
+      EXPECT_EQ(0u, view.count(i * 3));
+    } else {
+      ASSERT_TRUE(view.find(i * 3) != view.end());
+      EXPECT_EQ(i, view.find(i * 3)->second);
+    }
+    EXPECT_EQ(0u, view.count(i * 3 + 1));
+  }
+  EXPECT_EQ(7, view.at(21));
+  int64_t sum = 0;
+  for (const auto& kv : view) sum += kv.second;
+  int64_t expected_sum = 0;
+  for (const auto& kv : m) expected_sum += kv.second;
+  EXPECT_EQ(expected_sum, sum);
+
+  // A view of the wrong type, a short or damaged file: all refused.
+  sparse_hash_map_view<int, int32_t> narrower;
+  EXPECT_FALSE(narrower.open(memory.data(), bytes.size()));
+  EXPECT_FALSE(view.open(memory.data(), bytes.size() - 1));
+  EXPECT_TRUE(view.empty());
+  reinterpret_cast<char*>(memory.data())[40] ^= 1;
+  EXPECT_FALSE(view.open(memory.data(), bytes.size()));
+
+#ifdef SPARSEHASH_HAVE_MMAP
+  char path[] = "/tmp/sparsehash_viewXXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(static_cast<ssize_t>(bytes.size()),
+            write(fd, bytes.data(), bytes.size()));
+  close(fd);
+  EXPECT_TRUE(view.open_file(path));
+  EXPECT_EQ(m.size(), view.size());
+  EXPECT_EQ(99999, view.at(99999 * 3));
+  view.close();
+  unlink(path);
+  EXPECT_FALSE(view.open_file(path));
+#endif
+}
+
 // Verify that the metadata serialization is endianness and word size
 // agnostic.
 TYPED_TEST(HashtableAllTest, MetadataSerializationAndEndianness) {
@@ -1456,6 +2496,124 @@ TEST(HashtableTest, ResizeWithoutShrink) {
 }
 
 
+// Exercises a table whose Stats policy is count_stats.  Shrinking is
+// off at first so that erased keys leave deleted buckets to reuse.
+template <class Table>
+void CheckCountedStats(Table* ht) {
+  ht->min_load_factor(0);
+  for (int i = 0; i < 100; ++i) ht->insert(std::make_pair(i, i));
+  google::hashtable_stats stats = ht->stats();
+  EXPECT_EQ(100u, stats.misses);
+  EXPECT_EQ(0u, stats.hits);
+  EXPECT_GT(stats.resizes, 0u);
+  EXPECT_EQ(0u, stats.shrinks);
+
+  for (int i = 0; i < 100; ++i) EXPECT_EQ(1u, ht->count(i));
+  EXPECT_EQ(0u, ht->count(1000));
+  stats = ht->stats();
+  EXPECT_EQ(100u, stats.hits);
+  EXPECT_EQ(101u, stats.misses);
+  EXPECT_EQ(stats.hits + stats.misses, stats.lookups);
+  EXPECT_LE(stats.max_probe, stats.total_probes);
+
+  for (int i = 0; i < 50; ++i) ht->erase(i);
+  for (int i = 0; i < 50; ++i) ht->insert(std::make_pair(i, i));
+  EXPECT_EQ(50u, ht->stats().deleted_reused);
+
+  ht->min_load_factor(0.2f);
+  for (int i = 0; i < 100; ++i) ht->erase(i);
+  ht->insert(std::make_pair(1, 1));
+  stats = ht->stats();
+  EXPECT_EQ(1u, stats.shrinks);
+  EXPECT_GT(stats.rehash_nanos, 0u);
+
+  // erase_if() rebuilds the table, here into a smaller one.
+  for (int i = 0; i < 1000; ++i) ht->insert(std::make_pair(i, i));
+  const google::hashtable_stats before = ht->stats();
+  EXPECT_EQ(990u, ht->erase_if([](const std::pair<const int, int>& v) {
+    return v.first >= 10;
+  }));
+  stats = ht->stats();
+  EXPECT_EQ(before.shrinks + 1, stats.shrinks);
+  EXPECT_EQ(before.resizes, stats.resizes);
+  EXPECT_GT(stats.rehash_nanos, before.rehash_nanos);
+}
+
+TEST(HashtableTest, Stats) {
+  typedef google::libc_allocator_with_realloc<std::pair<const int, int>> A;
+  dense_hash_map<int, int, std::hash<int>, std::equal_to<int>, A,
+                 google::count_stats> dense;
+  dense.set_empty_key(-1);
+  dense.set_deleted_key(-2);
+  CheckCountedStats(&dense);
+
+  sparse_hash_map<int, int, std::hash<int>, std::equal_to<int>, A,
+                  google::count_stats> sparse;
+  sparse.set_deleted_key(-2);
+  CheckCountedStats(&sparse);
+
+  // With the default policy nothing is counted.
+  dense_hash_map<int, int> uncounted;
+  uncounted.set_empty_key(-1);
+  uncounted[1] = 1;
+  EXPECT_EQ(0u, uncounted.stats().lookups);
+  EXPECT_EQ(0u, uncounted.stats().resizes);
+}
+
+struct ConstantHash {
+  size_t operator()(int) const { return 7; }
+};
+
+TEST(HashtableTest, Analyze) {
+  dense_hash_map<int, int> dense;
+  dense.set_empty_key(-1);
+  dense.set_deleted_key(-2);
+  dense.min_load_factor(0);
+  for (int i = 0; i < 1000; ++i) dense[i] = i;
+  for (int i = 0; i < 100; ++i) dense.erase(i);
+  google::hashtable_analysis a = dense.analyze();
+  EXPECT_EQ(dense.bucket_count(), a.num_buckets);
+  EXPECT_EQ(900u, a.num_elements);
+  EXPECT_EQ(100u, a.num_deleted);
+  size_t entries = 0, deleted = 0;
+  for (size_t n : a.displacement) entries += n;
+  for (size_t n : a.deleted_per_region) deleted += n;
+  EXPECT_EQ(900u, entries);
+  EXPECT_EQ(100u, deleted);
+  EXPECT_EQ(a.num_buckets, a.region_buckets * a.deleted_per_region.size());
+  EXPECT_EQ(a.displacement.size() - 1, a.max_displacement);
+  EXPECT_GE(a.longest_cluster, 1u);
+  EXPECT_LT(a.longest_cluster, a.num_buckets);
+  EXPECT_EQ(a.num_buckets - 1, a.chi_square_df);
+  EXPECT_TRUE(a.group_fill.empty());
+
+  // Every key in one home bucket: they probe 0, 1, ..., 49 times.
+  sparse_hash_map<int, int, ConstantHash> sparse;
+  for (int i = 0; i < 50; ++i) sparse[i] = i;
+  a = sparse.analyze();
+  EXPECT_EQ(50u, a.num_elements);
+  EXPECT_EQ(49u, a.max_displacement);
+  EXPECT_DOUBLE_EQ(24.5, a.mean_displacement);
+  EXPECT_GT(a.chi_square, 10.0 * a.chi_square_df);
+  size_t groups = 0, grouped = 0;
+  for (size_t i = 0; i < a.group_fill.size(); ++i) {
+    groups += a.group_fill[i];
+    grouped += i * a.group_fill[i];
+  }
+  EXPECT_EQ((a.num_buckets + 47) / 48, groups);
+  EXPECT_EQ(50u, grouped);
+
+  // A big table's home buckets are counted in 65536 ranges.
+  dense_hash_map<int, int> big;
+  big.set_empty_key(-1);
+  big.resize(200000);
+  for (int i = 0; i < 1000; ++i) big[i] = i;
+  a = big.analyze();
+  EXPECT_GT(a.num_buckets, 65536u);
+  EXPECT_EQ(65535u, a.chi_square_df);
+  EXPECT_EQ(1000u, a.num_elements);
+}
+
 TEST(HashtableDeathTest, ResizeOverflow) {
   dense_hash_map<int, int> ht;
   EXPECT_THROW(ht.resize(static_cast<size_t>(-1)), std::length_error);
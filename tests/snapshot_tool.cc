@@ -0,0 +1,1104 @@
+// Copyright (c) 2010, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Looks inside the files the hash tables write, without loading them
+// into a table:
+//
+//    snapshot_tool info [options] FILE
+//    snapshot_tool validate [options] FILE
+//    snapshot_tool convert --to=FORMAT [options] IN OUT
+//
+// It reads what serialize() writes for any of the four containers,
+// snapshots from serialize_snapshot(), serialize_parallel() and
+// serialize_delta(), and serialize_mappable()'s layout.  Values are
+// copied as so many bytes, so the values have to have been written
+// with NopointerSerializer.
+//
+// info prints the bucket and element counts, the load factor, how full
+// each region of the table is, and, from the occupancy alone, how many
+// buckets a lookup of a missing key would probe (assuming its hash is
+// equally likely to pick any bucket).  validate checks everything that
+// can be checked -- magic numbers, checksums, counts against bitmaps,
+// the index of an indexed snapshot -- and exits non-zero if anything is
+// wrong.  Both read the file front to back once.
+//
+// convert rewrites a table in another format: legacy (what serialize()
+// writes), snapshot (serialize_snapshot()) or mappable
+// (serialize_mappable(), for sparse_hash_map_view).  The buckets keep
+// their positions, so --layout=dense or --layout=sparse can also move a
+// table between the dense and sparse encodings.  The input is checked
+// in full first, then read again as the output is written, so memory
+// use is a bit per bucket whatever the size of the values.
+//
+// Options:
+//    --value-size=N   the size of a value in an older file; by default
+//                     it's worked out from the size of the file
+//    --key-size=N     the key size and hasher tag (in hex; see
+//    --hasher-tag=X   snapshot_hasher_tag()) to write into a snapshot or
+//                     mappable file converted from an older one
+//    --value-align=N  alignof(value_type), to write into a mappable
+//                     file converted from one that doesn't record it
+//    --layout=L       dense or sparse: the layout to convert to
+//    --regions=N      how many regions info reports on (16)
+
+#include <algorithm>  // for min, max
+#include <cctype>  // for isxdigit
+#include <cerrno>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sparsehash/internal/hashtable-common.h>
+#include <sparsehash/internal/hashtable-snapshot.h>
+#include <sparsehash/internal/sparsehashtable.h>  // for DEFAULT_GROUP_SIZE
+
+using google::DEFAULT_GROUP_SIZE;
+using google::sparsehash_internal::MAPPABLE_MAGIC;
+using google::sparsehash_internal::MAPPABLE_VERSION;
+using google::sparsehash_internal::SNAPSHOT_CHUNK_SIZE;
+using google::sparsehash_internal::SNAPSHOT_FRAME_HEADER_SIZE;
+using google::sparsehash_internal::SNAPSHOT_LITTLE_ENDIAN;
+using google::sparsehash_internal::SNAPSHOT_MAGIC;
+using google::sparsehash_internal::SNAPSHOT_SPARSE;
+using google::sparsehash_internal::SNAPSHOT_VERSION;
+using google::sparsehash_internal::buffered_reader;
+using google::sparsehash_internal::checksummed_reader;
+using google::sparsehash_internal::checksummed_writer;
+using google::sparsehash_internal::count_trailing_zeros;
+using google::sparsehash_internal::crc32c;
+using google::sparsehash_internal::get_bigendian;
+using google::sparsehash_internal::host_is_little_endian;
+using google::sparsehash_internal::mappable_header;
+using google::sparsehash_internal::memory_reader;
+using google::sparsehash_internal::read_bigendian_number;
+using google::sparsehash_internal::read_data;
+using google::sparsehash_internal::read_snapshot_frame;
+using google::sparsehash_internal::read_snapshot_header_after_magic;
+using google::sparsehash_internal::read_snapshot_index;
+using google::sparsehash_internal::set_mappable_layout;
+using google::sparsehash_internal::snapshot_header;
+using google::sparsehash_internal::write_bigendian_number;
+using google::sparsehash_internal::write_data;
+using google::sparsehash_internal::write_padding;
+using google::sparsehash_internal::write_snapshot_header;
+
+namespace {
+
+// dense_hashtable's and sparsetable's MAGIC_NUMBERs, which are private.
+const uint32_t DENSE_MAGIC = 0x13578642;
+const uint32_t SPARSE_MAGIC = 0x24687531;
+
+// A sparsegroup's bitmap, and what write_metadata() writes: the
+// group's element count (2 bytes) and then the bitmap.
+const uint64_t GROUP_SIZE = DEFAULT_GROUP_SIZE;
+const size_t BITMAP_SIZE = (DEFAULT_GROUP_SIZE - 1) / 8 + 1;
+const size_t GROUP_METADATA_SIZE = 2 + BITMAP_SIZE;
+
+uint64_t num_groups(uint64_t num_buckets) {
+  return (num_buckets + GROUP_SIZE - 1) / GROUP_SIZE;
+}
+
+int popcount(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(word);
+#else
+  int n = 0;
+  for (; word != 0; word &= word - 1) ++n;
+  return n;
+#endif
+}
+
+int bitmap_popcount(const unsigned char* bitmap) {
+  int n = 0;
+  for (size_t i = 0; i < BITMAP_SIZE; ++i) n += popcount(bitmap[i]);
+  return n;
+}
+
+// sparsetable's encoding of its sizes: 4 bytes if the number fits,
+// else 0xFFFFFFFF and 8 bytes.
+template <typename INPUT>
+bool read_32_or_64(INPUT* fp, uint64_t* value) {
+  uint32_t first4;
+  if (!read_bigendian_number(fp, &first4, 4)) return false;
+  if (first4 < 0xFFFFFFFFu) {
+    *value = first4;
+    return true;
+  }
+  return read_bigendian_number(fp, value, 8);
+}
+
+template <typename OUTPUT>
+bool write_32_or_64(OUTPUT* fp, uint64_t value) {
+  if (value < 0xFFFFFFFFu) return write_bigendian_number(fp, value, 4);
+  return write_bigendian_number(fp, uint64_t(0xFFFFFFFFu), 4) &&
+         write_bigendian_number(fp, value, 8);
+}
+
+enum file_format { LEGACY, SNAPSHOT, INDEXED, DELTA, MAPPABLE };
+
+const char* format_name(file_format format) {
+  switch (format) {
+    case LEGACY: return "legacy serialize()";
+    case SNAPSHOT: return "snapshot";
+    case INDEXED: return "indexed snapshot";
+    case DELTA: return "delta snapshot";
+    case MAPPABLE: return "mappable";
+  }
+  return "?";
+}
+
+// What a file says about the table in it.  Fields a format doesn't
+// record are 0.
+struct table_info {
+  file_format format;
+  bool sparse;
+  uint32_t flags;  // SNAPSHOT_LITTLE_ENDIAN, as the file has it
+  uint32_t key_size;
+  uint32_t value_size;
+  bool value_size_inferred;
+  uint32_t value_align;
+  bool has_hasher_tag;
+  uint64_t hasher_tag;
+  uint64_t num_buckets;
+  uint64_t num_elements;
+  uint64_t file_size;
+  // Deltas only.
+  uint64_t from_epoch;
+  uint64_t to_epoch;
+  uint64_t num_deleted;
+  uint64_t num_delta_groups;
+};
+
+// For reading past values we don't want.
+struct skip_values {
+  bool begin(const table_info&) { return true; }
+  bool operator()(uint64_t, const char*) { return true; }
+};
+
+// Reads a file front to back, checking it as it goes, and calls
+// visitor.begin(info) once the header's been read and visitor(bucket,
+// value) for each element, in bucket order.  Deltas aren't whole
+// tables, so they're only checked.  scan() may be called again to read
+// the file again.
+class table_reader {
+ public:
+  table_reader(const char* path, uint32_t value_size)
+      : path_(path), value_size_option_(value_size) {}
+
+  template <typename Visitor>
+  bool scan(Visitor* visitor) {
+    error_.clear();
+    memset(&info_, 0, sizeof(info_));
+    num_read_ = 0;
+    std::unique_ptr<FILE, int (*)(FILE*)> fp(fopen(path_, "rb"), fclose);
+    if (!fp) return fail("can't open %s", path_);
+    if (fseek(fp.get(), 0, SEEK_END) != 0) return fail("can't seek");
+    const long size = ftell(fp.get());
+    if (size < 0) return fail("can't tell the size of the file");
+    info_.file_size = size;
+    rewind(fp.get());
+    return scan_file(fp.get(), visitor);
+  }
+
+  const table_info& info() const { return info_; }
+  const std::string& error() const { return error_; }
+
+ private:
+  bool fail(const char* format, ...)
+#if defined(__GNUC__) || defined(__clang__)
+      __attribute__((format(printf, 2, 3)))
+#endif
+  {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    error_ = message;
+    return false;
+  }
+
+  template <typename Visitor>
+  bool scan_file(FILE* fp, Visitor* visitor) {
+    unsigned char magic_bytes[4];
+    if (!read_data(fp, magic_bytes, sizeof(magic_bytes)))
+      return fail("too short to be a table");
+    const unsigned char* p = magic_bytes;
+    const uint32_t magic = static_cast<uint32_t>(get_bigendian(&p, 4));
+    uint32_t native_magic;
+    memcpy(&native_magic, magic_bytes, sizeof(native_magic));
+    if (native_magic == MAPPABLE_MAGIC) return scan_mappable(fp, visitor);
+    if (magic == MAPPABLE_MAGIC && native_magic != magic)
+      return fail("a mappable file from a machine of the other byte order");
+    if (magic == SNAPSHOT_MAGIC) return scan_snapshot(fp, visitor);
+    if (magic != DENSE_MAGIC && magic != SPARSE_MAGIC)
+      return fail("not a hash table (magic number %08" PRIx32 ")", magic);
+
+    info_.format = LEGACY;
+    info_.flags = host_is_little_endian() ? SNAPSHOT_LITTLE_ENDIAN : 0;
+    rewind(fp);
+    buffered_reader<FILE> in(fp, static_cast<size_t>(info_.file_size));
+    if (!scan_table(&in, info_.file_size, visitor)) return false;
+    unsigned char extra;
+    if (read_data(&in, &extra, 1))
+      return fail("there's more in the file after the table");
+    return true;
+  }
+
+  // What serialize() writes, from its magic number on.  body_size is
+  // how many bytes it takes up, if we know, so we can work out the
+  // value size from it.
+  template <typename INPUT, typename Visitor>
+  bool scan_table(INPUT* in, uint64_t body_size, Visitor* visitor) {
+    uint32_t magic;
+    uint64_t num_buckets, num_elements, header_size;
+    if (!read_bigendian_number(in, &magic, 4)) return fail("truncated header");
+    const bool sparse = magic == SPARSE_MAGIC;
+    if (magic == DENSE_MAGIC) {
+      if (!read_bigendian_number(in, &num_buckets, 8) ||
+          !read_bigendian_number(in, &num_elements, 8))
+        return fail("truncated header");
+      header_size = 20;
+    } else if (sparse) {
+      if (!read_32_or_64(in, &num_buckets) || !read_32_or_64(in, &num_elements))
+        return fail("truncated header");
+      header_size = 4 + (num_buckets < 0xFFFFFFFFu ? 4 : 12) +
+                    (num_elements < 0xFFFFFFFFu ? 4 : 12);
+    } else {
+      return fail("bad magic number %08" PRIx32 " inside the snapshot",
+                  magic);
+    }
+
+    if (info_.format == LEGACY) {
+      info_.sparse = sparse;
+      info_.num_buckets = num_buckets;
+      info_.num_elements = num_elements;
+    } else if (sparse != info_.sparse || num_buckets != info_.num_buckets ||
+               num_elements != info_.num_elements) {
+      return fail("the table doesn't match the snapshot's header");
+    }
+    if (!check_counts()) return false;
+
+    if (info_.value_size == 0) {
+      if (value_size_option_ != 0) {
+        info_.value_size = value_size_option_;
+      } else if (num_elements > 0) {
+        const uint64_t metadata =
+            header_size +
+            (sparse ? num_groups(num_buckets) * GROUP_METADATA_SIZE
+                    : (num_buckets + 7) / 8);
+        if (body_size <= metadata || (body_size - metadata) % num_elements)
+          return fail("can't work out the value size; use --value-size");
+        info_.value_size =
+            static_cast<uint32_t>((body_size - metadata) / num_elements);
+        info_.value_size_inferred = true;
+      }
+    }
+    value_.resize(info_.value_size);
+    if (!visitor->begin(info_)) return fail("can't write the output");
+
+    if (sparse) {
+      // All the groups' metadata comes first, then all the values.
+      const uint64_t n = num_groups(num_buckets);
+      bitmaps_.resize(n * BITMAP_SIZE);
+      for (uint64_t g = 0; g < n; ++g)
+        if (!read_group_metadata(in, g, &bitmaps_[g * BITMAP_SIZE]))
+          return false;
+      for (uint64_t g = 0; g < n; ++g)
+        if (!read_group_values(in, g, &bitmaps_[g * BITMAP_SIZE], visitor))
+          return false;
+    } else if (!read_buckets(in, 0, num_buckets, visitor)) {
+      return false;
+    }
+    return check_all_read();
+  }
+
+  template <typename Visitor>
+  bool scan_snapshot(FILE* fp, Visitor* visitor) {
+    snapshot_header header;
+    if (!read_snapshot_header_after_magic(fp, &header))
+      return fail("the snapshot header is truncated or corrupt");
+    if (header.version != SNAPSHOT_VERSION)
+      return fail("snapshot version %" PRIu32 "; this build reads %" PRIu32,
+                  header.version, SNAPSHOT_VERSION);
+    if (header.chunk_size == 0 || header.chunk_size > (1u << 30))
+      return fail("bad chunk size %" PRIu32, header.chunk_size);
+    info_.format = header.delta() ? DELTA : header.indexed() ? INDEXED
+                                                             : SNAPSHOT;
+    info_.sparse = (header.flags & SNAPSHOT_SPARSE) != 0;
+    info_.flags = header.flags & SNAPSHOT_LITTLE_ENDIAN;
+    info_.key_size = header.key_size;
+    info_.value_size = header.value_size;
+    info_.has_hasher_tag = true;
+    info_.hasher_tag = header.hasher_tag;
+    info_.num_buckets = header.num_buckets;
+    info_.num_elements = header.num_elements;
+    if (!check_counts()) return false;
+    value_.resize(info_.value_size);
+
+    if (info_.format == DELTA) {
+      if (!info_.sparse) return fail("a delta of a dense table");
+      checksummed_reader<FILE> in(fp, header.chunk_size);
+      if (!scan_delta(&in)) return false;
+      if (!in.finish()) return fail("the delta doesn't end properly");
+    } else if (info_.format == INDEXED) {
+      if (!scan_indexed(fp, header.chunk_size, visitor)) return false;
+    } else {
+      checksummed_reader<FILE> in(fp, header.chunk_size);
+      if (!scan_table(&in, 0, visitor)) return false;
+      if (!in.finish())
+        return fail("the snapshot's chunks don't end properly");
+    }
+    if (fgetc(fp) != EOF)
+      return fail("there's more in the file after the snapshot");
+    return true;
+  }
+
+  // serialize_parallel()'s frames, each holding chunk_size buckets or
+  // groups, then the index.
+  template <typename Visitor>
+  bool scan_indexed(FILE* fp, uint64_t chunk_size, Visitor* visitor) {
+    if (!visitor->begin(info_)) return fail("can't write the output");
+    const uint64_t units =
+        info_.sparse ? num_groups(info_.num_buckets) : info_.num_buckets;
+    const uint64_t num_chunks = (units + chunk_size - 1) / chunk_size;
+    std::vector<char> payload;
+    std::vector<uint64_t> offsets;
+    uint64_t offset = 0;
+    for (uint64_t chunk = 0; chunk < num_chunks; ++chunk) {
+      uint32_t crc;
+      if (!read_snapshot_frame(fp, &payload, &crc) || payload.empty())
+        return fail("chunk %" PRIu64 " of %" PRIu64 " is missing", chunk,
+                    num_chunks);
+      if (crc32c(0, payload.data(), payload.size()) != crc)
+        return fail("chunk %" PRIu64 " is corrupt", chunk);
+      offsets.push_back(offset);
+      offset += SNAPSHOT_FRAME_HEADER_SIZE + payload.size();
+      memory_reader in(payload.data(), payload.size());
+      const uint64_t first = chunk * chunk_size;
+      const uint64_t last = (std::min)(first + chunk_size, units);
+      if (info_.sparse) {
+        for (uint64_t g = first; g < last; ++g) {
+          unsigned char bitmap[BITMAP_SIZE];
+          if (!read_group_metadata(&in, g, bitmap) ||
+              !read_group_values(&in, g, bitmap, visitor))
+            return false;
+        }
+      } else if (!read_buckets(&in, first, last - first, visitor)) {
+        return false;
+      }
+      if (!in.at_end())
+        return fail("chunk %" PRIu64 " has bytes left over", chunk);
+    }
+    uint32_t crc;
+    if (!read_snapshot_frame(fp, &payload, &crc) || !payload.empty() ||
+        crc != crc32c(0, "", 0))
+      return fail("the chunks don't end properly");
+    if (!read_snapshot_index(fp, offsets))
+      return fail("the index is corrupt or doesn't match the chunks");
+    return check_all_read();
+  }
+
+  // serialize_delta()'s groups, checked and counted but not visited.
+  template <typename INPUT>
+  bool scan_delta(INPUT* in) {
+    unsigned char erased_bits;
+    if (!read_bigendian_number(in, &info_.from_epoch, 8) ||
+        !read_bigendian_number(in, &info_.to_epoch, 8) ||
+        !read_bigendian_number(in, &info_.num_deleted, 8) ||
+        !read_bigendian_number(in, &erased_bits, 1) ||
+        !read_bigendian_number(in, &info_.num_delta_groups, 8))
+      return fail("the delta is truncated or corrupt");
+    const uint64_t n = num_groups(info_.num_buckets);
+    if (info_.num_delta_groups > n)
+      return fail("the delta has more groups than the table");
+    skip_values ignore;
+    for (uint64_t i = 0; i < info_.num_delta_groups; ++i) {
+      uint64_t g;
+      unsigned char bitmap[BITMAP_SIZE];
+      if (!read_bigendian_number(in, &g, 8))
+        return fail("the delta is truncated or corrupt");
+      if (g >= n) return fail("the delta has group %" PRIu64 " of %" PRIu64,
+                              g, n);
+      if (!read_group_metadata(in, g, bitmap) ||
+          !read_group_values(in, g, bitmap, &ignore))
+        return false;
+      unsigned char erased[BITMAP_SIZE];
+      if (erased_bits && !read_data(in, erased, sizeof(erased)))
+        return fail("the delta is truncated or corrupt");
+    }
+    return true;
+  }
+
+  // serialize_mappable()'s header, bitmaps, offsets and values.
+  template <typename Visitor>
+  bool scan_mappable(FILE* fp, Visitor* visitor) {
+    mappable_header header;
+    rewind(fp);
+    if (!read_data(fp, &header, sizeof(header)))
+      return fail("truncated header");
+    if (header.header_crc != header.compute_crc())
+      return fail("the header is corrupt");
+    if (header.version != MAPPABLE_VERSION)
+      return fail("mappable version %" PRIu32 "; this build reads %" PRIu32,
+                  header.version, MAPPABLE_VERSION);
+    if (header.group_size != GROUP_SIZE)
+      return fail("groups of %" PRIu32 " buckets; this build uses %" PRIu64,
+                  header.group_size, GROUP_SIZE);
+    info_.format = MAPPABLE;
+    info_.sparse = true;
+    info_.flags = header.flags & SNAPSHOT_LITTLE_ENDIAN;
+    info_.value_size = header.value_size;
+    info_.value_align = header.value_align;
+    info_.has_hasher_tag = true;
+    info_.hasher_tag = header.hasher_tag;
+    info_.num_buckets = header.num_buckets;
+    info_.num_elements = header.num_elements;
+    if (!check_counts()) return false;
+    if (header.value_align == 0 ||
+        (header.value_align & (header.value_align - 1)) != 0)
+      return fail("bad value alignment %" PRIu32, header.value_align);
+    const uint64_t n = num_groups(header.num_buckets);
+    mappable_header expected = header;
+    set_mappable_layout(&expected, n, BITMAP_SIZE);
+    if (header.offsets_offset != expected.offsets_offset ||
+        header.values_offset != expected.values_offset ||
+        header.file_size != expected.file_size)
+      return fail("the header's offsets don't fit its counts");
+    if (header.file_size != info_.file_size)
+      return fail("the file is %" PRIu64 " bytes; the header says %" PRIu64,
+                  info_.file_size, header.file_size);
+    value_.resize(info_.value_size);
+    if (!visitor->begin(info_)) return fail("can't write the output");
+
+    buffered_reader<FILE> in(
+        fp, static_cast<size_t>(header.file_size - sizeof(header)));
+    bitmaps_.resize(n * BITMAP_SIZE);
+    if (!read_data(&in, bitmaps_.data(), bitmaps_.size()))
+      return fail("truncated bitmaps");
+    for (uint64_t g = 0; g < n; ++g)
+      if (!check_bitmap(g, &bitmaps_[g * BITMAP_SIZE])) return false;
+    uint64_t pos = sizeof(header) + bitmaps_.size();
+    if (!skip(&in, &pos, header.offsets_offset)) return false;
+    uint64_t expected_offset = 0;
+    for (uint64_t g = 0; g <= n; ++g) {
+      uint64_t offset;
+      if (!read_data(&in, &offset, sizeof(offset)))
+        return fail("truncated offsets");
+      if (offset != expected_offset)
+        return fail("group %" PRIu64 "'s offset doesn't match the bitmaps", g);
+      if (g < n) expected_offset += bitmap_popcount(&bitmaps_[g * BITMAP_SIZE]);
+    }
+    if (expected_offset != header.num_elements)
+      return fail("the bitmaps hold %" PRIu64 " elements, not %" PRIu64,
+                  expected_offset, header.num_elements);
+    pos += 8 * (n + 1);
+    if (!skip(&in, &pos, header.values_offset)) return false;
+    for (uint64_t g = 0; g < n; ++g)
+      if (!read_group_values(&in, g, &bitmaps_[g * BITMAP_SIZE], visitor))
+        return false;
+    return check_all_read();
+  }
+
+  template <typename INPUT>
+  bool skip(INPUT* in, uint64_t* pos, uint64_t target) {
+    char padding[64];
+    while (*pos < target) {
+      const size_t n = static_cast<size_t>((std::min)(target - *pos,
+                                                      uint64_t(64)));
+      if (!read_data(in, padding, n)) return fail("truncated padding");
+      *pos += n;
+    }
+    return true;
+  }
+
+  // Every format has at least a bit per bucket, so a header claiming
+  // more buckets than the file has bits is wrong -- and we'd rather say
+  // so than try to allocate for them.
+  bool check_counts() {
+    const uint64_t n = info_.num_buckets;
+    if ((n & (n - 1)) != 0)
+      return fail("%" PRIu64 " buckets isn't a power of 2", n);
+    if (info_.num_elements > n)
+      return fail("%" PRIu64 " elements in %" PRIu64 " buckets",
+                  info_.num_elements, n);
+    if ((n + 7) / 8 > info_.file_size)
+      return fail("%" PRIu64 " buckets is more than the file could hold", n);
+    return true;
+  }
+
+  bool check_all_read() {
+    if (num_read_ != info_.num_elements)
+      return fail("found %" PRIu64 " elements; the header says %" PRIu64,
+                  num_read_, info_.num_elements);
+    return true;
+  }
+
+  // n buckets from first on, as dense_hashtable writes them: a byte of
+  // bitmap, then the values of the buckets it marks, and so on.
+  template <typename INPUT, typename Visitor>
+  bool read_buckets(INPUT* in, uint64_t first, uint64_t n, Visitor* visitor) {
+    for (uint64_t i = 0; i < n; i += 8) {
+      unsigned char byte;
+      if (!read_data(in, &byte, 1))
+        return fail("truncated or corrupt at bucket %" PRIu64, first + i);
+      unsigned bits = byte;
+      if (n - i < 8 && (bits >> (n - i)) != 0)
+        return fail("bits set past the last bucket");
+      for (; bits != 0; bits &= bits - 1) {
+        if (!read_value(in, first + i + count_trailing_zeros(bits), visitor))
+          return false;
+      }
+    }
+    return true;
+  }
+
+  template <typename INPUT>
+  bool read_group_metadata(INPUT* in, uint64_t g, unsigned char* bitmap) {
+    uint16_t count;
+    if (!read_bigendian_number(in, &count, 2) ||
+        !read_data(in, bitmap, BITMAP_SIZE))
+      return fail("truncated or corrupt at group %" PRIu64, g);
+    if (count != bitmap_popcount(bitmap))
+      return fail("group %" PRIu64 "'s count doesn't match its bitmap", g);
+    return check_bitmap(g, bitmap);
+  }
+
+  bool check_bitmap(uint64_t g, const unsigned char* bitmap) {
+    const uint64_t buckets =
+        (std::min)(GROUP_SIZE, info_.num_buckets - g * GROUP_SIZE);
+    for (uint64_t pos = buckets; pos < GROUP_SIZE; ++pos) {
+      if (bitmap[pos / 8] & (1 << (pos % 8)))
+        return fail("bits set past the last bucket");
+    }
+    return true;
+  }
+
+  template <typename INPUT, typename Visitor>
+  bool read_group_values(INPUT* in, uint64_t g, const unsigned char* bitmap,
+                         Visitor* visitor) {
+    for (size_t i = 0; i < BITMAP_SIZE; ++i) {
+      for (unsigned bits = bitmap[i]; bits != 0; bits &= bits - 1) {
+        const uint64_t bucket =
+            g * GROUP_SIZE + i * 8 + count_trailing_zeros(bits);
+        if (!read_value(in, bucket, visitor)) return false;
+      }
+    }
+    return true;
+  }
+
+  template <typename INPUT, typename Visitor>
+  bool read_value(INPUT* in, uint64_t bucket, Visitor* visitor) {
+    if (num_read_ == info_.num_elements)
+      return fail("more elements than the header says");
+    if (!value_.empty() && !read_data(in, value_.data(), value_.size()))
+      return fail("truncated or corrupt at bucket %" PRIu64, bucket);
+    ++num_read_;
+    if (!(*visitor)(bucket, value_.data()))
+      return fail("can't write the output");
+    return true;
+  }
+
+  const char* path_;
+  uint32_t value_size_option_;
+  table_info info_;
+  std::string error_;
+  uint64_t num_read_;
+  std::vector<char> value_;
+  std::vector<unsigned char> bitmaps_;  // a sparse table's, while we need them
+};
+
+// Which buckets are full: a bit per bucket.
+class occupancy {
+ public:
+  occupancy() : num_buckets_(0) {}
+
+  bool begin(const table_info& info) {
+    num_buckets_ = info.num_buckets;
+    words_.assign((num_buckets_ + 63) / 64, 0);
+    return true;
+  }
+  bool operator()(uint64_t bucket, const char*) {
+    words_[bucket / 64] |= uint64_t(1) << (bucket % 64);
+    return true;
+  }
+
+  uint64_t num_buckets() const { return num_buckets_; }
+  bool test(uint64_t bucket) const {
+    return (words_[bucket / 64] >> (bucket % 64)) & 1;
+  }
+  uint64_t count(uint64_t first, uint64_t last) const {
+    uint64_t n = 0;
+    for (; first < last && first % 64 != 0; ++first) n += test(first);
+    for (; first + 64 <= last; first += 64) n += popcount(words_[first / 64]);
+    for (; first < last; ++first) n += test(first);
+    return n;
+  }
+  // Group g's bitmap, as sparsegroup keeps it.
+  void group_bitmap(uint64_t g, unsigned char* bitmap) const {
+    for (size_t i = 0; i < BITMAP_SIZE; ++i) {
+      const uint64_t bit = g * GROUP_SIZE + i * 8;  // a multiple of 8
+      bitmap[i] = bit < num_buckets_
+                      ? static_cast<unsigned char>(words_[bit / 64] >>
+                                                   (bit % 64))
+                      : 0;
+    }
+  }
+
+ private:
+  uint64_t num_buckets_;
+  std::vector<uint64_t> words_;
+};
+
+// ----- info ----
+
+void print_occupancy_report(const occupancy& occ, uint64_t num_regions) {
+  const uint64_t n = occ.num_buckets();
+  if (n == 0 || num_regions == 0) return;
+  if (num_regions > n) num_regions = n;
+  printf("occupancy by region:\n");
+  double lowest = 1, highest = 0;
+  for (uint64_t r = 0; r < num_regions; ++r) {
+    const uint64_t first = n / num_regions * r;
+    const uint64_t last = r + 1 == num_regions ? n : first + n / num_regions;
+    const double fill = double(occ.count(first, last)) / (last - first);
+    lowest = (std::min)(lowest, fill);
+    highest = (std::max)(highest, fill);
+    printf("  buckets %12" PRIu64 " - %-12" PRIu64 " %6.2f%%\n", first,
+           last - 1, 100 * fill);
+  }
+  printf("  lowest %.2f%%, highest %.2f%%\n", 100 * lowest, 100 * highest);
+
+  // The longest run of full buckets, and, for a key that isn't there,
+  // how many buckets find_position() would look at before reaching an
+  // empty one, starting from each bucket in turn: the same quadratic
+  // probe both tables use.
+  uint64_t longest_run = 0, run = 0;
+  for (uint64_t b = 0; b < n; ++b) {
+    run = occ.test(b) ? run + 1 : 0;
+    longest_run = (std::max)(longest_run, run);
+  }
+  std::vector<uint64_t> histogram(65);
+  uint64_t total_probes = 0, max_probes = 0;
+  const uint64_t mask = n - 1;
+  for (uint64_t start = 0; start < n; ++start) {
+    uint64_t probes = 1;
+    for (uint64_t b = start; occ.test(b) && probes <= n; ++probes)
+      b = (b + probes) & mask;
+    total_probes += probes;
+    max_probes = (std::max)(max_probes, probes);
+    int bin = 0;
+    while (probes >> (bin + 1)) ++bin;
+    ++histogram[bin];
+  }
+  printf("longest run of full buckets: %" PRIu64 "\n", longest_run);
+  printf("buckets probed looking up a missing key:\n");
+  for (int i = 0; i < 65; ++i) {
+    if (histogram[i] == 0) continue;
+    char range[48];
+    if (i == 0)
+      snprintf(range, sizeof(range), "1");
+    else
+      snprintf(range, sizeof(range), "%" PRIu64 " - %" PRIu64,
+               uint64_t(1) << i, (uint64_t(2) << i) - 1);
+    printf("  %-24s %6.2f%%\n", range, 100.0 * histogram[i] / n);
+  }
+  printf("  mean %.2f, most %" PRIu64 "\n", double(total_probes) / n,
+         max_probes);
+}
+
+void print_info(const table_info& info) {
+  printf("format:       %s, %s layout\n", format_name(info.format),
+         info.sparse ? "sparse" : "dense");
+  if (info.format != LEGACY)
+    printf("byte order:   %s-endian values\n",
+           info.flags & SNAPSHOT_LITTLE_ENDIAN ? "little" : "big");
+  if (info.key_size) printf("key size:     %" PRIu32 "\n", info.key_size);
+  if (info.value_size)
+    printf("value size:   %" PRIu32 "%s\n", info.value_size,
+           info.value_size_inferred ? " (from the size of the file)" : "");
+  if (info.value_align)
+    printf("value align:  %" PRIu32 "\n", info.value_align);
+  if (info.has_hasher_tag)
+    printf("hasher tag:   %016" PRIx64 "\n", info.hasher_tag);
+  printf("buckets:      %" PRIu64 "\n", info.num_buckets);
+  printf("elements:     %" PRIu64 "\n", info.num_elements);
+  if (info.num_buckets)
+    printf("load factor:  %.4f\n",
+           double(info.num_elements) / info.num_buckets);
+  if (info.format == DELTA) {
+    printf("epochs:       %" PRIu64 " -> %" PRIu64 "\n", info.from_epoch,
+           info.to_epoch);
+    printf("groups:       %" PRIu64 " changed\n", info.num_delta_groups);
+    printf("deleted:      %" PRIu64 "\n", info.num_deleted);
+  }
+}
+
+// ----- convert ----
+
+// Writes the buckets as dense_hashtable::serialize() does.
+template <typename OUTPUT>
+class dense_writer {
+ public:
+  explicit dense_writer(OUTPUT* out)
+      : out_(out), num_buckets_(0), base_(0), bits_(0), ok_(true) {}
+
+  bool begin(const table_info& info) {
+    num_buckets_ = info.num_buckets;
+    ok_ = write_bigendian_number(out_, DENSE_MAGIC, 4) &&
+          write_bigendian_number(out_, info.num_buckets, 8) &&
+          write_bigendian_number(out_, info.num_elements, 8);
+    value_size_ = info.value_size;
+    return ok_;
+  }
+  bool operator()(uint64_t bucket, const char* value) {
+    while (ok_ && bucket >= base_ + 8) flush();
+    bits_ |= static_cast<unsigned char>(1 << (bucket - base_));
+    values_.insert(values_.end(), value, value + value_size_);
+    return ok_;
+  }
+  bool finish() {
+    while (ok_ && base_ < num_buckets_) flush();
+    return ok_;
+  }
+
+ private:
+  void flush() {
+    ok_ = write_data(out_, &bits_, 1) &&
+          (values_.empty() || write_data(out_, values_.data(), values_.size()));
+    base_ += 8;
+    bits_ = 0;
+    values_.clear();
+  }
+
+  OUTPUT* out_;
+  uint64_t num_buckets_;
+  uint32_t value_size_;
+  uint64_t base_;  // the first bucket of bits_
+  unsigned char bits_;
+  std::vector<char> values_;
+  bool ok_;
+};
+
+// Writes the buckets as sparsetable::serialize() does.  The group
+// metadata comes first, so it has to know the occupancy beforehand.
+template <typename OUTPUT>
+class sparse_writer {
+ public:
+  sparse_writer(OUTPUT* out, const occupancy& occ) : out_(out), occ_(occ) {}
+
+  bool begin(const table_info& info) {
+    value_size_ = info.value_size;
+    if (!write_32_or_64(out_, SPARSE_MAGIC) ||
+        !write_32_or_64(out_, info.num_buckets) ||
+        !write_32_or_64(out_, info.num_elements))
+      return false;
+    for (uint64_t g = 0; g < num_groups(info.num_buckets); ++g) {
+      unsigned char bitmap[BITMAP_SIZE];
+      occ_.group_bitmap(g, bitmap);
+      if (!write_bigendian_number(out_, uint16_t(bitmap_popcount(bitmap)),
+                                  2) ||
+          !write_data(out_, bitmap, sizeof(bitmap)))
+        return false;
+    }
+    return true;
+  }
+  bool operator()(uint64_t, const char* value) {
+    return write_data(out_, value, value_size_);
+  }
+  bool finish() { return true; }
+
+ private:
+  OUTPUT* out_;
+  const occupancy& occ_;
+  uint32_t value_size_;
+};
+
+// Writes sparse_hashtable::serialize_mappable()'s layout.
+class mappable_writer {
+ public:
+  mappable_writer(FILE* out, const occupancy& occ, uint64_t hasher_tag,
+                  uint32_t value_align)
+      : out_(out), occ_(occ), hasher_tag_(hasher_tag),
+        value_align_(value_align) {}
+
+  bool begin(const table_info& info) {
+    const uint64_t n = num_groups(info.num_buckets);
+    mappable_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = MAPPABLE_MAGIC;
+    header.version = MAPPABLE_VERSION;
+    header.flags = info.flags;
+    header.value_size = value_size_ = info.value_size;
+    header.value_align = value_align_;
+    header.group_size = DEFAULT_GROUP_SIZE;
+    header.hasher_tag = hasher_tag_;
+    header.num_buckets = info.num_buckets;
+    header.num_elements = info.num_elements;
+    set_mappable_layout(&header, n, BITMAP_SIZE);
+    header.header_crc = header.compute_crc();
+    if (!write_data(out_, &header, sizeof(header))) return false;
+    for (uint64_t g = 0; g < n; ++g) {
+      unsigned char bitmap[BITMAP_SIZE];
+      occ_.group_bitmap(g, bitmap);
+      if (!write_data(out_, bitmap, sizeof(bitmap))) return false;
+    }
+    uint64_t written = sizeof(header) + n * BITMAP_SIZE;
+    if (!write_padding(out_, &written, header.offsets_offset)) return false;
+    uint64_t offset = 0;
+    for (uint64_t g = 0; g <= n; ++g) {
+      if (!write_data(out_, &offset, sizeof(offset))) return false;
+      offset += occ_.count(g * GROUP_SIZE,
+                           (std::min)((g + 1) * GROUP_SIZE, info.num_buckets));
+    }
+    written += 8 * (n + 1);
+    return write_padding(out_, &written, header.values_offset);
+  }
+  bool operator()(uint64_t, const char* value) {
+    return write_data(out_, value, value_size_);
+  }
+  bool finish() { return true; }
+
+ private:
+  FILE* out_;
+  const occupancy& occ_;
+  uint64_t hasher_tag_;
+  uint32_t value_align_;
+  uint32_t value_size_;
+};
+
+struct options {
+  uint32_t value_size;
+  uint32_t key_size;
+  bool has_hasher_tag;
+  uint64_t hasher_tag;
+  uint32_t value_align;
+  const char* layout;
+  const char* to;
+  uint64_t regions;
+};
+
+// Rereads the input into a writer.
+template <typename Writer>
+bool write_table(table_reader* reader, Writer* writer) {
+  return reader->scan(writer) && writer->finish();
+}
+
+template <typename OUTPUT>
+bool write_table(table_reader* reader, OUTPUT* out, bool sparse,
+                 const occupancy& occ) {
+  if (sparse) {
+    sparse_writer<OUTPUT> writer(out, occ);
+    return write_table(reader, &writer);
+  }
+  dense_writer<OUTPUT> writer(out);
+  return write_table(reader, &writer);
+}
+
+int convert(const options& opts, const char* in_path, const char* out_path) {
+  table_reader reader(in_path, opts.value_size);
+  occupancy occ;
+  if (!reader.scan(&occ)) {
+    fprintf(stderr, "%s: %s\n", in_path, reader.error().c_str());
+    return 1;
+  }
+  const table_info info = reader.info();
+  if (info.format == DELTA) {
+    fprintf(stderr, "%s: a delta isn't a table; apply it to its base\n",
+            in_path);
+    return 1;
+  }
+  const std::string to = opts.to ? opts.to : "";
+  const bool sparse = opts.layout ? strcmp(opts.layout, "sparse") == 0
+                                  : info.sparse;
+  const bool has_tag = opts.has_hasher_tag || info.has_hasher_tag;
+  const uint64_t tag = opts.has_hasher_tag ? opts.hasher_tag : info.hasher_tag;
+  const uint32_t key_size = opts.key_size ? opts.key_size : info.key_size;
+  if (to != "legacy" && to != "snapshot" && to != "mappable") {
+    fprintf(stderr, "--to must be legacy, snapshot or mappable\n");
+    return 1;
+  }
+  if (to != "legacy" && !has_tag) {
+    fprintf(stderr, "%s doesn't say what hashed it; use --hasher-tag\n",
+            in_path);
+    return 1;
+  }
+  if (to == "snapshot" && key_size == 0) {
+    fprintf(stderr, "%s doesn't give the key size; use --key-size\n",
+            in_path);
+    return 1;
+  }
+  // The value size doesn't tell us the alignment (a pair<const int, int>
+  // is 8 bytes aligned to 4), and a view won't open the wrong one.
+  const uint32_t align = opts.value_align ? opts.value_align
+                                          : info.value_align;
+  if (to == "mappable" && align == 0) {
+    fprintf(stderr, "%s doesn't give the value alignment; use --value-align\n",
+            in_path);
+    return 1;
+  }
+
+  std::unique_ptr<FILE, int (*)(FILE*)> out(fopen(out_path, "wb"), fclose);
+  if (!out) {
+    fprintf(stderr, "can't create %s\n", out_path);
+    return 1;
+  }
+  bool ok;
+  if (to == "legacy") {
+    ok = write_table(&reader, out.get(), sparse, occ);
+  } else if (to == "snapshot") {
+    snapshot_header header;
+    header.version = SNAPSHOT_VERSION;
+    header.flags = info.flags | (sparse ? SNAPSHOT_SPARSE : 0);
+    header.key_size = key_size;
+    header.value_size = info.value_size;
+    header.hasher_tag = tag;
+    header.num_buckets = info.num_buckets;
+    header.num_elements = info.num_elements;
+    header.chunk_size = SNAPSHOT_CHUNK_SIZE;
+    checksummed_writer<FILE> chunks(out.get());
+    ok = write_snapshot_header(out.get(), header) &&
+         write_table(&reader, &chunks, sparse, occ) && chunks.finish();
+  } else {
+    mappable_writer writer(out.get(), occ, tag, align);
+    ok = write_table(&reader, &writer);
+  }
+  if (fflush(out.get()) != 0) ok = false;
+  if (!ok) {
+    fprintf(stderr, "%s -> %s: %s\n", in_path, out_path,
+            reader.error().empty() ? "write failed" : reader.error().c_str());
+    return 1;
+  }
+  return 0;
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: snapshot_tool info [options] FILE\n"
+          "       snapshot_tool validate [options] FILE\n"
+          "       snapshot_tool convert --to=legacy|snapshot|mappable "
+          "[options] IN OUT\n"
+          "options: --value-size=N --key-size=N --hasher-tag=HEX "
+          "--value-align=N\n"
+          "         --layout=dense|sparse --regions=N\n");
+}
+
+// Reads all of value as a number in the given base, from 1 (0 for a
+// hasher tag) to max.  No sign, spaces or trailing characters.
+bool parse_number(const char* value, int base, uint64_t max, uint64_t* n) {
+  if (!isxdigit(static_cast<unsigned char>(*value))) return false;
+  char* end;
+  errno = 0;
+  *n = strtoull(value, &end, base);
+  return *end == '\0' && errno == 0 && *n <= max && (*n > 0 || base == 16);
+}
+
+bool parse_option(const char* arg, options* opts) {
+  const char* eq = strchr(arg, '=');
+  if (strncmp(arg, "--", 2) != 0 || eq == NULL) return false;
+  const std::string name(arg + 2, eq);
+  const char* value = eq + 1;
+  uint64_t n;
+  if (name == "value-size") {
+    if (!parse_number(value, 10, UINT32_MAX, &n)) return false;
+    opts->value_size = static_cast<uint32_t>(n);
+  } else if (name == "key-size") {
+    if (!parse_number(value, 10, UINT32_MAX, &n)) return false;
+    opts->key_size = static_cast<uint32_t>(n);
+  } else if (name == "hasher-tag") {
+    if (!parse_number(value, 16, UINT64_MAX, &n)) return false;
+    opts->has_hasher_tag = true;
+    opts->hasher_tag = n;
+  } else if (name == "value-align") {
+    if (!parse_number(value, 10, UINT32_MAX, &n) || (n & (n - 1)) != 0)
+      return false;  // alignments are powers of 2
+    opts->value_align = static_cast<uint32_t>(n);
+  } else if (name == "layout") {
+    opts->layout = value;
+    return strcmp(value, "dense") == 0 || strcmp(value, "sparse") == 0;
+  } else if (name == "to") {
+    opts->to = value;
+  } else if (name == "regions") {
+    return parse_number(value, 10, UINT64_MAX, &opts->regions);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+}  // unnamed namespace
+
+int main(int argc, char** argv) {
+  options opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.regions = 16;
+  std::vector<const char*> args;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--", 2) != 0) {
+      args.push_back(argv[i]);
+    } else if (!parse_option(argv[i], &opts)) {
+      fprintf(stderr, "bad option %s\n", argv[i]);
+      usage();
+      return 2;
+    }
+  }
+  if (args.empty()) {
+    usage();
+    return 2;
+  }
+  const std::string command = args[0];
+  if (command == "convert" && args.size() == 3)
+    return convert(opts, args[1], args[2]);
+  if ((command != "info" && command != "validate") || args.size() != 2) {
+    usage();
+    return 2;
+  }
+
+  table_reader reader(args[1], opts.value_size);
+  occupancy occ;
+  const bool ok = reader.scan(&occ);
+  if (!ok) {
+    printf("%s: %s\n", args[1], reader.error().c_str());
+    return 1;
+  }
+  if (command == "validate") {
+    printf("%s: ok\n", args[1]);
+    return 0;
+  }
+  print_info(reader.info());
+  if (reader.info().format != DELTA) print_occupancy_report(occ, opts.regions);
+  return 0;
+}
@@ -0,0 +1,291 @@
+// Copyright (c) 2010, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Runs snapshot_tool on what the tables write, and reads what it
+// converts back into tables and views.
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include <sparsehash/dense_hash_map>
+#include <sparsehash/sparse_hash_map>
+#include <sparsehash/sparse_hash_map_view>
+
+#ifdef SPARSEHASH_HAVE_MMAP  // for mkdtemp() and system()'s exit status
+#include <sys/wait.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+using google::dense_hash_map;
+using google::sparse_hash_map;
+using google::sparse_hash_map_view;
+
+namespace {
+
+// pair<const int, int> is 8 bytes aligned to 4, so the value size
+// alone doesn't give its alignment.
+typedef dense_hash_map<int, int> Dense;
+typedef sparse_hash_map<int, int> Sparse;
+typedef sparse_hash_map_view<int, int> View;
+
+const int kNumKeys = 10000;
+
+void SetKeys(Dense* m) {
+  m->set_empty_key(-1);
+  m->set_deleted_key(-2);
+}
+void SetKeys(Sparse* m) { m->set_deleted_key(-2); }
+
+// Every seventh int, less every tenth of those.
+template <class Map>
+void Fill(Map* m) {
+  SetKeys(m);
+  for (int i = 0; i < kNumKeys; i++) (*m)[i * 7] = i;
+  for (int i = 0; i < kNumKeys; i += 10) m->erase(i * 7);
+}
+
+template <class Map>
+void ExpectFilled(const Map& m) {
+  EXPECT_EQ(static_cast<size_t>(kNumKeys - kNumKeys / 10), m.size());
+  for (int i = 0; i < kNumKeys; i++) {
+    const auto it = m.find(i * 7);
+    if (i % 10 == 0) {
+      EXPECT_TRUE(it == m.end());
+    } else {
+      ASSERT_TRUE(it != m.end()) << i * 7;
+      EXPECT_EQ(i, it->second);
+    }
+  }
+}
+
+template <class Write>
+bool WriteFile(const string& path, Write write) {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == NULL) return false;
+  const bool ok = write(fp);
+  return fclose(fp) == 0 && ok;
+}
+
+template <class Map>
+bool ReadLegacy(const string& path, Map* m) {
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (fp == NULL) return false;
+  SetKeys(m);
+  const bool ok = m->unserialize(typename Map::NopointerSerializer(), fp);
+  fclose(fp);
+  return ok;
+}
+
+template <class Map>
+bool ReadSnapshot(const string& path, Map* m) {
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (fp == NULL) return false;
+  SetKeys(m);
+  const bool ok =
+      m->unserialize_snapshot(typename Map::NopointerSerializer(), fp);
+  fclose(fp);
+  return ok;
+}
+
+// Gives each test a directory, and cleans up the files made in it.
+class SnapshotToolTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char temp[] = "/tmp/sparsehash_toolXXXXXX";
+    ASSERT_TRUE(mkdtemp(temp) != NULL);
+    dir_ = temp;
+  }
+
+  void TearDown() override {
+    for (const string& path : paths_) unlink(path.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  string Path(const string& name) {
+    paths_.push_back(dir_ + "/" + name);
+    return paths_.back();
+  }
+
+  // Returns snapshot_tool's exit status.
+  static int Run(const string& args) {
+    const string command =
+        string(SNAPSHOT_TOOL) + " " + args + " >/dev/null 2>&1";
+    const int status = system(command.c_str());
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  }
+
+  // Writes m in each format it has, noting the options convert needs
+  // to fill in what the format doesn't record.
+  template <class Map>
+  void WriteFormats(Map* m, const string& name) {
+    typedef typename Map::NopointerSerializer Serializer;
+    char tag[64];
+    snprintf(tag, sizeof(tag), "--hasher-tag=%" PRIx64,
+             google::sparsehash_internal::snapshot_hasher_tag<
+                 typename Map::hasher, int>());
+    const string legacy = Path(name + ".legacy");
+    ASSERT_TRUE(WriteFile(legacy, [m](FILE* fp) {
+      return m->serialize(Serializer(), fp);
+    }));
+    inputs_.push_back(
+        Input(legacy, string(tag) + " --key-size=4 --value-align=4"));
+    const string snapshot = Path(name + ".snapshot");
+    ASSERT_TRUE(WriteFile(snapshot, [m](FILE* fp) {
+      return m->serialize_snapshot(Serializer(), fp);
+    }));
+    inputs_.push_back(Input(snapshot, "--value-align=4"));
+    const string parallel = Path(name + ".parallel");
+    ASSERT_TRUE(WriteFile(parallel, [m](FILE* fp) {
+      return m->serialize_parallel(Serializer(), fp, 4);
+    }));
+    inputs_.push_back(Input(parallel, "--value-align=4"));
+  }
+
+  void WriteMappable(Sparse* m, const string& name) {
+    const string mappable = Path(name);
+    ASSERT_TRUE(WriteFile(mappable, [m](FILE* fp) {
+      return m->serialize_mappable(fp);
+    }));
+    inputs_.push_back(Input(mappable, "--key-size=4"));
+  }
+
+  struct Input {
+    Input(const string& p, const string& o) : path(p), options(o) {}
+    string path;
+    string options;
+  };
+
+  string dir_;
+  vector<string> paths_;
+  vector<Input> inputs_;
+};
+
+TEST_F(SnapshotToolTest, ConvertsEveryFormat) {
+  Dense dense;
+  Fill(&dense);
+  Sparse sparse;
+  Fill(&sparse);
+  WriteFormats(&dense, "dense");
+  WriteFormats(&sparse, "sparse");
+  WriteMappable(&sparse, "sparse.mappable");
+  ASSERT_EQ(7u, inputs_.size());
+
+  for (const Input& in : inputs_) {
+    SCOPED_TRACE(in.path);
+    EXPECT_EQ(0, Run("validate " + in.path));
+    EXPECT_EQ(0, Run("info " + in.path));
+
+    const string to_dense = Path("out.dense");
+    ASSERT_EQ(0, Run("convert --to=legacy --layout=dense " + in.path + " " +
+                     to_dense));
+    EXPECT_EQ(0, Run("validate " + to_dense));
+    Dense dense_legacy;
+    EXPECT_TRUE(ReadLegacy(to_dense, &dense_legacy));
+    ExpectFilled(dense_legacy);
+
+    const string to_sparse = Path("out.sparse");
+    ASSERT_EQ(0, Run("convert --to=legacy --layout=sparse " + in.path + " " +
+                     to_sparse));
+    Sparse sparse_legacy;
+    EXPECT_TRUE(ReadLegacy(to_sparse, &sparse_legacy));
+    ExpectFilled(sparse_legacy);
+
+    const string snapshot = Path("out.snapshot");
+    for (const char* layout : {"dense", "sparse"}) {
+      ASSERT_EQ(0, Run("convert --to=snapshot --layout=" + string(layout) +
+                       " " + in.options + " " + in.path + " " + snapshot));
+      EXPECT_EQ(0, Run("validate " + snapshot));
+      if (string(layout) == "dense") {
+        Dense m;
+        EXPECT_TRUE(ReadSnapshot(snapshot, &m));
+        ExpectFilled(m);
+      } else {
+        Sparse m;
+        EXPECT_TRUE(ReadSnapshot(snapshot, &m));
+        ExpectFilled(m);
+      }
+    }
+
+    const string mappable = Path("out.mappable");
+    ASSERT_EQ(0, Run("convert --to=mappable " + in.options + " " + in.path +
+                     " " + mappable));
+    EXPECT_EQ(0, Run("validate " + mappable));
+    View view;
+    ASSERT_TRUE(view.open_file(mappable.c_str()));
+    ExpectFilled(view);
+  }
+}
+
+TEST_F(SnapshotToolTest, RefusesWhatItCantConvert) {
+  Sparse sparse;
+  Fill(&sparse);
+  WriteFormats(&sparse, "sparse");
+  const string legacy = inputs_[0].path;
+  const string snapshot = inputs_[1].path;
+  const string out = Path("out");
+
+  // A legacy file records no hasher tag or key size, and only a
+  // mappable file records the value alignment.
+  EXPECT_EQ(1, Run("convert --to=snapshot --key-size=4 " + legacy + " " +
+                   out));
+  EXPECT_EQ(1, Run("convert --to=snapshot --hasher-tag=1 " + legacy + " " +
+                   out));
+  EXPECT_EQ(1, Run("convert --to=mappable " + snapshot + " " + out));
+  EXPECT_EQ(1, Run("convert --to=json " + snapshot + " " + out));
+
+  // Options that aren't all number, or are out of range.
+  for (const char* option :
+       {"--value-size=abc", "--value-size=8x", "--value-size=0",
+        "--key-size=-4", "--hasher-tag=xyz", "--value-align=3",
+        "--value-align=0", "--regions=0", "--layout=wide", "--color=red"}) {
+    EXPECT_EQ(2, Run("validate " + string(option) + " " + snapshot))
+        << option;
+  }
+  EXPECT_EQ(0, Run("validate --value-align=4 --regions=2 " + snapshot));
+
+  // A damaged file fails validation.
+  FILE* fp = fopen(snapshot.c_str(), "r+b");
+  ASSERT_TRUE(fp != NULL);
+  fseek(fp, 100, SEEK_SET);
+  const int c = fgetc(fp);
+  fseek(fp, 100, SEEK_SET);
+  fputc(c ^ 1, fp);
+  fclose(fp);
+  EXPECT_EQ(1, Run("validate " + snapshot));
+}
+
+}  // unnamed namespace
+
+#endif  // SPARSEHASH_HAVE_MMAP
@@ -33,6 +33,7 @@
 
 #include <memory>     // for allocator
 #include <algorithm>  // for swap
+#include <sstream>
 #include <string>
 #include <vector>
 #include <cstdio>
@@ -388,6 +389,25 @@ TEST(Sparsetable, Int) {
     ASSERT_THAT(y, ContainerEq(y2));
     ASSERT_EQ(12UL, y2.num_nonempty());
   }
+
+  // ----------------------------------------------------------------------
+  // The nopointer paths work with streams too, not just FILE*.
+
+  {
+    std::stringstream ss;
+    y.write_metadata(&ss);
+    y.write_nopointer_data(&ss);
+    ss << "trailer";
+
+    sparsetable<int> y2;
+    ASSERT_TRUE(y2.read_metadata(&ss));
+    ASSERT_TRUE(y2.read_nopointer_data(&ss));
+    ASSERT_THAT(y, ContainerEq(y2));
+
+    std::string trailer;  // left alone by the reads above
+    ss >> trailer;
+    ASSERT_EQ("trailer", trailer);
+  }
 }
 
 // An instrumented allocator that keeps track of all calls to
@@ -0,0 +1,142 @@
+// Copyright (c) 2010, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+//
+// Records the operations a program does on a hash map, so that bench
+// (--workload=trace --trace=FILE) can replay them against each of the
+// maps.  Copy this header into the program, and call the recorder next
+// to each operation on the map:
+//
+//    TraceRecorder trace("ops.trace");
+//    m[k] = v;      trace.insert(k, v);
+//    m.find(k);     trace.find(k);
+//    m.erase(k);    trace.erase(k);
+//
+// Keys and values are 64-bit integers; a program whose keys are
+// anything else can record an id for each, such as a 64-bit hash.  The
+// recorder is for one thread: it does no locking.
+//
+// The file holds kTraceMagic, then a record per operation: the op, as
+// a byte; the key (or, for a resize, the size asked for) as 8 bytes,
+// least significant first; and, for an insert, the value the same way.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static const char kTraceMagic[8] = {'S', 'H', 'T', 'R', 'A', 'C', 'E', '1'};
+
+enum TraceOp {
+  TRACE_INSERT = 1,  // m[key] = value
+  TRACE_FIND = 2,
+  TRACE_ERASE = 3,
+  TRACE_CLEAR = 4,
+  TRACE_RESIZE = 5,  // m.resize(key)
+};
+
+struct TraceRecord {
+  TraceOp op;
+  uint64_t key;
+  uint64_t value;  // for inserts only
+};
+
+class TraceRecorder {
+ public:
+  explicit TraceRecorder(const char* path) : fp_(fopen(path, "wb")) {
+    if (fp_) fwrite(kTraceMagic, sizeof(kTraceMagic), 1, fp_);
+  }
+  ~TraceRecorder() {
+    if (fp_) fclose(fp_);
+  }
+
+  // False if the file couldn't be opened or written.
+  bool ok() const { return fp_ && !ferror(fp_); }
+
+  void insert(uint64_t key, uint64_t value) {
+    Put(TRACE_INSERT, key);
+    Put64(value);
+  }
+  void find(uint64_t key) { Put(TRACE_FIND, key); }
+  void erase(uint64_t key) { Put(TRACE_ERASE, key); }
+  void clear() { Put(TRACE_CLEAR, 0); }
+  void resize(uint64_t size) { Put(TRACE_RESIZE, size); }
+
+ private:
+  void Put(TraceOp op, uint64_t key) {
+    if (!fp_) return;
+    putc(op, fp_);
+    Put64(key);
+  }
+  void Put64(uint64_t x) {
+    if (!fp_) return;
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++) {
+      bytes[i] = static_cast<unsigned char>(x >> (8 * i));
+    }
+    fwrite(bytes, sizeof(bytes), 1, fp_);
+  }
+
+  FILE* fp_;
+
+  TraceRecorder(const TraceRecorder&);
+  void operator=(const TraceRecorder&);
+};
+
+// Reads a whole trace into records.  Returns false if the file can't be
+// read, isn't a trace, or ends partway through a record.
+inline bool ReadTrace(const char* path, std::vector<TraceRecord>* records) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) return false;
+  char magic[sizeof(kTraceMagic)];
+  bool ok = fread(magic, sizeof(magic), 1, fp) == 1 &&
+            memcmp(magic, kTraceMagic, sizeof(magic)) == 0;
+  records->clear();
+  int op;
+  while (ok && (op = getc(fp)) != EOF) {
+    unsigned char bytes[16];
+    const size_t length = op == TRACE_INSERT ? 16 : 8;
+    if (op < TRACE_INSERT || op > TRACE_RESIZE ||
+        fread(bytes, length, 1, fp) != 1) {
+      ok = false;
+      break;
+    }
+    TraceRecord record = {static_cast<TraceOp>(op), 0, 0};
+    for (int i = 0; i < 8; i++) {
+      record.key |= uint64_t(bytes[i]) << (8 * i);
+      if (length == 16) record.value |= uint64_t(bytes[8 + i]) << (8 * i);
+    }
+    records->push_back(record);
+  }
+  fclose(fp);
+  return ok;
+}